@@ -0,0 +1 @@
+../library/ComplementaryAHRS.cpp
\ No newline at end of file
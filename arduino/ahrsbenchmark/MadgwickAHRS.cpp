@@ -0,0 +1 @@
+../library/MadgwickAHRS.cpp
\ No newline at end of file
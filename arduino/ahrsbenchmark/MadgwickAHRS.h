@@ -0,0 +1 @@
+../library/MadgwickAHRS.h
\ No newline at end of file
@@ -0,0 +1 @@
+../library/MadgwickFixedAHRS.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../library/MadgwickFixedAHRS.h
\ No newline at end of file
@@ -0,0 +1,97 @@
+//-*- mode: c -*-
+/* 
+ * NAME
+ *     ahrsbenchmark.ino
+ * PURPOSE
+ *     Times the orientation filters Ahrs can use (see FILTER SELECTION in library/Ahrs.h) on the real hardware.
+ *     Load it on a Nano, open the serial monitor (19200), and it prints the cost of each, then does it again on any input line.
+ *     Accuracy is a separate question - see tools/ahrsbench.cpp, which runs the filters over a recording on the host.
+ * PROTOCOL TO HOST
+ *     "I <filter> update <cycles> updateIMU <cycles>" - CPU cycles per call, averaged over BENCHMARK_CALLS calls.
+ * RESULTS
+ *     None recorded yet. Once it has been run on a Nano, put the figures here and in FILTER SELECTION in library/Ahrs.h.
+ * DEPENDENCIES
+ *     MadgwickAHRS, MadgwickFixedAHRS, MahonyAHRS, ComplementaryAHRS
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <Arduino.h>
+
+#include "MadgwickAHRS.h"
+#include "MahonyAHRS.h"
+#include "ComplementaryAHRS.h"
+#include "MadgwickFixedAHRS.h"
+
+#define BENCHMARK_CALLS 200     /* micros() only counts in 4us steps, so time plenty of calls */
+#define SAMPLE_FREQ     190.0   /* The LSM9DS0 gyro rate, as Ahrs runs it */
+
+// Volatile, so the compiler can't fold the inputs into the filter code. Roughly a rover sitting level, turning slowly.
+volatile float gx = 0.5, gy = -0.3, gz = 12.0;
+volatile float ax = 0.1, ay = -0.2, az = 9.8;
+volatile float mx = 0.2, my = -0.05, mz = -0.4;
+volatile float sink;
+
+// Cycles for the loop and the volatile reads alone, taken off each filter's time.
+uint32_t overheadUs = 0;
+
+uint32_t cycles(uint32_t us) {
+    return (us > overheadUs ? us - overheadUs : 0) * (F_CPU / 1000000L) / BENCHMARK_CALLS;
+}
+
+uint32_t timeOverhead() {
+    uint32_t startedAt = micros();
+    for (int i = 0; i < BENCHMARK_CALLS; i++) {
+        ax = -ax;
+        sink = gx; sink = gy; sink = gz; sink = ax; sink = ay; sink = az; sink = mx; sink = my; sink = mz;
+    }
+    return micros() - startedAt;
+}
+
+template <class FILTER> void benchmark(const char *name) {
+    FILTER filter;
+    filter.begin(SAMPLE_FREQ);
+    // Accel changes every call here, so MadgwickFixed normalises it (in float) every time - its worst case. In Ahrs it only
+    // does that once a batch. Similarly, the Complementary filter only does its tilt trig every 20ms, which this hides.
+    uint32_t startedAt = micros();
+    for (int i = 0; i < BENCHMARK_CALLS; i++) {
+        ax = -ax;
+        filter.updateIMU(gx, gy, gz, ax, ay, az);
+    }
+    uint32_t updateImuUs = micros() - startedAt;
+    startedAt = micros();
+    for (int i = 0; i < BENCHMARK_CALLS; i++) {
+        ax = -ax;
+        filter.update(gx, gy, gz, ax, ay, az, mx, my, mz);
+    }
+    uint32_t updateUs = micros() - startedAt;
+    Serial.print("I "); Serial.print(name);
+    Serial.print(" update "); Serial.print(cycles(updateUs));
+    Serial.print(" cycles updateIMU "); Serial.print(cycles(updateImuUs));
+    Serial.print(" cycles (yaw "); Serial.print(filter.getYaw()); // Use the result, so none of it is optimised away.
+    Serial.println(")");
+}
+
+void runBenchmarks() {
+    overheadUs = timeOverhead();
+    benchmark<Madgwick>("Madgwick");
+    benchmark<MadgwickFixed>("MadgwickFixed");
+    benchmark<Mahony>("Mahony");
+    benchmark<Complementary>("Complementary");
+}
+
+void setup() {
+    delay(2000);
+    Serial.begin(19200);
+    while (!Serial) delay(1);
+    Serial.println("I ahrsbenchmark");
+    runBenchmarks();
+}
+
+void loop() {
+    if (Serial.available()) {
+        while (Serial.available())
+            Serial.read();
+        runBenchmarks();
+    }
+}
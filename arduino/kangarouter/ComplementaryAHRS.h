@@ -0,0 +1 @@
+../library/ComplementaryAHRS.h
\ No newline at end of file
@@ -0,0 +1 @@
+../library/I2cBus.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../library/I2cWire.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../library/I2cWire.h
\ No newline at end of file
@@ -0,0 +1 @@
+../library/MagCalibration.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../library/MagCalibration.h
\ No newline at end of file
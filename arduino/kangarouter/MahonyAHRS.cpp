@@ -0,0 +1 @@
+../library/MahonyAHRS.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../library/MahonyAHRS.h
\ No newline at end of file
@@ -0,0 +1 @@
+../library/PowerCurve.cpp
\ No newline at end of file
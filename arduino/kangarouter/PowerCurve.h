@@ -0,0 +1 @@
+../library/PowerCurve.h
\ No newline at end of file
@@ -21,7 +21,8 @@
  * PIN ASSIGNMENTS
  *   0 - RX
  *   1 - TX
- *   2 -
+ *   2 - IMU DRDY_G (LSM9DS0 gyro data ready) - optional (see IMU_DRDY_PIN). Without it the Ahrs polls the gyro FIFO
+ *       every 20ms instead of reading as samples arrive - every sample still gets through, just timed less exactly.
  *   3 - Left motor  speed
  *   4 - Left motor  direction
  *   5 - Right motor speed
@@ -48,8 +49,15 @@ Blinker blinker(13);
 HoverboardDrive drive(false, true, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12);
 Lsm9ds0Imu imu;
 //Lsm9ds1Imu imu;
-Ahrs ahrs(&imu);
+Ahrs<Lsm9ds0Imu> ahrs(&imu);
+//Ahrs<Lsm9ds1Imu> ahrs(&imu);
+//Ahrs<Lsm9ds0Imu, MadgwickFixed> ahrs(&imu); // Lighter filters - see FILTER SELECTION in Ahrs.h.
+//Ahrs<Lsm9ds0Imu, Mahony> ahrs(&imu);
+//Ahrs<Lsm9ds0Imu, Complementary> ahrs(&imu);
 Helm helm(&ahrs, &drive, 50, 1000);
+#define IMU_DRDY_PIN 2 /* DRDY_G is wired to D2. Comment this out if it isn't. */
+
+uint32_t feedingPattern = BLINK_PATTERN_13; // Blinker pattern while the IMU is healthy. Setup complete, but never fed.
 
 void setup() {
     delay(1000);
@@ -59,13 +67,16 @@ void setup() {
     delay(1000);
     blinker.setup();
     imu.setup();
+#ifdef IMU_DRDY_PIN
+    imu.useDataReadyPin(IMU_DRDY_PIN, digitalPinToInterrupt(IMU_DRDY_PIN));
+#endif
+    imu.setDrive(&drive);       // Only learn the gyro bias when the motors are off.
     imu.setReportInterval(0);   // Not actually interested in IMU report
     ahrs.setup();
     ahrs.setReportInterval(200);
     drive.setup();
     helm.setup();
     Serial.println("KI Kangarouter setup complete");
-    blinker.setBlinkPattern(BLINK_PATTERN_13); // Setup complete, but never fed.
 }
 
 // The loop routine runs over and over again forever.
@@ -77,6 +88,8 @@ void loop() {
     helm.loop(now);
     blinker.loop(now);
     checkCommandInput(now);
+    // IMU trouble (see "UH") shows for as long as it lasts, then we're back to how well we're being fed.
+    blinker.setBlinkPattern(imu.getHealth() != 0 ? BLINK_PATTERN_32 : feedingPattern);
 }
 
 #define MAX_COMMAND_LENGTH 32 /* The maximum length of a command line from the host */
@@ -95,12 +108,12 @@ void checkCommandInput(uint32_t now) {
             drive.command(commandLine);
             helm.command(commandLine);
             commandLinePopulation = 0;
-            blinker.setBlinkPattern(BLINK_PATTERN_22); // We are being fed.
+            feedingPattern = BLINK_PATTERN_22; // We are being fed.
             lastCommandReadAt = now;
         } else
             commandLine[commandLinePopulation++] = b;
     } else {
         if (now - lastCommandReadAt > 5000)
-            blinker.setBlinkPattern(BLINK_PATTERN_21); // We are hungry.
+            feedingPattern = BLINK_PATTERN_21; // We are hungry.
     }
 }
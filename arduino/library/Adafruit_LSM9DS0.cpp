@@ -407,8 +407,12 @@ byte Adafruit_LSM9DS0::readBuffer(boolean type, byte reg, byte len, uint8_t *buf
 #else
       _wire->beginTransmission(address);
       _wire->write(reg);
-      _wire->endTransmission();
-      _wire->requestFrom(address, (byte)len);
+      if (_wire->endTransmission(false) != 0) { // No STOP: the register and the read go as one transaction (I2cWire).
+        return 0;
+      }
+      if (_wire->requestFrom(address, (byte)len) != len) {
+        return 0;
+      }
 #endif
 
     for (uint8_t i=0; i<len; i++) {
@@ -424,7 +424,9 @@ byte Adafruit_LSM9DS1::readBuffer(boolean type, byte reg, byte len, uint8_t *buf
   if (_i2c) {
     _wire->beginTransmission(address);
     _wire->write(reg);
-    _wire->endTransmission();
+    if (_wire->endTransmission(false) != 0) { // No STOP: the register and the read go as one transaction (I2cWire).
+      return 0;
+    }
     if (_wire->requestFrom(address, (byte)len) != len) {
       return 0;
     }
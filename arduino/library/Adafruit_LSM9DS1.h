@@ -20,7 +20,7 @@
 #else
  #include "WProgram.h"
 #endif
-#include "Wire.h"
+#include "I2cWire.h" // Not <Wire.h> - see I2cWire.h
 #include <SPI.h>
 #include "Adafruit_Sensor.h"
 
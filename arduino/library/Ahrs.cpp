@@ -14,15 +14,17 @@
 
 #include <stdio.h>
 
-#define IMU_SAMPLE_RATE_MS 50
+#define IMU_SAMPLE_RATE_MS 50 /* Read interval for an IMU which doesn't batch (one sample per read) */
+#define IMU_BATCH_RATE_MS  20 /* Read interval for an IMU which batches - often enough that its batches stay small */
+#define IMU_BACKSTOP_MS   100 /* With data-ready, read at least this often anyway */
 
-//void Ahrs::printFloat(float f) {
+//void AhrsBase::printFloat(float f) {
 //    char buffer[9];
 //    dtostrf(f, 8, 2, buffer);
 //    Serial.print(buffer);
 //}
 
-//void Ahrs::printStatus() {
+//void AhrsBase::printStatus() {
 //    
 //    Serial.print("D ");
 //    /*
@@ -50,36 +52,261 @@
  * PREREQUISITE: Serial.begin(...) must be called before this.
  * PREREQUISITE: imu::setup must be called before this.
  */
-void Ahrs::setup() {
+void AhrsBase::setup() {
     Serial.println("OI Ahrs ready.");
-    filter.begin(1000 / IMU_SAMPLE_RATE_MS);
+    uint32_t samplePeriodUs = imu->getSamplePeriodUs();
+    if (samplePeriodUs > 0) {
+        nominalDt = samplePeriodUs / 1000000.0;  // Every queued sample is one sample period apart.
+        imuReadIntervalMs = IMU_BATCH_RATE_MS;
+        samplesPerRead = max(1, (int) (IMU_BATCH_RATE_MS * 1000L / samplePeriodUs));
+    } else {
+        nominalDt = IMU_SAMPLE_RATE_MS / 1000.0;
+        imuReadIntervalMs = IMU_SAMPLE_RATE_MS;
+    }
+    setAccelTolerance(AHRS_ACCEL_TOLERANCE_PERCENT);
+    setMagTolerance(AHRS_MAG_TOLERANCE_PERCENT);
+    setTiltLimit(AHRS_TILT_LIMIT_DEGREES);
+    setImpactLimit(AHRS_IMPACT_MPS2);
+}
+
+/**
+ * Readings with |a| within percent of 1g pass accelerationUndisturbed(). Squared, so the check needs no sqrt.
+ * @param percent 0 => no check.
+ */
+void AhrsBase::setAccelTolerance(byte percent) {
+    accelGated = percent > 0;
+    float lo = AHRS_GRAVITY * (100 - min(percent, (byte) 99)) / 100.0;
+    float hi = AHRS_GRAVITY * (100 + percent) / 100.0;
+    accelLimits[0] = lo * lo;
+    accelLimits[1] = hi * hi;
+}
+
+/**
+ * Readings with |m| within percent of the usual field strength pass magneticUndisturbed().
+ * @param percent 0 => no check.
+ */
+void AhrsBase::setMagTolerance(byte percent) {
+    magGated = percent > 0;
+    float lo = (100 - min(percent, (byte) 99)) / 100.0;
+    float hi = (100 + percent) / 100.0;
+    magLimits[0] = lo * lo;
+    magLimits[1] = hi * hi;
+}
+
+/**
+ * Called by Ahrs<IMU>::loop() once a batch, with the (healthy) accelerometer reading.
+ * @return false if it's too far from 1g to be gravity alone - or was, less than AHRS_DISTURBANCE_HOLD_MS ago.
+ */
+byte AhrsBase::accelerationUndisturbed(float ax, float ay, float az, uint32_t now) {
+    if (!accelGated)
+        return true;
+    float squared = ax * ax + ay * ay + az * az;
+    if (squared < accelLimits[0] || squared > accelLimits[1])
+        accelHeldUntil = now + AHRS_DISTURBANCE_HOLD_MS;
+    else if ((int32_t) (now - accelHeldUntil) >= 0)
+        return true;
+    if (accelRejected < 0xFFFF)
+        accelRejected++;
+    return false;
+}
+
+/**
+ * Called by Ahrs<IMU>::loop() with each fresh (healthy) magnetometer reading.
+ * Every reading goes into the usual field strength, disturbed or not, so that a lasting change (a new place, something
+ * bolted on) is taken as normal after a while; a passing one hardly moves it.
+ * @return false if it's too far from the usual strength - or was, less than AHRS_DISTURBANCE_HOLD_MS ago.
+ */
+byte AhrsBase::magneticUndisturbed(float mx, float my, float mz, uint32_t now) {
+    float squared = mx * mx + my * my + mz * mz;
+    if (fieldSquared == 0.0) {
+        fieldSquared = squared;
+        return true;
+    }
+    float ratio = squared / fieldSquared;
+    fieldSquared += (squared - fieldSquared) / AHRS_FIELD_AVERAGE;
+    if (!magGated)
+        return true;
+    if (ratio < magLimits[0] || ratio > magLimits[1])
+        magHeldUntil = now + AHRS_DISTURBANCE_HOLD_MS;
+    else if ((int32_t) (now - magHeldUntil) >= 0)
+        return true;
+    if (magRejected < 0xFFFF)
+        magRejected++;
+    return false;
+}
+
+void AhrsBase::reportDisturbances() {
+    Serial.print("OD");
+    Serial.print(accelRejected); Serial.print(" ");
+    Serial.print(magRejected); Serial.print(" ");
+    Serial.println((int) (sqrt(fieldSquared) * 1000.0));
+}
+
+/**
+ * Tilt beyond degrees from level raises AHRS_EVENT_TILT. Kept as cosines, so the check needs no trig.
+ * @param degrees 0 => never.
+ */
+void AhrsBase::setTiltLimit(byte degrees) {
+    tiltChecked = degrees > 0;
+    tiltLimitCos = cos(degrees / 57.29578f);
+    tiltReleaseCos = cos(max(degrees - AHRS_TILT_HYSTERESIS_DEGREES, 0) / 57.29578f);
+    tilted = false;
+}
+
+/**
+ * Linear acceleration beyond mps2 raises AHRS_EVENT_IMPACT.
+ * @param mps2 0 => never.
+ */
+void AhrsBase::setImpactLimit(byte mps2) {
+    impactSquared = (float) mps2 * mps2;
+}
+
+/**
+ * Called by Ahrs<IMU>::loop() after updated(), with the batch's raw accelerometer reading (m/s^2, NWU).
+ * Up, in the sensor frame, is the third row of the quaternion's rotation matrix - the same vector Madgwick compares the
+ * accelerometer with - and the accelerometer reads +1g along it when still.
+ */
+void AhrsBase::sensed(float ax, float ay, float az, byte accelerationHealthy, uint32_t now) {
+    float *q = getQuaternion();
+    float upX = 2.0f * (q[1] * q[3] - q[0] * q[2]);
+    float upY = 2.0f * (q[0] * q[1] + q[2] * q[3]);
+    float upZ = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]; // cos(tilt)
+    uint32_t atUs = imu->getSampleTimestampUs();
+    if (tiltChecked) {
+        if (!tilted && upZ < tiltLimitCos) {
+            tilted = true;
+            events |= AHRS_EVENT_TILT;
+            eventAtUs[0] = atUs;
+            Serial.print("OET"); Serial.print(atUs); Serial.print(" ");
+            Serial.println((int) (acos(constrain(upZ, -1.0f, 1.0f)) * 57.29578f));
+        } else if (tilted && upZ > tiltReleaseCos)
+            tilted = false;
+    }
+    if (!accelerationHealthy)
+        return;
+    linear[0] = ax - upX * AHRS_GRAVITY;
+    linear[1] = ay - upY * AHRS_GRAVITY;
+    linear[2] = az - upZ * AHRS_GRAVITY;
+    if (impactSquared > 0.0 && (int32_t) (now - impactHeldUntil) >= 0) {
+        float squared = linear[0] * linear[0] + linear[1] * linear[1] + linear[2] * linear[2];
+        if (squared > impactSquared) {
+            impactHeldUntil = now + AHRS_IMPACT_HOLD_MS;
+            events |= AHRS_EVENT_IMPACT;
+            eventAtUs[1] = atUs;
+            Serial.print("OEI"); Serial.print(atUs); Serial.print(" ");
+            Serial.println((long) (sqrt(squared) * 1000.0));
+        }
+    }
+}
+
+void AhrsBase::reportLinear() {
+    Serial.print("OL");
+    for (byte i = 0; i < 3; i++) {
+        if (i > 0) Serial.print(" ");
+        Serial.print((long) (linear[i] * 1000.0));
+    }
+    Serial.println();
+}
+
+/**
+ * Called by Ahrs<IMU>::loop(). With data-ready (and edges actually coming - see Imu DATA READY), when enough samples are
+ * waiting; otherwise on the schedule.
+ */
+byte AhrsBase::readDue(uint32_t now) {
+    if (imu->dataReadyLive())
+        return imu->samplesWaiting() >= samplesPerRead || now - lastImuReadAt >= IMU_BACKSTOP_MS;
+    return now - lastImuReadAt >= (uint32_t) imuReadIntervalMs;
+}
+
+/**
+ * Called by Ahrs<IMU>::loop() just after reading.
+ * @return seconds between samples, from the time since the last read's latest sample.
+ */
+float AhrsBase::sampleDt(byte samples) {
+    if (samples == 0)
+        return nominalDt;
+    uint32_t at = imu->getSampleTimestampUs();
+    if (timed && at == lastSampleAtUs) {
+        // New samples, but the data-ready timestamp hasn't moved - it has stalled. Time them by the read instead.
+        imu->untimed(samples);
+        at = micros();
+    }
+    uint32_t elapsedUs = at - lastSampleAtUs;
+    byte wasTimed = timed;
+    lastSampleAtUs = at;
+    timed = true;
+    if (!wasTimed || elapsedUs == 0 || elapsedUs > AHRS_MAX_DT_US)
+        return nominalDt;
+    return elapsedUs / 1000000.0 / samples;
 }
 
 /**
- * Called by the Arduino library continually after setup().
- */
-void Ahrs::loop(uint32_t now) {
-    if(now < nextImuReadAt)
-        return; // Nothing to do
-    imu->readSensor();  /* Ask IMU to read in current data */ 
-    filter.update(imu->gyro[0],imu->gyro[1], imu->gyro[2], imu->acceleration[0], imu->acceleration[1], imu->acceleration[2], imu->magnetic[0], imu->magnetic[1], imu->magnetic[1]); // XYZ==NWU.
-    rpy[0] = (int) filter.getRoll();               // deg +ve -> left wing up.
-    rpy[1] = (int) -filter.getPitch();             // deg +ve -> nose up 
-    rpy[2] = ((int) -filter.getYaw() + 540) % 360; // deg CW of (magnetic) North
-    dRpy[0] = (int) imu->gyro[0];                  // d-roll/dt  deg/s
-    dRpy[1] = (int) imu->gyro[1];                  // d-pitch/dt deg/s
-    dRpy[2] = (int) -imu->gyro[2];                 // d-yaw/dt   deg/s CW
-    nextImuReadAt = now + IMU_SAMPLE_RATE_MS;
+ * Called by Ahrs<IMU>::loop() once the batch has been through the filter.
+ * No trig here - see LAZY ANGLES.
+ */
+void AhrsBase::updated(uint32_t now) {
+    quaternionFresh = false;
+    rpyFresh = false;
+    yawFresh = false;
+    dRpy[0] = (int) imu->getGyro(0);               // d-roll/dt  deg/s
+    dRpy[1] = (int) imu->getGyro(1);               // d-pitch/dt deg/s
+    dRpy[2] = (int) -imu->getGyro(2);              // d-yaw/dt   deg/s CW
+    lastImuReadAt = now;
     if (reportIntervalMs > 0 && now >= nextReportAt) {
         report();
         nextReportAt = now + reportIntervalMs;
     }
 }
 
+float *AhrsBase::getQuaternion() {
+    if (!quaternionFresh) {
+        filterQuaternion(q);
+        quaternionFresh = true;
+    }
+    return q;
+}
+
+/**
+ * Madgwick's yaw (atan2f(q1q2 + q0q3, 0.5 - q2q2 - q3q3) - CCW, NWU), turned into centidegrees CW of North.
+ */
+int32_t AhrsBase::getYawCentidegrees() {
+    if (!yawFresh) {
+        float *q = getQuaternion();
+        float yaw = atan2f(q[1] * q[2] + q[0] * q[3], 0.5f - q[2] * q[2] - q[3] * q[3]); // radians CCW, [-pi .. pi]
+        yawCd = ((int32_t) (-yaw * 5729.578f) + 36000L) % 36000L;
+        yawFresh = true;
+    }
+    return yawCd;
+}
+
+/**
+ * Roll and pitch as Madgwick's computeAngles(), then flipped to NWD.
+ */
+int *AhrsBase::getRpy() {
+    if (!rpyFresh) {
+        float *q = getQuaternion();
+        rpy[0] = (int) (atan2f(q[0] * q[1] + q[2] * q[3], 0.5f - q[1] * q[1] - q[2] * q[2]) * 57.29578f); // deg +ve -> left wing up.
+        rpy[1] = (int) (asinf(-2.0f * (q[1] * q[3] - q[0] * q[2])) * -57.29578f);                      // deg +ve -> nose up
+        rpy[2] = getYawCentidegrees() / 100;                                                           // deg CW of (magnetic) North
+        rpyFresh = true;
+    }
+    return rpy;
+}
+
 /**
  * Write state to Serial.
  */
-void Ahrs::report() {
+void AhrsBase::report() {
+    if (reportQuaternion) {
+        float *q = getQuaternion();
+        Serial.print("OQ");
+        for (byte i = 0; i < 4; i++) {
+            Serial.print((int) (q[i] * 10000.0f)); Serial.print(" ");
+        }
+        Serial.println(getYawCentidegrees());
+        return;
+    }
+    getRpy();
     Serial.print("OR");
     Serial.print(rpy[0]); Serial.print(" ");
     Serial.print(rpy[1]); Serial.print(" "); 
@@ -93,9 +320,25 @@ void Ahrs::report() {
  * Command line received from host.
  * @param commandLine the line received from the host. Note that the line may not be for this object.
  */
-void Ahrs::command(char *commandLine) {
+void AhrsBase::command(char *commandLine) {
     if (commandLine[0] != 'O')
         return; // Not for us.
     if (commandLine[1] == 'R') // Report interval.
         setReportInterval(atoi(commandLine + 2));
+    else if (commandLine[1] == 'Q') // Report quaternion (1) or roll pitch yaw (0).
+        reportQuaternion = commandLine[2] == '1';
+    else if (commandLine[1] == 'D') { // Disturbances.
+        if (commandLine[2] == 'A')
+            setAccelTolerance(atoi(commandLine + 3));
+        else if (commandLine[2] == 'M')
+            setMagTolerance(atoi(commandLine + 3));
+        reportDisturbances();
+    } else if (commandLine[1] == 'L') // Linear acceleration.
+        reportLinear();
+    else if (commandLine[1] == 'E') { // Event limits.
+        if (commandLine[2] == 'T')
+            setTiltLimit(atoi(commandLine + 3));
+        else if (commandLine[2] == 'I')
+            setImpactLimit(atoi(commandLine + 3));
+    }
 }
@@ -6,12 +6,26 @@
  *     Given a LSM9DS0 (or, in principle an LSM9DS1), calculates its orientation
  * PROTOCOL FROM HOST
  *     "ORnnn" changes reporting interval to every nnn ms. Value of 0 turns off reporting
+ *     "OQ1"   report the quaternion ("OQ...") instead of roll pitch yaw ("OR..."). "OQ0" goes back.
+ *     "OD"    report the disturbance counts (see DISTURBANCES).
+ *     "ODAnn" accept accelerometer readings within nn% of 1g (default AHRS_ACCEL_TOLERANCE_PERCENT). 0 => accept everything.
+ *     "ODMnn" accept magnetometer readings within nn% of the usual field strength (default AHRS_MAG_TOLERANCE_PERCENT). 0 => all.
+ *     "OL"    report the linear acceleration (once).
+ *     "OETnn" raise a tilt event beyond nn degrees from level (default AHRS_TILT_LIMIT_DEGREES). 0 => never.
+ *     "OEInn" raise an impact event beyond nn m/s^2 of linear acceleration (default AHRS_IMPACT_MPS2). 0 => never.
  * PROTOCOL TO HOST
  *     "ORroll pitch yaw rollrate pitchrate yawrate" (r p y values are in degrees rr pr yr are in degrees/second) NWU
+ *     "OQw x y z yaw" quaternion components in 1/10000ths (NWU sensor frame relative to the earth frame - x magnetic North,
+ *                     z up - exactly the filter's state), yaw in centidegrees CW of (magnetic) North.
+ *     "ODaccelRejected magRejected field" accelerometer and magnetometer readings rejected as disturbed (since setup), and the
+ *                     usual field strength they're compared with (milligauss).
+ *     "OLx y z"       linear acceleration (gravity removed), mm/s^2, NWU sensor frame.
+ *     "OETat tilt"    tilt event: the sample at micros() at tilted tilt degrees from level - see EVENTS. Sent as it happens.
+ *     "OEIat accel"   impact event: the sample at micros() at had accel mm/s^2 of linear acceleration. Sent as it happens.
  * DEPENDENCIES
  *     Adafruit_LSMDS0 (Adafruit_LSMDS1)
  *     Adafruit_Sensor
- *     MadgwickAHRS
+ *     MadgwickAHRS (or MadgwickFixedAHRS, MahonyAHRS, ComplementaryAHRS)
  * AUTHOR
  *     Scott BARNES
  * COPYRIGHT
@@ -23,6 +37,66 @@
  *     Standard aircraft roll/pitch/yaw is NWD (left handed; +roll=>left wing up; +pitch => nose up; +yaw = nose to right), but Madgwick is right handed
  *     XYZ=NWU (right handed, same as Madgwick)
  *     External interface to Ahrs is NWD, Ahrs is handled.
+ * LAZY ANGLES
+ *     The filter's quaternion is the state. Nothing is converted after a read - roll, pitch and yaw (atan2, asin) are only
+ *     worked out when someone asks for them (getRpy(), getYawCentidegrees(), a report), and then once until the next read.
+ *     Yaw on its own (all the Helm wants) is one atan2.
+ * MULTI-RATE
+ *     Every gyro sample goes through the filter, with the batch's accelerometer reading (updateIMU() - roll and pitch corrected).
+ *     The magnetometer is read less often (see Imu), and each fresh reading is fused once, with the latest gyro sample (update()),
+ *     so yaw is corrected at the magnetometer's rate and held by the gyro in between. Stale readings are never re-used.
+ * HEALTH
+ *     While the Imu says the magnetometer is unhealthy, yaw is gyro only (no magnetometer correction); while the accelerometer
+ *     is unhealthy, roll and pitch are too.
+ * DISTURBANCES
+ *     The filter trusts the accelerometer to point down and the magnetometer to point North. When the hoverboard motors
+ *     accelerate, or the rover bumps, the accelerometer also measures that; near steel (or the motors' own fields) the
+ *     magnetometer is bent. Either way the filter's correction yanks roll, pitch and yaw, and the Helm steers after a phantom
+ *     heading change.
+ *     So each reading is checked first. Gravity is 1g, so an accelerometer reading much further than
+ *     AHRS_ACCEL_TOLERANCE_PERCENT from 1g is rejected: that batch goes through the filter without it (gyro only, for
+ *     roll and pitch). The earth's field is constant here, so a magnetometer reading further than AHRS_MAG_TOLERANCE_PERCENT
+ *     from the usual strength (a slow average of what we've seen - AHRS_FIELD_AVERAGE readings) is rejected: yaw holds on
+ *     the gyro.
+ *     A rejection also holds off that sensor for AHRS_DISTURBANCE_HOLD_MS, because a disturbance's edges pass the check but
+ *     are still wrong. Rejections are counted ("OD").
+ *     This is a gate, not a scaled gain, so it works with any filter (each only gets zeros, or no magnetometer reading).
+ * LINEAR ACCELERATION
+ *     The filter's quaternion says which way is up, so gravity can be taken out of the accelerometer reading: what's left
+ *     is the sensor's own acceleration (NWU sensor frame, m/s^2) - getLinearAcceleration(). Worked out once a read, from
+ *     the raw reading (even one rejected as disturbed - that's when it's interesting), six multiplies.
+ * EVENTS
+ *     Tipping over, or hitting something, can't wait for the host to notice the angles. So after each read the Ahrs checks
+ *     tilt (the angle between the sensor's z and up - roll and pitch together, no trig) against AHRS_TILT_LIMIT_DEGREES, and
+ *     the linear acceleration against AHRS_IMPACT_MPS2. Crossing either raises an event, stamped with the micros() timestamp
+ *     of the sample which crossed it, reported ("OE...") and kept for takeEvents() - the Helm stops on it, in the same pass
+ *     of loop().
+ *     A tilt event is raised once, and again only after tilt has come back AHRS_TILT_HYSTERESIS_DEGREES below the limit;
+ *     an impact event at most once each AHRS_IMPACT_HOLD_MS (one bump rings for a while).
+ *     Tilt needs only the quaternion; impacts need a healthy accelerometer.
+ * TIMING
+ *     Each sample is integrated over its own dt, measured from the Imu's sample timestamps (micros() - the data-ready time if
+ *     wired, otherwise the read time), not a fixed 1/rate. So a loop that runs late (another module overran) still integrates
+ *     the right angle, and the read rate can change freely. A batch's interval is shared equally between its samples.
+ *     The first read, and any gap over AHRS_MAX_DT_US (eg after a capture), use the IMU's nominal period instead.
+ *     If the data-ready timestamp hasn't moved since the last read, though there are new samples, the line has stalled: they
+ *     are timed by the read (micros()) instead, and the Imu counts them (see Imu HEALTH), so the lost time isn't hidden.
+ * IMU SELECTION
+ *     The IMU driver is a template parameter - eg Ahrs<Lsm9ds0Imu> ahrs(&imu); - chosen in the sketch, not by #define.
+ *     Per sample, Ahrs<IMU> calls the driver's readBatch() and selectSample() directly (IMU::), not through the vtable, so the
+ *     compiler can inline them (the Arduino IDE builds with -flto), and a driver the sketch doesn't name is dropped by the linker.
+ *     Everything that doesn't depend on the driver (reporting, commands) is in AhrsBase, which is what the Helm holds.
+ * FILTER SELECTION
+ *     The orientation filter is the second template parameter, default Madgwick - eg Ahrs<Lsm9ds0Imu, Mahony> ahrs(&imu);
+ *     Any class with Madgwick's begin()/update()/updateIMU() (with dt) and getQuaternion() will do.
+ *     Work per gyro sample (updateIMU) - operation counts only; the cycles on a 16MHz Nano are for ahrsbenchmark to measure,
+ *     and haven't been recorded yet:
+ *         Madgwick       - gradient descent step, 3 invSqrt (4 in update()). Most accurate.
+ *         MadgwickFixed  - the same, in Q2.30 fixed point. Same answers (see MadgwickFixedAHRS.h), float only at the edges.
+ *                          Whether that is faster on the Nano, and by how much, is unmeasured.
+ *         Mahony         - cross product error, PI feedback, 2 invSqrt (3 in update()).
+ *         Complementary  - Euler angles, ten multiplies, no normalising, trig only once a batch. Fine while nearly level.
+ *     tools/ahrsbench.cpp runs them all over an imucapture.py recording and reports how far each drifts from Madgwick.
  */
 
 #ifndef Ahrs_h
@@ -37,34 +111,154 @@
 #include "King.h"
 #include "Imu.h"
 #include "MadgwickAHRS.h"
+#include "MahonyAHRS.h"
+#include "ComplementaryAHRS.h"
+#include "MadgwickFixedAHRS.h"
 
-class Ahrs : public King {
+#define AHRS_MAX_DT_US 250000L /* A gap longer than this between reads isn't integrated as is (see TIMING) */
+#define AHRS_GRAVITY                  9.80665  /* m/s^2 */
+#define AHRS_ACCEL_TOLERANCE_PERCENT  10       /* See DISTURBANCES */
+#define AHRS_MAG_TOLERANCE_PERCENT    15
+#define AHRS_FIELD_AVERAGE            256      /* Magnetometer readings (20s at 12.5Hz) the usual field strength is averaged over */
+#define AHRS_DISTURBANCE_HOLD_MS      250      /* After a rejection, reject that sensor for this long */
+#define AHRS_TILT_LIMIT_DEGREES       30       /* See EVENTS */
+#define AHRS_TILT_HYSTERESIS_DEGREES  5
+#define AHRS_IMPACT_MPS2              20       /* About 2g */
+#define AHRS_IMPACT_HOLD_MS           500
+
+#define AHRS_EVENT_TILT               0x01     /* takeEvents() bits */
+#define AHRS_EVENT_IMPACT             0x02
+
+class AhrsBase : public King {
 private:
     void printFloat(float);
-    Imu *imu;
-    Madgwick filter;
     byte imuDump = 1;
-    uint32_t nextImuReadAt = 0L;
+    uint32_t lastImuReadAt = 0L;     // millis().
+    int imuReadIntervalMs = 50;      // How often we read the IMU. Faster if it batches (see setup()).
+    uint16_t samplesPerRead = 1;     // With data-ready, read once this many samples are waiting.
     uint32_t nextReportAt = 0L;
     int reportIntervalMs = 333; // Default is report thrice per second.
-    int rpy[3]; // roll, pitch, yaw. Degrees.
+    byte reportQuaternion = false;   // "OQ1" - report OQ instead of OR.
+    float q[4];                      // The filter's quaternion (w x y z), fetched when first needed after a read.
+    byte quaternionFresh = false;
+    int rpy[3]; // roll, pitch, yaw. Degrees. Worked out when first needed after a read.
+    byte rpyFresh = false;
+    int32_t yawCd;                   // yaw in centidegrees. Also worked out when first needed.
+    byte yawFresh = false;
     int dRpy[3]; // d-roll/dt, d-pitch/dt, d-yaw/dt. deg/s
+    uint32_t lastSampleAtUs = 0L;    // Timestamp of the latest sample last time.
+    byte timed = false;              // .. and whether there has been a last time.
+    float accelLimits[2];            // |a|^2 accepted between these. Set by setAccelTolerance().
+    float magLimits[2];              // |m|^2 / fieldSquared accepted between these. Set by setMagTolerance().
+    byte accelGated = true;          // Whether we check at all (tolerance != 0).
+    byte magGated = true;
+    float fieldSquared = 0.0;        // Usual |m|^2, gauss^2. 0 => no readings yet.
+    uint32_t accelHeldUntil = 0L;    // millis(). Reject the accelerometer until then.
+    uint32_t magHeldUntil = 0L;
+    uint16_t accelRejected = 0;      // Counts (saturating).
+    uint16_t magRejected = 0;
+    void setAccelTolerance(byte percent);
+    void setMagTolerance(byte percent);
+    void reportDisturbances();
+    float linear[3] = { 0.0, 0.0, 0.0 }; // Linear acceleration, m/s^2, NWU. See LINEAR ACCELERATION.
+    float tiltLimitCos;              // Tilted beyond the limit when cos(tilt) < this. Set by setTiltLimit().
+    float tiltReleaseCos;            // .. and back again when cos(tilt) > this.
+    byte tiltChecked = true;         // Whether we check at all (limit != 0).
+    byte tilted = false;
+    float impactSquared;             // |linear|^2 (m/s^2)^2 beyond which it's an impact. 0 => never.
+    uint32_t impactHeldUntil = 0L;   // millis(). No new impact events until then.
+    byte events = 0;                 // AHRS_EVENT_ bits raised since the last takeEvents().
+    uint32_t eventAtUs[2] = { 0L, 0L }; // Sample timestamp of the latest of each event.
+    void setTiltLimit(byte degrees);
+    void setImpactLimit(byte mps2);
+    void reportLinear();
+protected:
+    Imu *imu;
+    float nominalDt;                 // Seconds. The IMU's sample period (or read interval, if it doesn't batch).
+    // Whether it's time to read the IMU.
+    byte readDue(uint32_t now);
+    // Seconds to integrate each of the samples just read over. See TIMING.
+    float sampleDt(byte samples);
+    // After reading (and filtering): mark the angles stale, set dRpy, note the read time, and report.
+    void updated(uint32_t now);
+    // Copies the filter's quaternion (w x y z, NWU) into q.
+    virtual void filterQuaternion(float *q) = 0;
+    // Whether to give the filter this accelerometer (m/s^2) or magnetometer (gauss) reading. See DISTURBANCES.
+    byte accelerationUndisturbed(float ax, float ay, float az, uint32_t now);
+    byte magneticUndisturbed(float mx, float my, float mz, uint32_t now);
+    // After updated(): works out the linear acceleration from this (raw, m/s^2) reading and raises any events. See EVENTS.
+    void sensed(float ax, float ay, float az, byte accelerationHealthy, uint32_t now);
 public:
-    Ahrs(Imu *imu) { this->imu = imu; }
+    AhrsBase(Imu *imu) { this->imu = imu; }
     // Must be called from Arduino startup.
     virtual void setup();
-    // Must be called from Arduino loop each time around.
-    virtual void loop(uint32_t now);
     // Reports on current state, as instructed.
     virtual void report();
     // Instructs Ahrs to report this often (0 is never).
     void setReportInterval(uint32_t reportIntervalMs) { this->reportIntervalMs = reportIntervalMs; };
-    // Returns roll pitch yaw (NWD)
-    int *getRpy() { return rpy; };
+    // Returns the orientation quaternion (w x y z), NWU sensor frame relative to earth (x magnetic North, z up).
+    float *getQuaternion();
+    // Returns roll pitch yaw (NWD), degrees.
+    int *getRpy();
+    // Returns yaw in centidegrees CW of (magnetic) North [0 .. 35999]. Cheaper than getRpy(), which works out roll and pitch too.
+    int32_t getYawCentidegrees();
     // Returns roll pitch yaw rates (NWD)
     int *getDRpy() { return dRpy; };
+    // Returns the linear acceleration (gravity removed), m/s^2, NWU sensor frame. See LINEAR ACCELERATION.
+    float *getLinearAcceleration() { return linear; };
+    // Returns the AHRS_EVENT_ bits raised since the last call, and clears them. See EVENTS.
+    byte takeEvents() { byte raised = events; events = 0; return raised; };
+    // Returns the sample timestamp (micros()) of the latest event of this kind (AHRS_EVENT_TILT or AHRS_EVENT_IMPACT).
+    uint32_t getEventAtUs(byte event) { return eventAtUs[event == AHRS_EVENT_IMPACT ? 1 : 0]; };
+    // Returns the IMU we are reading (eg for the Helm to measure acceleration during calibration).
+    Imu *getImu() { return imu; };
     // A command line has been received from the host - pass it to the Ahrs.
     virtual void command(char *commandLine);
 };
 
+template <class IMU, class FILTER = Madgwick> class Ahrs : public AhrsBase {
+private:
+    FILTER filter;
+public:
+    Ahrs(IMU *imu) : AhrsBase(imu) {}
+    // Must be called from Arduino startup.
+    virtual void setup() {
+        AhrsBase::setup();
+        filter.begin(1.0 / nominalDt);
+    }
+    virtual void filterQuaternion(float *q) { filter.getQuaternion(q); }
+    // Must be called from Arduino loop each time around.
+    virtual void loop(uint32_t now) {
+        if (!readDue(now))
+            return;
+        IMU *typedImu = static_cast<IMU *>(imu);
+        uint16_t produced = imu->startRead();
+        byte samples = imu->finishRead(produced, typedImu->IMU::readBatch()); /* Ask IMU to read in everything it has queued */
+        // The only place the readings become floats. Accel is the same for the whole batch, so convert it once.
+        // An unhealthy (see Imu HEALTH) or disturbed (see DISTURBANCES) accelerometer is left out - zero => the filter
+        // just integrates the gyro.
+        float ax = 0.0, ay = 0.0, az = 0.0;
+        byte accelerationHealthy = samples > 0 && imu->isAccelerationHealthy();
+        byte accelerationUsed = false;
+        if (accelerationHealthy) {
+            ax = imu->getAcceleration(0); ay = imu->getAcceleration(1); az = imu->getAcceleration(2);
+            accelerationUsed = accelerationUndisturbed(ax, ay, az, now);
+        }
+        float fax = accelerationUsed ? ax : 0.0, fay = accelerationUsed ? ay : 0.0, faz = accelerationUsed ? az : 0.0;
+        float dt = sampleDt(samples);
+        for (byte i = 0; i < samples; i++) {
+            typedImu->IMU::selectSample(i);
+            // A new magnetometer reading goes with the latest gyro sample - see MULTI-RATE.
+            if (i == samples - 1 && imu->magneticFresh && imu->isMagneticHealthy()
+                && magneticUndisturbed(imu->getMagnetic(0), imu->getMagnetic(1), imu->getMagnetic(2), now))
+                filter.update(imu->getGyro(0), imu->getGyro(1), imu->getGyro(2), fax, fay, faz, imu->getMagnetic(0), imu->getMagnetic(1), imu->getMagnetic(2), dt); // XYZ==NWU.
+            else
+                filter.updateIMU(imu->getGyro(0), imu->getGyro(1), imu->getGyro(2), fax, fay, faz, dt);
+        }
+        updated(now);
+        if (samples > 0)
+            sensed(ax, ay, az, accelerationHealthy, now);
+    }
+};
+
 #endif /* Ahrs_h */
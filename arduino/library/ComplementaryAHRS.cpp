@@ -0,0 +1,113 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     ComplementaryAHRS.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <math.h>
+
+#include "ComplementaryAHRS.h"
+
+#define RAD_TO_DEGREES 57.29578f
+#define DEGREES_TO_RAD 0.0174533f
+
+// Wraps an angle difference (degrees) into -180 .. 180.
+static float wrap180(float degrees) {
+    while (degrees > 180.0f) degrees -= 360.0f;
+    while (degrees < -180.0f) degrees += 360.0f;
+    return degrees;
+}
+
+/**
+ * Gyro only. Body rates -> Euler angle rates (ZYX), with the trig from the last tilt correction.
+ */
+void Complementary::integrate(float gx, float gy, float gz) {
+    float dt = invSampleFreq;
+    float yz = gy * sinRoll + gz * cosRoll;
+    roll += (gx + yz * tanPitch) * dt;
+    pitch += (gy * cosRoll - gz * sinRoll) * dt;
+    yaw = wrap180(yaw + yz * secPitch * dt);
+    sinceTilt += dt;
+    sinceHeading += dt;
+}
+
+/**
+ * Only does anything every COMPLEMENTARY_TILT_INTERVAL_S (and straight away the first time).
+ */
+void Complementary::correctTilt(float ax, float ay, float az) {
+    if ((ax == 0.0f && ay == 0.0f && az == 0.0f) || (tilted && sinceTilt < COMPLEMENTARY_TILT_INTERVAL_S))
+        return;
+    float accelRoll = atan2f(ay, az) * RAD_TO_DEGREES;
+    float accelPitch = atan2f(-ax, sqrtf(ay * ay + az * az)) * RAD_TO_DEGREES;
+    if (!tilted) {
+        roll = accelRoll;
+        pitch = accelPitch;
+        tilted = true;
+    } else {
+        float k = sinceTilt / tiltTau;
+        if (k > 1.0f) k = 1.0f;
+        roll += wrap180(accelRoll - roll) * k;
+        pitch += (accelPitch - pitch) * k;
+    }
+    roll = wrap180(roll);
+    sinceTilt = 0.0f;
+    float r = roll * DEGREES_TO_RAD;
+    float p = pitch * DEGREES_TO_RAD;
+    sinRoll = sinf(r);
+    cosRoll = cosf(r);
+    float cosPitch = cosf(p);
+    if (fabsf(cosPitch) < 0.01f) // Pointing straight up or down. Yaw is meaningless there anyway.
+        cosPitch = cosPitch < 0.0f ? -0.01f : 0.01f;
+    secPitch = 1.0f / cosPitch;
+    tanPitch = sinf(p) * secPitch;
+}
+
+/**
+ * Tilt compensated heading: level the magnetometer reading with the current roll and pitch, then atan2.
+ */
+void Complementary::correctHeading(float mx, float my, float mz) {
+    if (mx == 0.0f && my == 0.0f && mz == 0.0f)
+        return;
+    float cosPitch = 1.0f / secPitch;
+    float sinPitch = tanPitch * cosPitch;
+    float levelX = mx * cosPitch + (my * sinRoll + mz * cosRoll) * sinPitch;
+    float levelY = my * cosRoll - mz * sinRoll;
+    float heading = atan2f(-levelY, levelX) * RAD_TO_DEGREES;
+    if (!headed) {
+        yaw = heading;
+        headed = true;
+    } else {
+        float k = sinceHeading / headingTau;
+        if (k > 1.0f) k = 1.0f;
+        yaw = wrap180(yaw + wrap180(heading - yaw) * k);
+    }
+    sinceHeading = 0.0f;
+}
+
+void Complementary::updateIMU(float gx, float gy, float gz, float ax, float ay, float az) {
+    integrate(gx, gy, gz);
+    correctTilt(ax, ay, az);
+}
+
+void Complementary::update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz) {
+    updateIMU(gx, gy, gz, ax, ay, az);
+    correctHeading(mx, my, mz);
+}
+
+/**
+ * ZYX Euler angles -> quaternion (w x y z).
+ */
+void Complementary::getQuaternion(float *q) {
+    float halfRoll = roll * DEGREES_TO_RAD / 2.0f, halfPitch = pitch * DEGREES_TO_RAD / 2.0f, halfYaw = yaw * DEGREES_TO_RAD / 2.0f;
+    float cr = cosf(halfRoll), sr = sinf(halfRoll);
+    float cp = cosf(halfPitch), sp = sinf(halfPitch);
+    float cy = cosf(halfYaw), sy = sinf(halfYaw);
+    q[0] = cr * cp * cy + sr * sp * sy;
+    q[1] = sr * cp * cy - cr * sp * sy;
+    q[2] = cr * sp * cy + sr * cp * sy;
+    q[3] = cr * cp * sy - sr * sp * cy;
+}
@@ -0,0 +1,72 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     Complementary
+ * PURPOSE
+ *     The lightest orientation filter Ahrs can use, by operation count (not yet timed on a Nano - see ahrsbenchmark): integrate the gyro, and pull roll/pitch towards the accelerometer's tilt
+ *     and yaw towards the (tilt compensated) magnetometer heading, slowly.
+ *     Same interface as Madgwick (see MadgwickAHRS.h), so it drops into Ahrs<IMU, Complementary>.
+ *     Not a King.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * DETAILS
+ *     State is roll, pitch and yaw in degrees - no quaternion, no normalising.
+ *     Per gyro sample, the body rates are turned into Euler angle rates (using sin/cos of roll and pitch cached at the last tilt
+ *     correction) and integrated: ten multiplies, no trig, no square root.
+ *     The trig (atan2 for tilt, and again for heading) only happens every COMPLEMENTARY_TILT_INTERVAL_S (about once a batch -
+ *     the Imu only reads the accelerometer once a batch anyway) and when a fresh magnetometer reading comes in (update()).
+ *     Each correction blends in by (time since the last one) / COMPLEMENTARY_*_TAU_S, so the gyro is trusted over seconds,
+ *     and the accelerometer and magnetometer in the long run, whatever rate they come in at.
+ *     It is worse than Madgwick when the rover is tilted a long way and turning, which a rover mostly isn't.
+ * UNITS
+ *     Gyro in degrees/second (as Madgwick). Accelerometer and magnetometer in any units - only their directions are used.
+ *     A zero accelerometer (or magnetometer) reading means "not available", and no correction is made from it.
+ */
+
+#ifndef ComplementaryAHRS_h
+#define ComplementaryAHRS_h
+
+#define COMPLEMENTARY_TILT_TAU_S     2.0f   /* Seconds for the accelerometer to pull roll/pitch (most of the way) in */
+#define COMPLEMENTARY_HEADING_TAU_S  5.0f   /* Seconds for the magnetometer to pull yaw in */
+#define COMPLEMENTARY_TILT_INTERVAL_S 0.02f /* Correct tilt (and redo the trig) this often. IMU_BATCH_RATE_MS in Ahrs.cpp. */
+
+class Complementary {
+private:
+    float roll = 0.0f, pitch = 0.0f, yaw = 0.0f;         // Degrees. Same conventions as Madgwick (yaw -180 .. 180 here).
+    float sinRoll = 0.0f, cosRoll = 1.0f;                // Cached at the last tilt correction.
+    float tanPitch = 0.0f, secPitch = 1.0f;
+    float sinceTilt = 0.0f;                              // Seconds integrated since the last tilt correction.
+    float sinceHeading = 0.0f;                           // .. and heading correction.
+    float invSampleFreq = 1.0f / 512.0f;
+    float tiltTau = COMPLEMENTARY_TILT_TAU_S;
+    float headingTau = COMPLEMENTARY_HEADING_TAU_S;
+    char tilted = false;                                 // Whether roll/pitch have been set from the accelerometer yet.
+    char headed = false;                                 // .. and yaw from the magnetometer.
+    void integrate(float gx, float gy, float gz);
+    void correctTilt(float ax, float ay, float az);
+    void correctHeading(float mx, float my, float mz);
+public:
+    void begin(float sampleFrequency) { invSampleFreq = 1.0f / sampleFrequency; }
+    void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+    void updateIMU(float gx, float gy, float gz, float ax, float ay, float az);
+    // As above, but integrating over dt seconds instead of 1 / sampleFrequency.
+    void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt) {
+        invSampleFreq = dt;
+        update(gx, gy, gz, ax, ay, az, mx, my, mz);
+    }
+    void updateIMU(float gx, float gy, float gz, float ax, float ay, float az, float dt) {
+        invSampleFreq = dt;
+        updateIMU(gx, gy, gz, ax, ay, az);
+    }
+    void setTimeConstants(float tiltTauS, float headingTauS) { tiltTau = tiltTauS; headingTau = headingTauS; }
+    float getRoll() { return roll; }
+    float getPitch() { return pitch; }
+    float getYaw() { return yaw + 180.0f; }              // 0 .. 360, as Madgwick.
+    float getRollRadians() { return roll * 0.0174533f; }
+    float getPitchRadians() { return pitch * 0.0174533f; }
+    float getYawRadians() { return yaw * 0.0174533f; }
+    // Built from roll, pitch and yaw (which are this filter's state), same conventions as Madgwick's. Six sin/cos.
+    void getQuaternion(float *q);
+};
+
+#endif /* ComplementaryAHRS_h */
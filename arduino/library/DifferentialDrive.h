@@ -40,7 +40,9 @@ public:
         this->reverseRightMotor = reverseRightMotor;
     };
     
-    virtual void setMotorPowers(int leftMotorSpeed, int rightMotorSpeed);
+    virtual void setMotorPowers(int leftMotorSpeed, int rightMotorSpeed) = 0;
+    virtual byte hasOdometry() { return false; };   // Only drives with wheel encoders (eg tapped Hall sensors) can say how far we've gone.
+    virtual int32_t getDistanceMm() { return 0; };  // Mean distance travelled by the two wheels since startup. Only meaningful if hasOdometry().
     void setReportInterval(int reportIntervalMs) { this->reportIntervalMs = reportIntervalMs; };
 };
 
@@ -13,21 +13,44 @@
 #include "Helm.h"
 #include "Ahrs.h"
 #include "DifferentialDrive.h"
+#include "Imu.h"
 
 /**
  * @param ahrs to work out orientation.
  * @param drive to drive the motors.
  * @param maxPower never apply more than this percent power to motors.
- * @param speedAtFullPowerMmPS estimated speed we would go if 100% power applied to motors. Assume linear for fractions.
+ * @param speedAtFullPowerMmPS estimated speed we would go if 100% power applied to motors. Assume linear for fractions, until calibrated ("HK").
  */
-Helm::Helm(Ahrs *ahrs, DifferentialDrive *drive, int maxPower, int speedAtFullPowerMmPS) {
+Helm::Helm(AhrsBase *ahrs, DifferentialDrive *drive, int maxPower, int speedAtFullPowerMmPS) : powerCurve(speedAtFullPowerMmPS) {
     this->ahrs = ahrs;
     this->drive = drive;
     this->maxPower = maxPower;
     this->speedAtFullPowerMmPS = speedAtFullPowerMmPS;
 }
 
+/**
+ * Should be called by setup() in the .ino sketch.
+ * PREREQUISITE: Serial.begin(...) must be called before this.
+ */
+void Helm::setup() {
+    if (powerCurve.load(HELM_EEPROM_ADDRESS))
+        powerCurve.report("HK");
+    else
+        Serial.println("HD No calibrated power curve. Using linear.");
+}
+
 void Helm::loop(uint32_t now) {
+    byte events = ahrs->takeEvents();
+    if (events != 0 && (!stopped || calibrationStep >= 0)) { // See SAFETY.
+        byte event = (events & AHRS_EVENT_TILT) ? AHRS_EVENT_TILT : AHRS_EVENT_IMPACT;
+        emergencyStop();
+        Serial.print(event == AHRS_EVENT_TILT ? "HET" : "HEI"); Serial.println(ahrs->getEventAtUs(event));
+        return;
+    }
+    if (calibrationStep >= 0) {
+        calibrationLoop(now);
+        return;
+    }
     if (updateIntervalMs <= 0) // Helm is effectively turned off.
         return;
     if (stopped) {
@@ -39,9 +62,9 @@ void Helm::loop(uint32_t now) {
     // Work out course correction.
     // Apply PID to correctionSpeed.
     
-    int yaw = ahrs->getRpy()[2];
+    int32_t yawCd = ahrs->getYawCentidegrees(); // Centidegrees, so the P term doesn't step a whole degree at a time.
     int dYawDt = ahrs->getDRpy()[2];
-    int courseCorrection = (((goalCourse - yaw) + 900) % 360) - 180; // How many degrees CW we have to turn to be correct [-180 .. 180]
+    float courseCorrection = ((goalCourse * 100L - yawCd + 54000L) % 36000L - 18000L) / 100.0; // How many degrees CW we have to turn to be correct [-180 .. 180]
 
     float K = (turningCircleMm * 3.1415 * 1000.0 / 360.0) / turnTimeMs;
     float p = pK * courseCorrection * K;
@@ -49,16 +72,13 @@ void Helm::loop(uint32_t now) {
     float i = 0.0; // (int) (iK * counter); // for now .. maybe do something with this later.
     // Units of p,i,d are actually mm/s.
     
-    int basePower  = 100L * goalSpeedMmPS / speedAtFullPowerMmPS;
-    basePower = min(max(basePower, -maxPower), maxPower);
-
-    int turnPower  = 100L * (p + i + d) / speedAtFullPowerMmPS;
-    turnPower = min(max(turnPower, -maxPower), maxPower);
-
-    int leftPower = min(max(basePower + turnPower, -maxPower), maxPower);
-    int rightPower = min(max(basePower - turnPower, -maxPower), maxPower);
+    // Each wheel gets its own speed, and the power curve maps each one to power (it isn't linear, so we can't add powers).
+    int correctionMmPS = (int) (p + i + d);
+    int basePower = min(max(powerCurve.powerForSpeed(goalSpeedMmPS), -maxPower), maxPower);
+    int leftPower = min(max(powerCurve.powerForSpeed(goalSpeedMmPS + correctionMmPS), -maxPower), maxPower);
+    int rightPower = min(max(powerCurve.powerForSpeed(goalSpeedMmPS - correctionMmPS), -maxPower), maxPower);
 
-    Serial.print("HD Helm Y "); Serial.print(yaw); Serial.print(" dY/dt "); Serial.print(dYawDt); Serial.print(" cCor "); Serial.print(courseCorrection);
+    Serial.print("HD Helm Y "); Serial.print(yawCd / 100.0); Serial.print(" dY/dt "); Serial.print(dYawDt); Serial.print(" cCor "); Serial.print(courseCorrection);
     Serial.print(" BP "); Serial.print(basePower);
     Serial.print(" K "); Serial.print(K);
     Serial.print(" p "); Serial.print(p); Serial.print(" d "); Serial.print(d);
@@ -131,20 +151,127 @@ void Helm::command(char *commandLine) {
         } else if (commandLine[2] == 'C') {    // "HSCnnn" - set update interval (HSC0 turns off the Helm)
             updateIntervalMs = atoi(commandLine + 3);
         }
+    } else if (commandLine[1] == 'K') {
+        if (commandLine[2] == 'R') {           // "HKR" - report power curve
+            powerCurve.report("HK");
+        } else if (commandLine[2] == 'X') {    // "HKX" - forget calibration
+            powerCurve.forget(HELM_EEPROM_ADDRESS);
+            powerCurve.setLinear(speedAtFullPowerMmPS);
+            powerCurve.report("HK");
+        } else {                               // "HK" - calibrate
+            startCalibration();
+        }
     }
 }
 
+/**
+ * Sweep the power up in steps, measuring the speed at each.
+ * The rover must be stationary (and pointing somewhere it can safely drive a few metres).
+ * This doesn't block - the sweep is driven by loop(). Any stop command aborts it.
+ */
+void Helm::startCalibration() {
+    Serial.println("HD Calibrating power curve");
+    setStopped(true); // So we sit still afterwards.
+    calibrationStep = 0;
+    calibrationMeasuring = false;
+    calibrationStepStartedAt = calibrationLastAt = millis();
+    calibrationSpeedMmPS = 0.0;
+    calibrationAccelBias = 0.0;
+    calibrationBiasSamples = 0;
+    drive->setMotorPowers(0, 0);
+}
+
+void Helm::calibrationLoop(uint32_t now) {
+    // Integrate acceleration all the time (it's cheap), even if we end up using odometry.
+    float forwardAcceleration = ahrs->getImu()->getAcceleration(0); // m/s^2, X is forwards (NWU).
+    if (calibrationStep == 0) {
+        calibrationAccelBias += forwardAcceleration;
+        calibrationBiasSamples++;
+    } else {
+        calibrationSpeedMmPS += (forwardAcceleration - calibrationAccelBias) * (now - calibrationLastAt); // m/s^2 * ms == mm/s
+    }
+    calibrationLastAt = now;
+    if (!calibrationMeasuring) {
+        if (now - calibrationStepStartedAt < HELM_CALIBRATION_SETTLE_MS)
+            return;
+        calibrationMeasuring = true;
+        calibrationStartMm = drive->getDistanceMm();
+    }
+    if (now - calibrationStepStartedAt < HELM_CALIBRATION_SETTLE_MS + HELM_CALIBRATION_MEASURE_MS)
+        return;
+    // This step is done. Record the speed.
+    int speedMmPS = 0;
+    if (calibrationStep == 0) {
+        calibrationAccelBias /= max(calibrationBiasSamples, 1);
+    } else if (drive->hasOdometry()) {
+        speedMmPS = (drive->getDistanceMm() - calibrationStartMm) * 1000L / HELM_CALIBRATION_MEASURE_MS;
+    } else {
+        speedMmPS = (int) calibrationSpeedMmPS;
+    }
+    powerCurve.setSpeedAtStep(calibrationStep, speedMmPS);
+    Serial.print("HD Calibration step "); Serial.print(calibrationStep); Serial.print(" speed "); Serial.println(speedMmPS);
+    // On to the next step - unless it would exceed maxPower.
+    calibrationStep++;
+    int power = 100 * calibrationStep / (POWER_CURVE_STEPS - 1);
+    if (calibrationStep >= POWER_CURVE_STEPS || power > maxPower) {
+        finishCalibration(calibrationStep - 1);
+        return;
+    }
+    drive->setMotorPowers(power, power);
+    calibrationStepStartedAt = now;
+    calibrationMeasuring = false;
+}
+
+/**
+ * Put back whatever curve we had before calibrating: the saved one, or linear if there isn't one.
+ */
+void Helm::restorePowerCurve() {
+    if (!powerCurve.load(HELM_EEPROM_ADDRESS))
+        powerCurve.setLinear(speedAtFullPowerMmPS);
+}
+
+/**
+ * Stop the motors, fill in any steps we didn't dare drive, and save the curve.
+ * @param lastMeasuredStep the highest step that was actually measured.
+ */
+void Helm::finishCalibration(byte lastMeasuredStep) {
+    drive->setMotorPowers(0, 0);
+    calibrationStep = -1;
+    if (lastMeasuredStep < 1 || powerCurve.getSpeedAtStep(lastMeasuredStep) <= 0) {
+        Serial.println("HD Calibration failed - we never moved. Is maxPower too low?");
+        restorePowerCurve();
+        return;
+    }
+    // Extrapolate the undriven steps along the slope of the last two measured ones.
+    int top = powerCurve.getSpeedAtStep(lastMeasuredStep);
+    int slope = max(top - powerCurve.getSpeedAtStep(lastMeasuredStep - 1), 1);
+    for (byte i = lastMeasuredStep + 1; i < POWER_CURVE_STEPS; i++)
+        powerCurve.setSpeedAtStep(i, top + slope * (i - lastMeasuredStep));
+    powerCurve.rebuild();
+    powerCurve.save(HELM_EEPROM_ADDRESS);
+    powerCurve.report("HK");
+}
+
 void Helm::setStopped(byte stopped) {
     this->stopped = stopped;
     // That won't stop immediately, but the next time we do a speed check (at nextUpdateAt). No hurry.
 }
 
 void Helm::fullStop() {
+    if (calibrationStep >= 0) {
+        Serial.println("HD Calibration aborted");
+        calibrationStep = -1;
+        restorePowerCurve(); // Half a sweep is worse than none.
+    }
     setStopped(true);
     nextUpdateAt = 0L; // Force quick motor drop
 }
 
 void Helm::emergencyStop() {
+    if (calibrationStep >= 0) {
+        calibrationStep = -1;
+        restorePowerCurve();
+    }
     drive->setMotorPowers(0, 0);
     setStopped(true);
 }
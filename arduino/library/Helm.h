@@ -16,8 +16,25 @@
  *     "HSDnnn.nn"    - Set dK to atof(nnn.nn)
  *     "HSMnnn"       - Set max power to atoi(nnn)
  *     "HSTnnn"       - Set update interval (ie how often we update the Drive). Zero is never.
+ *     "HK"           - Calibrate the power curve: sweep power 0%, 10% .. maxPower, measuring speed at each step. ROVER WILL MOVE (in a straight line).
+ *     "HKR"          - Report the power curve.
+ *     "HKX"          - Forget the calibrated power curve (go back to linear speedAtFullPowerMmPS).
  * PROTOCOL TO HOST
  *     "HD arbitrary debugging message which could be logged"
+ *     "HKs0 s1 .. s10" the power curve - speed (mm/s) at 0%, 10% .. 100% power. Sent after calibration, or on "HKR".
+ *     "HET at"       - Stopped because the Ahrs saw a tilt (T) or impact (I) event in the sample at micros() at. See SAFETY.
+ * CALIBRATION
+ *     Speed is measured from the drive's odometry if it has any, otherwise by integrating the forward (X) acceleration from the IMU.
+ *     The IMU is the poor cousin - it drifts - so keep the sweep short and the ground flat.
+ *     The first step (0% power) is used to measure the accelerometer bias, so the rover must be stationary when "HK" is sent.
+ *     Steps above maxPower are not driven - they are extrapolated from the last two measured steps.
+ *     The result is saved in EEPROM, and loaded again by setup().
+ * SAFETY
+ *     If the Ahrs raises a tilt or impact event (see EVENTS in Ahrs.h) while the motors are driven (moving, or calibrating),
+ *     the Helm stops at once - the next loop() after the read that saw it, not after the host has noticed - and says why ("HE").
+ *     It stays stopped until the next "HC".
+ * EEPROM
+ *     Bytes [HELM_EEPROM_ADDRESS .. HELM_EEPROM_ADDRESS + 31] belong to the Helm.
  */
 
 #ifndef Helm_h
@@ -27,10 +44,15 @@
 #include "King.h"
 #include "Ahrs.h"
 #include "HoverboardDrive.h"
+#include "PowerCurve.h"
+
+#define HELM_EEPROM_ADDRESS            0     /* Where the power curve lives in EEPROM */
+#define HELM_CALIBRATION_SETTLE_MS  1000     /* At each calibration step, let the motors spin up for this long .. */
+#define HELM_CALIBRATION_MEASURE_MS 1000     /* .. then measure speed over this long. */
 
 class Helm : public King {
 private:
-    Ahrs *ahrs;
+    AhrsBase *ahrs;
     DifferentialDrive *drive;
     boolean stopped = true;
     int maxPower = 50;               // Never direct the Drive to power outside [-maxPower .. +maxPower]
@@ -44,15 +66,28 @@ private:
     int goalSpeedMmPS = 0;           // [-100 .. 100] -ve is backwards. This is the speed we have been INSTRUCTED to go.
     int turningCircleMm = 520;       // In the case of Differential drive, this is the wheel base. Ackerman drive .. um .. maybe something else.
     int turnTimeMs = 1000;
+    PowerCurve powerCurve;           // Speed -> power. Linear on speedAtFullPowerMmPS until calibrated.
+    int8_t calibrationStep = -1;     // Which power step (0 .. POWER_CURVE_STEPS - 1) we are calibrating. -1 => not calibrating.
+    uint32_t calibrationStepStartedAt = 0L;
+    uint32_t calibrationLastAt = 0L;
+    byte calibrationMeasuring = false; // In the measuring (not settling) part of the step.
+    int32_t calibrationStartMm = 0;  // Odometry at start of measuring.
+    float calibrationSpeedMmPS = 0.0; // IMU estimate of speed (integrated acceleration).
+    float calibrationAccelBias = 0.0; // IMU forward acceleration when stationary (m/s^2).
+    int calibrationBiasSamples = 0;
+    void calibrationLoop(uint32_t now);
+    void finishCalibration(byte lastMeasuredStep);
+    void restorePowerCurve();
 public:
-    Helm(Ahrs *ahrs, DifferentialDrive *drive, int maxPower, int speedAtFullPowerMmPS);
-    virtual void setup() {}
+    Helm(AhrsBase *ahrs, DifferentialDrive *drive, int maxPower, int speedAtFullPowerMmPS);
+    virtual void setup();
     virtual void loop(uint32_t now);
     virtual void command(char *commandLine);
     virtual void setCourseAndSpeed(int course, int speedMmPS, int turnTimeMs); // speedMmPS must not be -ve
     virtual void setStopped(byte stopped);
     virtual void emergencyStop();
     virtual void fullStop();
+    virtual void startCalibration();
 };
 
 #endif /* Helm_h */
@@ -7,7 +7,7 @@
  * AUTHOR
  *     Scott Barnes
  * PHILOSOPHY
- *     The Hall effect sensors can be 'tapped' by the Arduino to give D (as in PID) feedback to the Helm. Later.
+ *     The Hall effect sensors are 'tapped' by the Arduino to give distance (so speed) feedback to the Helm.
  * COPYRIGHT
  *     Scott BARNES 2019. IP freely on non-commercial applications.
  * HARDWARE INTERFACE
@@ -35,12 +35,12 @@
  * @param leftMotorDirectionPin pin which controls motor direction.
  * @param rightMotorSpeedPin  PWM pin which controls motor speed (actually motor power, but it's called a speed pin).
  * @param rightMotorDirectionPin pin which controls motor direction.
- * @param hallLeftMotorAPin not yet used.
- * @param hallLeftMotorBPin not yet used.
- * @param hallLeftMotorCPin not yet used.
- * @param hallRightMotorAPin not yet used.
- * @param hallRightMotorBPin not yet used.
- * @param hallRightMotorCPin not yet used.
+ * @param hallLeftMotorAPin Hall sensor pins, for odometry. See ODOMETRY.
+ * @param hallLeftMotorBPin
+ * @param hallLeftMotorCPin
+ * @param hallRightMotorAPin
+ * @param hallRightMotorBPin
+ * @param hallRightMotorCPin
  */
 HoverboardDrive::HoverboardDrive(byte reverseLeftMotor, byte reverseRightMotor, byte leftMotorSpeedPin, byte leftMotorDirectionPin, byte rightMotorSpeedPin, byte rightMotorDirectionPin, byte hallLeftMotorAPin, byte hallLeftMotorBPin, byte hallLeftMotorCPin, byte hallRightMotorAPin, byte hallRightMotorBPin, byte hallRightMotorCPin) : DifferentialDrive(reverseLeftMotor, reverseRightMotor) {
     this->leftMotorSpeedPin = leftMotorSpeedPin;
@@ -66,22 +66,108 @@ HoverboardDrive::HoverboardDrive(byte reverseLeftMotor, byte reverseRightMotor,
     //delay(1000); Nope. Don't put delay()s in constructors. Arduino freezes.
 }
 
+HoverboardDrive *HoverboardDrive::synchronousDrive = 0;
+HoverboardDrive *HoverboardDrive::odometryDrive = 0;
+
+// Where each Hall state (C B A) is in the sequence, or -1 if it isn't. See ODOMETRY.
+static const int8_t hallPosition[8] = { -1, 0, 2, 1, 4, 5, 3, -1 };
+// Steps for each move along the sequence (mod 6). 3 could be either way.
+static const int8_t hallStep[6] = { 0, 1, 2, 0, -2, -1 };
+
 /**
  * Call this from Arduino setup()
  */
 void HoverboardDrive::setup() {
-    // Nothing to do here .. well .. except.
+    setupSynchronousPwm();
+    setupOdometry();
     resetMotors();
 }
 
+/**
+ * @param tccr set to the timer control register holding the pin's COM bits ..
+ * @param com  .. and to the one which connects it (non-inverting PWM).
+ * @return the output compare register which sets the duty on this pin, or 0 if it isn't on a timer we can synchronise.
+ */
+volatile uint8_t *HoverboardDrive::ocrForPin(byte pin, volatile uint8_t **tccr, byte *com) {
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+    switch (digitalPinToTimer(pin)) {
+    case TIMER0A: *tccr = &TCCR0A; *com = _BV(COM0A1); return &OCR0A;
+    case TIMER0B: *tccr = &TCCR0A; *com = _BV(COM0B1); return &OCR0B;
+    case TIMER2A: *tccr = &TCCR2A; *com = _BV(COM2A1); return &OCR2A;
+    case TIMER2B: *tccr = &TCCR2A; *com = _BV(COM2B1); return &OCR2B;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * If the pins allow it, take over the PWM registers so both channels can be updated on the same timer boundary.
+ */
+void HoverboardDrive::setupSynchronousPwm() {
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+    leftOcr = ocrForPin(leftMotorSpeedPin, &leftTccr, &leftCom);
+    rightOcr = ocrForPin(rightMotorSpeedPin, &rightTccr, &rightCom);
+    if (!leftOcr || !rightOcr || digitalPinToPort(leftMotorDirectionPin) != digitalPinToPort(rightMotorDirectionPin) || synchronousDrive) {
+        Serial.println("SD HoverboardDrive pins can't be updated synchronously. Writing them directly.");
+        return;
+    }
+    directionPort = portOutputRegister(digitalPinToPort(leftMotorDirectionPin));
+    leftDirectionMask = digitalPinToBitMask(leftMotorDirectionPin);
+    rightDirectionMask = digitalPinToBitMask(rightMotorDirectionPin);
+    // Zero power is the pin disconnected from the timer, so driven low by its port bit (digitalWrite() disconnects it too).
+    // We connect it (timerBoundary()) only while it has power.
+    digitalWrite(leftMotorSpeedPin, LOW);
+    digitalWrite(rightMotorSpeedPin, LOW);
+    noInterrupts();
+    *leftOcr = 0;
+    *rightOcr = 0;
+    // Timer2 to fast PWM (the core sets it up phase-correct). It's already /64, same as Timer0, so the periods are the same length.
+    TCCR2A |= _BV(WGM21) | _BV(WGM20);
+    // Hold both prescalers, zero both counters, and let them go together, so the periods start together.
+    // Timer0 is millis()'s clock, so this costs millis() less than a ms, once.
+    GTCCR = _BV(TSM) | _BV(PSRASY) | _BV(PSRSYNC);
+    TCNT0 = 0;
+    TCNT2 = 0;
+    GTCCR = 0;
+    appliedDirections = *directionPort & (leftDirectionMask | rightDirectionMask);
+    synchronousDrive = this;
+    synchronous = true;
+    interrupts();
+#endif
+}
+
+/**
+ * If the pins allow it, count the Hall sensors' steps on pin change interrupts.
+ */
+void HoverboardDrive::setupOdometry() {
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+    byte pins[HOVERBOARD_HALLS] = { hallLeftMotorAPin, hallLeftMotorBPin, hallLeftMotorCPin, hallRightMotorAPin, hallRightMotorBPin, hallRightMotorCPin };
+    for (byte i = 0; i < HOVERBOARD_HALLS; i++)
+        if (digitalPinToPCICR(pins[i]) == 0 || odometryDrive) {
+            Serial.println("SD HoverboardDrive Hall pins can't interrupt. No odometry.");
+            return;
+        }
+    noInterrupts();
+    for (byte i = 0; i < HOVERBOARD_HALLS; i++) {
+        hallInput[i] = portInputRegister(digitalPinToPort(pins[i]));
+        hallMask[i] = digitalPinToBitMask(pins[i]);
+        *digitalPinToPCMSK(pins[i]) |= _BV(digitalPinToPCMSKbit(pins[i]));
+        PCICR |= _BV(digitalPinToPCICRbit(pins[i]));
+    }
+    odometryDrive = this;
+    odometry = true;
+    hallChange(); // Where the wheels are now.
+    interrupts();
+#endif
+}
+
 void HoverboardDrive::resetMotors() {
     // There seems to be an issue initialising the BLDC motor drivers.
     // To overcome this, pull them low for 1s before starting.
     // Hopefully this will do some kind of reset on the drivers .. or something.
-    digitalWrite(leftMotorSpeedPin, LOW);
-    analogWrite(rightMotorSpeedPin, 0);
-    digitalWrite(leftMotorDirectionPin, LOW);
-    analogWrite(rightMotorDirectionPin, 0);
+    writeMotorPowers(LOW, 0, LOW, 0);
+    currentLeftMotorPower = 0;
+    currentRightMotorPower = 0;
     delay(1000); // This is actually to let the resetting the BLDC reset take effect. Not really clear whether it's needed, but WTH.
 }
 
@@ -104,18 +190,141 @@ void HoverboardDrive::loop(uint32_t now) {
  * @param rightMotorPower     -100 .. +100
  */
 void HoverboardDrive::setMotorPowers(int leftMotorPower, int rightMotorPower) {
-    if (leftMotorPower != currentLeftMotorPower) {
-        digitalWrite(leftMotorDirectionPin, reverseLeftMotor ? leftMotorPower < 0 : leftMotorPower >= 0);
-        analogWrite(leftMotorSpeedPin, leftMotorPower > 0 ? (255 * leftMotorPower / 100) : (255 * leftMotorPower / -100));
-        currentLeftMotorPower = leftMotorPower;
+    if (leftMotorPower == currentLeftMotorPower && rightMotorPower == currentRightMotorPower)
+        return;
+    currentLeftMotorPower = leftMotorPower;
+    currentRightMotorPower = rightMotorPower;
+    writeMotorPowers(reverseLeftMotor ? leftMotorPower < 0 : leftMotorPower >= 0, 255 * abs(leftMotorPower) / 100,
+                     reverseRightMotor ? rightMotorPower < 0 : rightMotorPower >= 0, 255 * abs(rightMotorPower) / 100);
+}
+
+/**
+ * Get both channels to the pins - together on the next timer boundary if we can, otherwise directly (but safely).
+ * @param leftDirection value for the left direction pin.
+ * @param leftDuty      [0 .. 255]
+ * @param rightDirection value for the right direction pin.
+ * @param rightDuty     [0 .. 255]
+ */
+void HoverboardDrive::writeMotorPowers(byte leftDirection, byte leftDuty, byte rightDirection, byte rightDuty) {
+    if (synchronous) {
+        byte directions = (leftDirection ? leftDirectionMask : 0) | (rightDirection ? rightDirectionMask : 0);
+        noInterrupts();
+        pendingDirections = directions;
+        pendingLeftDuty = leftDuty;
+        pendingRightDuty = rightDuty;
+        if (updatePhase == HOVERBOARD_UPDATE_IDLE) {
+            TIFR2 = _BV(TOV2);     // Clear any stale overflow, so the interrupt comes at the NEXT boundary, not right now.
+            TIMSK2 |= _BV(TOIE2);
+        }
+        updatePhase = directions != appliedDirections ? HOVERBOARD_UPDATE_ZERO : HOVERBOARD_UPDATE_APPLY;
+        interrupts();
+        return;
+    }
+    // No synchronous update. At least never drive a motor the wrong way: zero it before flipping its direction.
+    if (digitalRead(leftMotorDirectionPin) != leftDirection)
+        analogWrite(leftMotorSpeedPin, 0);
+    if (digitalRead(rightMotorDirectionPin) != rightDirection)
+        analogWrite(rightMotorSpeedPin, 0);
+    digitalWrite(leftMotorDirectionPin, leftDirection);
+    digitalWrite(rightMotorDirectionPin, rightDirection);
+    analogWrite(leftMotorSpeedPin, leftDuty);
+    analogWrite(rightMotorSpeedPin, rightDuty);
+}
+
+/**
+ * Called at the start of each PWM period (Timer0 and Timer2 overflow together) while an update is waiting.
+ * OCR writes here latch at the NEXT boundary (they're double buffered), for both channels at once. COM bit and direction
+ * writes are immediate. The pulse a connected pin started at this boundary is high as we run (it is at least one count,
+ * even at OCR == 0), so a channel which changes direction is disconnected a whole period first:
+ *   boundary N:   ZERO    - disconnect the changing channel(s): their pulse stops now, and none starts at N+1.
+ *   boundary N+1: APPLY   - flip both directions in one port write (the changing channels are low); write both new duties.
+ *   boundary N+2: CONNECT - both new duties are in effect: connect the channels with power, disconnect the rest.
+ * Without a direction change it's APPLY then CONNECT - both channels still change on the same boundary.
+ */
+void HoverboardDrive::timerBoundary() {
+    HoverboardDrive *drive = synchronousDrive;
+    if (drive->updatePhase == HOVERBOARD_UPDATE_ZERO) {
+        byte changing = drive->pendingDirections ^ drive->appliedDirections;
+        if (changing & drive->leftDirectionMask)
+            *drive->leftTccr &= ~drive->leftCom;
+        if (changing & drive->rightDirectionMask)
+            *drive->rightTccr &= ~drive->rightCom;
+        drive->updatePhase = HOVERBOARD_UPDATE_APPLY;
+        return;
     }
-    if (rightMotorPower != currentRightMotorPower) {
-        digitalWrite(rightMotorDirectionPin, reverseRightMotor ? rightMotorPower < 0 : rightMotorPower >= 0);
-        analogWrite(rightMotorSpeedPin, rightMotorPower > 0 ? (255 * rightMotorPower / 100) : (255 * rightMotorPower / -100));
-        currentRightMotorPower = rightMotorPower;
+    if (drive->updatePhase == HOVERBOARD_UPDATE_APPLY) {
+        byte mask = drive->leftDirectionMask | drive->rightDirectionMask;
+        *drive->directionPort = (*drive->directionPort & ~mask) | drive->pendingDirections;
+        drive->appliedDirections = drive->pendingDirections;
+        *drive->leftOcr = drive->pendingLeftDuty;
+        *drive->rightOcr = drive->pendingRightDuty;
+        drive->updatePhase = HOVERBOARD_UPDATE_CONNECT;
+        return;
+    }
+    if (*drive->leftOcr != 0)
+        *drive->leftTccr |= drive->leftCom;
+    else
+        *drive->leftTccr &= ~drive->leftCom;
+    if (*drive->rightOcr != 0)
+        *drive->rightTccr |= drive->rightCom;
+    else
+        *drive->rightTccr &= ~drive->rightCom;
+    drive->updatePhase = HOVERBOARD_UPDATE_IDLE;
+    TIMSK2 &= ~_BV(TOIE2); // No more interrupts until there's something to do.
+}
+
+/**
+ * Called when any Hall pin changes. Steps each motor along the Hall sequence to its new state. See ODOMETRY.
+ */
+void HoverboardDrive::hallChange() {
+    HoverboardDrive *drive = odometryDrive;
+    for (byte motor = 0; motor < 2; motor++) {
+        byte state = 0;
+        for (byte i = 0; i < 3; i++)
+            if (*drive->hallInput[motor * 3 + i] & drive->hallMask[motor * 3 + i])
+                state |= _BV(i);
+        int8_t position = hallPosition[state];
+        if (position < 0)
+            continue; // 000 or 111 - not a real state.
+        if (drive->hallState[motor] != 0)
+            drive->hallSteps[motor] += hallStep[(position - hallPosition[drive->hallState[motor]] + 6) % 6];
+        drive->hallState[motor] = state;
     }
 }
 
+/**
+ * @return the mean distance (mm) the two wheels have gone forwards since startup. 0 if we have no odometry.
+ */
+int32_t HoverboardDrive::getDistanceMm() {
+    noInterrupts();
+    int32_t left = hallSteps[0];
+    int32_t right = hallSteps[1];
+    interrupts();
+    if (reverseLeftMotor)
+        left = -left;
+    if (reverseRightMotor)
+        right = -right;
+    return ((int64_t) left + right) * HOVERBOARD_MM_PER_REV / (2 * HOVERBOARD_STEPS_PER_REV);
+}
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+ISR(TIMER2_OVF_vect) {
+    HoverboardDrive::timerBoundary();
+}
+
+ISR(PCINT0_vect) {
+    HoverboardDrive::hallChange();
+}
+
+ISR(PCINT1_vect) {
+    HoverboardDrive::hallChange();
+}
+
+ISR(PCINT2_vect) {
+    HoverboardDrive::hallChange();
+}
+#endif
+
 /**
  * SRnnn (debugging) report interval in ms
  * SP stop both motors.
@@ -147,4 +356,7 @@ void HoverboardDrive::command(char *commandLine) {
 void HoverboardDrive::report() {
     // Report on current speeds.
     Serial.print("SP"); Serial.print(currentLeftMotorPower); Serial.print(" "); Serial.println(currentRightMotorPower);
+    if (odometry) {
+        Serial.print("SO"); Serial.println(getDistanceMm());
+    }
 }
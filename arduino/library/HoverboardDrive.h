@@ -12,9 +12,30 @@
  * PROTOCOL TO HOST
  *     Nothing by default.
  *     "SPnnn mmm" periodically if reporting power. nnn and mmm are left and right motor powers respectively (variable width fields)
+ *     "SOnnn" with it, if we have odometry: distance travelled (mm) since startup (see ODOMETRY).
  * PHILOSOPHY
  *     Power not speed. Speed is a Helm concept.
- *     Later, however we will measure distance travelled via the six Hall sensors.
+ *     But we do measure distance travelled, via the six Hall sensors, so the Helm can work out speed.
+ * ODOMETRY
+ *     Each motor's three Hall sensors go through six states a pole pair (1, 3, 2, 6, 4, 5 - A is bit 0, C bit 2), one
+ *     way or the other. A pin change interrupt on any of the six pins looks at both motors, and counts each one's steps
+ *     through that sequence: +1 up it, -1 down it, +-2 if we missed one (3 can't be told apart, so isn't counted), and
+ *     000 or 111 (a glitch, or a sensor unplugged) is ignored. A reversed motor counts the other way, so forwards is
+ *     positive on both. getDistanceMm() is the mean of the two wheels.
+ *     If the distance goes the wrong way on a motor, swap its A and C Hall wires.
+ *     This needs (on a Nano) the Hall pins on pin change interrupts (all of them are), and the pin change interrupt
+ *     vectors - so don't use SoftwareSerial with this either.
+ * SYNCHRONOUS UPDATE
+ *     setMotorPowers() doesn't write the pins. It fills a buffer, and the Timer2 overflow interrupt applies both channels
+ *     (both directions in one port write, both duties in the double-buffered OCR registers) on the same PWM period boundary.
+ *     So a turn lands on both wheels together, not a PWM period apart.
+ *     If a direction changes, that channel is zeroed for one period first, so a motor is never driven the wrong way (even briefly).
+ *     Zero is the pin disconnected from its timer (held low), not OCR == 0: fast PWM still puts out a one count pulse at
+ *     OCR == 0, at the start of every period - just when the direction pin would change.
+ *     This needs (on a Nano) both speed pins on Timer0/Timer2 (pins 3, 5, 6, 11) and both direction pins on the same port.
+ *     Timer2 is switched to fast PWM (like Timer0) and the two are synchronised, so their periods start together.
+ *     Otherwise (or on other boards) we fall back to writing the pins directly, zeroing first if a direction changes.
+ *     Don't use tone() with this - it wants Timer2 too.
  * AUTHOR
  *     Scott BARNES 2019. IP freely on non-commercial applications.
  */
@@ -26,6 +47,15 @@
 #include "King.h"
 #include "DifferentialDrive.h"
 
+#define HOVERBOARD_UPDATE_IDLE   0 /* Nothing waiting */
+#define HOVERBOARD_UPDATE_ZERO   1 /* A direction changes: zero that channel at the next boundary, then apply */
+#define HOVERBOARD_UPDATE_APPLY  2 /* Apply directions and duties at the next boundary */
+#define HOVERBOARD_UPDATE_CONNECT 3 /* The new duties are in effect: connect the channels with power, disconnect those without */
+
+#define HOVERBOARD_HALLS         6 /* Left A, B, C, right A, B, C */
+#define HOVERBOARD_STEPS_PER_REV 90 /* Hall states a wheel goes through in a turn: 6 per pole pair, 15 pole pairs */
+#define HOVERBOARD_MM_PER_REV    518 /* 6.5" (165mm) tyre */
+
 class HoverboardDrive : public DifferentialDrive {
  private:
     byte leftMotorSpeedPin;
@@ -39,6 +69,34 @@ class HoverboardDrive : public DifferentialDrive {
     byte hallRightMotorBPin;
     byte hallRightMotorCPin;
     uint32_t nextReportAt = 0L;
+    // Synchronous update state (see SYNCHRONOUS UPDATE above).
+    byte synchronous = false;                // Both channels can be updated together on a timer boundary.
+    volatile uint8_t *directionPort = 0;     // The port both direction pins are on.
+    byte leftDirectionMask = 0;
+    byte rightDirectionMask = 0;
+    volatile uint8_t *leftOcr = 0;           // Output compare register for the left speed pin.
+    volatile uint8_t *rightOcr = 0;          // Output compare register for the right speed pin.
+    volatile uint8_t *leftTccr = 0;          // Timer control register with the left speed pin's COM bits ..
+    volatile uint8_t *rightTccr = 0;
+    byte leftCom = 0;                        // .. and the bit which connects the pin to the timer (non-inverting).
+    byte rightCom = 0;
+    volatile byte appliedDirections = 0;     // Direction bits currently on the port.
+    volatile byte pendingDirections = 0;     // Direction bits waiting for the next boundary.
+    volatile byte pendingLeftDuty = 0;       // [0 .. 255]
+    volatile byte pendingRightDuty = 0;      // [0 .. 255]
+    volatile byte updatePhase = 0;           // HOVERBOARD_UPDATE_IDLE, _ZERO, _APPLY or _CONNECT.
+    static HoverboardDrive *synchronousDrive; // The one the timer interrupt looks after.
+    // Odometry (see ODOMETRY above).
+    byte odometry = false;                   // The Hall pins are on pin change interrupts.
+    volatile uint8_t *hallInput[HOVERBOARD_HALLS]; // Input register for each Hall pin ..
+    byte hallMask[HOVERBOARD_HALLS];         // .. and its bit.
+    byte hallState[2] = { 0, 0 };            // Left, right: last good Hall state (0 => none yet).
+    volatile int32_t hallSteps[2] = { 0, 0 }; // Left, right: steps through the Hall sequence since startup.
+    static HoverboardDrive *odometryDrive;   // The one the pin change interrupts look after.
+    static volatile uint8_t *ocrForPin(byte pin, volatile uint8_t **tccr, byte *com);
+    void setupSynchronousPwm();
+    void setupOdometry();
+    void writeMotorPowers(byte leftDirection, byte leftDuty, byte rightDirection, byte rightDuty);
 public:
     HoverboardDrive(byte reverseLeftMotor, byte reverseRightMotor, byte leftMotorSpeedPin, byte leftMotorDirectionPin, byte rightMotorSpeedPin, byte rightMotorDirectionPin, byte hallLeftMotorAPin, byte hallLeftMotorBPin, byte hallLeftMotorCPin, byte hallRightMotorAPin, byte hallRightMotorBPin, byte hallRightMotorCPin);
     virtual void setup();
@@ -47,6 +105,10 @@ public:
     virtual void setMotorPowers(int leftMotorPower, int rightMotorPower); // percent [-100 .. +100] -v is reverse.
     virtual void report();
     virtual void resetMotors();
+    virtual byte hasOdometry() { return odometry; };
+    virtual int32_t getDistanceMm();
+    static void timerBoundary();             // Called from the Timer2 overflow interrupt. Not for general use.
+    static void hallChange();                // Called from the pin change interrupts. Not for general use.
 };
 
 #endif /* HoverboardDrive_h */
@@ -1,6 +1,16 @@
 /*
   I2C.cpp - I2C library
   Copyright (c) 2011-2012 Wayne Truchsess.  All right reserved.
+  Rev 6.0 - 2019 (kangarouter)
+          - The TWI is now driven by its interrupt (see I2cBus.h),
+            which can also run transactions in the background. The
+            functions here queue one and wait for it, so they still
+            block, and return the same codes.
+          - timeOut() now limits the whole transaction (including any
+            queued ahead of it), not each step.
+          - Without a timeOut(), a transaction goes through
+            I2cBus::run() (one attempt), so a stuck one is timed out
+            and the bus recovered, instead of waited on for ever.
   Rev 5.0 - January 24th, 2012
           - Removed the use of interrupts completely from the library
             so TWI state changes are now polled. 
@@ -61,6 +71,7 @@
 
 #include <inttypes.h>
 #include "I2C.h"
+#include "I2cBus.h"
 
 
 
@@ -80,28 +91,12 @@ I2C::I2C()
 
 void I2C::begin()
 {
-  #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__)
-    // activate internal pull-ups for twi
-    // as per note from atmega8 manual pg167
-    sbi(PORTC, 4);
-    sbi(PORTC, 5);
-  #else
-    // activate internal pull-ups for twi
-    // as per note from atmega128 manual pg204
-    sbi(PORTD, 0);
-    sbi(PORTD, 1);
-  #endif
-  // initialize twi prescaler and bit rate
-  cbi(TWSR, TWPS0);
-  cbi(TWSR, TWPS1);
-  TWBR = ((F_CPU / 100000) - 16) / 2;
-  // enable twi module and acks
-  TWCR = _BV(TWEN) | _BV(TWEA); 
+  i2cBus.begin();
 }
 
 void I2C::end()
 {
-  TWCR = 0;
+  i2cBus.end();
 }
 
 void I2C::timeOut(uint16_t _timeOut)
@@ -111,46 +106,12 @@ void I2C::timeOut(uint16_t _timeOut)
 
 void I2C::setSpeed(uint8_t _fast)
 {
-  if(!_fast)
-  {
-    TWBR = ((F_CPU / 100000) - 16) / 2;
-  }
-  else
-  {
-    TWBR = ((F_CPU / 400000) - 16) / 2;
-  }
+  i2cBus.setSpeed(_fast);
 }
   
 void I2C::pullup(uint8_t activate)
 {
-  if(activate)
-  {
-    #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__)
-      // activate internal pull-ups for twi
-      // as per note from atmega8 manual pg167
-      sbi(PORTC, 4);
-      sbi(PORTC, 5);
-    #else
-      // activate internal pull-ups for twi
-      // as per note from atmega128 manual pg204
-      sbi(PORTD, 0);
-      sbi(PORTD, 1);
-    #endif
-  }
-  else
-  {
-    #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__)
-      // deactivate internal pull-ups for twi
-      // as per note from atmega8 manual pg167
-      cbi(PORTC, 4);
-      cbi(PORTC, 5);
-    #else
-      // deactivate internal pull-ups for twi
-      // as per note from atmega128 manual pg204
-      cbi(PORTD, 0);
-      cbi(PORTD, 1);
-    #endif
-  }
+  i2cBus.pullup(activate);
 }
 
 void I2C::scan()
@@ -163,11 +124,7 @@ void I2C::scan()
   for(uint8_t s = 0; s <= 0x7F; s++)
   {
     returnStatus = 0;
-    returnStatus = start();
-    if(!returnStatus)
-    { 
-      returnStatus = sendAddress(SLA_W(s));
-    }
+    returnStatus = transfer(s, 0, I2C_BUS_NO_REGISTER, 0, 0);
     if(returnStatus)
     {
       if(returnStatus == 1)
@@ -184,7 +141,6 @@ void I2C::scan()
       Serial.println(s,HEX);
       totalDevicesFound++;
     }
-    stop();
   }
   if(!totalDevicesFound){Serial.println("No devices found");}
   timeOutDelay = tempTime;
@@ -233,27 +189,7 @@ uint8_t I2C::receive()
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress)
 {
-  returnStatus = 0;
-  returnStatus = start();
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_W(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(2);}
-    return(returnStatus);
-  }
-  returnStatus = sendByte(registerAddress);
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(3);}
-    return(returnStatus);
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
+  returnStatus = transfer(address, registerAddress, 0, 0, 0);
   return(returnStatus);
 }
 
@@ -264,33 +200,7 @@ uint8_t I2C::write(int address, int registerAddress)
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint8_t data)
 {
-  returnStatus = 0;
-  returnStatus = start(); 
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_W(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(2);}
-    return(returnStatus);
-  }
-  returnStatus = sendByte(registerAddress);
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(3);}
-    return(returnStatus);
-  }
-  returnStatus = sendByte(data);
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(3);}
-    return(returnStatus);
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
+  returnStatus = transfer(address, registerAddress, 0, &data, 1);
   return(returnStatus);
 }
 
@@ -309,36 +219,7 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, char *data)
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint8_t *data, uint8_t numberBytes)
 {
-  returnStatus = 0;
-  returnStatus = start();
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_W(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(2);}
-    return(returnStatus);
-  }
-  returnStatus = sendByte(registerAddress);
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(3);}
-    return(returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    returnStatus = sendByte(data[i]);
-    if(returnStatus)
-      {
-        if(returnStatus == 1){return(3);}
-        return(returnStatus);
-      }
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
+  returnStatus = transfer(address, registerAddress, 0, data, numberBytes);
   return(returnStatus);
 }
 
@@ -349,45 +230,7 @@ uint8_t I2C::read(int address, int numberBytes)
 
 uint8_t I2C::read(uint8_t address, uint8_t numberBytes)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if(numberBytes == 0){numberBytes++;}
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = start();
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_R(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(5);}
-    return(returnStatus);
-  }
-  for(uint8_t i = 0; i < numberBytes; i++)
-  {
-    if( i == nack )
-    {
-      returnStatus = receiveByte(0);
-      if(returnStatus == 1){return(6);}
-
-      if(returnStatus != MR_DATA_NACK){return(returnStatus);}
-    }
-    else
-    {
-      returnStatus = receiveByte(1);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_ACK){return(returnStatus);}
-    }
-    data[i] = TWDR;
-    bytesAvailable = i+1;
-    totalBytes = i+1;
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
-  return(returnStatus);
+  return(read(address, numberBytes, data));
 }
 
 uint8_t I2C::read(int address, int registerAddress, int numberBytes)
@@ -397,62 +240,7 @@ uint8_t I2C::read(int address, int registerAddress, int numberBytes)
 
 uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if(numberBytes == 0){numberBytes++;}
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = start();
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_W(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(2);}
-    return(returnStatus);
-  }
-  returnStatus = sendByte(registerAddress);
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(3);}
-    return(returnStatus);
-  }
-  returnStatus = start();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(4);}
-    return(returnStatus);
-  }
-  returnStatus = sendAddress(SLA_R(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(5);}
-    return(returnStatus);
-  }
-  for(uint8_t i = 0; i < numberBytes; i++)
-  {
-    if( i == nack )
-    {
-      returnStatus = receiveByte(0);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_NACK){return(returnStatus);}
-    }
-    else
-    {
-      returnStatus = receiveByte(1);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_ACK){return(returnStatus);}
-    }
-    data[i] = TWDR;
-    bytesAvailable = i+1;
-    totalBytes = i+1;
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
-  return(returnStatus);
+  return(read(address, registerAddress, numberBytes, data));
 }
 
 uint8_t I2C::read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
@@ -460,40 +248,7 @@ uint8_t I2C::read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
   bytesAvailable = 0;
   bufferIndex = 0;
   if(numberBytes == 0){numberBytes++;}
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = start();
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_R(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(5);}
-    return(returnStatus);
-  }
-  for(uint8_t i = 0; i < numberBytes; i++)
-  {
-    if( i == nack )
-    {
-      returnStatus = receiveByte(0);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_NACK){return(returnStatus);}
-    }
-    else
-    {
-      returnStatus = receiveByte(1);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_ACK){return(returnStatus);}
-    }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i+1;
-    totalBytes = i+1;
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
+  returnStatus = transfer(address, 0, I2C_BUS_READ | I2C_BUS_NO_REGISTER, dataBuffer, numberBytes);
   return(returnStatus);
 }
 
@@ -502,58 +257,7 @@ uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes,
   bytesAvailable = 0;
   bufferIndex = 0;
   if(numberBytes == 0){numberBytes++;}
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = start();
-  if(returnStatus){return(returnStatus);}
-  returnStatus = sendAddress(SLA_W(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(2);}
-    return(returnStatus);
-  }
-  returnStatus = sendByte(registerAddress);
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(3);}
-    return(returnStatus);
-  }
-  returnStatus = start();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(4);}
-    return(returnStatus);
-  }
-  returnStatus = sendAddress(SLA_R(address));
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(5);}
-    return(returnStatus);
-  }
-  for(uint8_t i = 0; i < numberBytes; i++)
-  {
-    if( i == nack )
-    {
-      returnStatus = receiveByte(0);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_NACK){return(returnStatus);}
-    }
-    else
-    {
-      returnStatus = receiveByte(1);
-      if(returnStatus == 1){return(6);}
-      if(returnStatus != MR_DATA_ACK){return(returnStatus);}
-    }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i+1;
-    totalBytes = i+1;
-  }
-  returnStatus = stop();
-  if(returnStatus)
-  {
-    if(returnStatus == 1){return(7);}
-    return(returnStatus);
-  }
+  returnStatus = transfer(address, registerAddress, I2C_BUS_READ, dataBuffer, numberBytes);
   return(returnStatus);
 }
 
@@ -561,149 +265,45 @@ uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes,
 /////////////// Private Methods ////////////////////////////////////////
 
 
-uint8_t I2C::start()
-{
-  unsigned long startingTime = millis();
-  TWCR = (1<<TWINT)|(1<<TWSTA)|(1<<TWEN);
-  while (!(TWCR & (1<<TWINT)))
-  {
-    if(!timeOutDelay){continue;}
-    if((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return(1);
-    }
-       
-  }
-  if ((TWI_STATUS == START) || (TWI_STATUS == REPEATED_START))
-  {
-    return(0);
-  }
-  if (TWI_STATUS == LOST_ARBTRTN)
-  {
-    uint8_t bufferedStatus = TWI_STATUS;
-    lockUp();
-    return(bufferedStatus);
-  }
-  return(TWI_STATUS);
-}
-
-uint8_t I2C::sendAddress(uint8_t i2cAddress)
-{
-  TWDR = i2cAddress;
-  unsigned long startingTime = millis();
-  TWCR = (1<<TWINT) | (1<<TWEN);
-  while (!(TWCR & (1<<TWINT)))
-  {
-    if(!timeOutDelay){continue;}
-    if((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return(1);
-    }
-       
-  }
-  if ((TWI_STATUS == MT_SLA_ACK) || (TWI_STATUS == MR_SLA_ACK))
-  {
-    return(0);
-  }
-  uint8_t bufferedStatus = TWI_STATUS;
-  if ((TWI_STATUS == MT_SLA_NACK) || (TWI_STATUS == MR_SLA_NACK))
-  {
-    stop();
-    return(bufferedStatus);
-  }
-  else
-  {
-    lockUp();
-    return(bufferedStatus);
-  } 
-}
-
-uint8_t I2C::sendByte(uint8_t i2cData)
-{
-  TWDR = i2cData;
-  unsigned long startingTime = millis();
-  TWCR = (1<<TWINT) | (1<<TWEN);
-  while (!(TWCR & (1<<TWINT)))
-  {
-    if(!timeOutDelay){continue;}
-    if((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return(1);
-    }
-       
-  }
-  if (TWI_STATUS == MT_DATA_ACK)
-  {
-    return(0);
-  }
-  uint8_t bufferedStatus = TWI_STATUS;
-  if (TWI_STATUS == MT_DATA_NACK)
-  {
-    stop();
-    return(bufferedStatus);
-  }
-  else
-  {
-    lockUp();
-    return(bufferedStatus);
-  } 
-}
+/* Queues the transaction on the I2cBus and waits for it - or, if
+   timeOutDelay is set, until that many milliseconds have passed, when
+   it is cancelled (returning the point it got to, 1 - 7). If it isn't,
+   I2cBus::run() times it out instead (see I2cBus.h BLOCKING), once it
+   has been on the bus too long for its length. Either way the bytes
+   read so far are available(). */
 
-uint8_t I2C::receiveByte(uint8_t ack)
+uint8_t I2C::transfer(uint8_t address, uint8_t registerAddress, uint8_t flags, uint8_t *buffer, uint8_t numberBytes)
 {
-  unsigned long startingTime = millis();
-  if(ack)
-  {
-    TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA);
-
+  I2cTransaction transaction;
+  transaction.address = address;
+  transaction.registerAddress = registerAddress;
+  transaction.flags = flags;
+  transaction.buffer = buffer;
+  transaction.length = numberBytes;
+  transaction.callback = 0;
+  if(!timeOutDelay)
+  {
+    static const I2cRetryPolicy once = { 1, 0, 0 };
+    i2cBus.run(&transaction, &once);
   }
   else
   {
-    TWCR = (1<<TWINT) | (1<<TWEN);
-  }
-  while (!(TWCR & (1<<TWINT)))
-  {
-    if(!timeOutDelay){continue;}
-    if((millis() - startingTime) >= timeOutDelay)
+    i2cBus.submit(&transaction);
+    unsigned long startingTime = millis();
+    while (transaction.status == I2C_BUS_PENDING)
     {
-      lockUp();
-      return(1);
+      if((millis() - startingTime) >= timeOutDelay)
+      {
+        i2cBus.cancel(&transaction);
+      }
     }
   }
-  if (TWI_STATUS == LOST_ARBTRTN)
-  {
-    uint8_t bufferedStatus = TWI_STATUS;
-    lockUp();
-    return(bufferedStatus);
-  }
-  return(TWI_STATUS); 
-}
-
-uint8_t I2C::stop()
-{
-  unsigned long startingTime = millis();
-  TWCR = (1<<TWINT)|(1<<TWEN)| (1<<TWSTO);
-  while ((TWCR & (1<<TWSTO)))
+  if(flags & I2C_BUS_READ)
   {
-    if(!timeOutDelay){continue;}
-    if((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return(1);
-    }
-       
+    bytesAvailable = transaction.done;
+    totalBytes = transaction.done;
   }
-  return(0);
-}
-
-void I2C::lockUp()
-{
-  TWCR = 0; //releases SDA and SCL lines to high impedance
-  TWCR = _BV(TWEN) | _BV(TWEA); //reinitialize TWI 
+  return(transaction.status);
 }
 
 I2C I2c = I2C();
-
@@ -1,6 +1,16 @@
 /*
   I2C.h   - I2C library
   Copyright (c) 2011-2012 Wayne Truchsess.  All right reserved.
+  Rev 6.0 - 2019 (kangarouter)
+          - The TWI is now driven by its interrupt (see I2cBus.h),
+            which can also run transactions in the background. The
+            functions here queue one and wait for it, so they still
+            block, and return the same codes.
+          - timeOut() now limits the whole transaction (including any
+            queued ahead of it), not each step.
+          - Without a timeOut(), a transaction goes through
+            I2cBus::run() (one attempt), so a stuck one is timed out
+            and the bus recovered, instead of waited on for ever.
   Rev 5.0 - January 24th, 2012
           - Removed the use of interrupts completely from the library
             so TWI state changes are now polled. 
@@ -114,14 +124,8 @@ class I2C
 
 
   private:
-    uint8_t start();
-    uint8_t sendAddress(uint8_t);
-    uint8_t sendByte(uint8_t);
-    uint8_t receiveByte(uint8_t);
-    uint8_t stop();
-    void lockUp();
+    uint8_t transfer(uint8_t, uint8_t, uint8_t, uint8_t*, uint8_t);
     uint8_t returnStatus;
-    uint8_t nack;
     uint8_t data[MAX_BUFFER_SIZE];
     static uint8_t bytesAvailable;
     static uint8_t bufferIndex;
@@ -0,0 +1,456 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     I2cBus.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <Arduino.h>
+
+#include "I2cBus.h"
+
+// TWI status codes (TWSR & 0xF8), master modes.
+#define I2C_BUS_START           0x08
+#define I2C_BUS_REPEATED_START  0x10
+#define I2C_BUS_MT_SLA_ACK      0x18
+#define I2C_BUS_MT_SLA_NACK     0x20
+#define I2C_BUS_MT_DATA_ACK     0x28
+#define I2C_BUS_MT_DATA_NACK    0x30
+#define I2C_BUS_MR_SLA_ACK      0x40
+#define I2C_BUS_MR_SLA_NACK     0x48
+#define I2C_BUS_MR_DATA_ACK     0x50
+#define I2C_BUS_MR_DATA_NACK    0x58
+
+// The TWI pins, for recover(). Same as pullup().
+#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__)
+#define I2C_BUS_PORT            PORTC
+#define I2C_BUS_DDR             DDRC
+#define I2C_BUS_PIN             PINC
+#define I2C_BUS_SDA             _BV(4)
+#define I2C_BUS_SCL             _BV(5)
+#else
+#define I2C_BUS_PORT            PORTD
+#define I2C_BUS_DDR             DDRD
+#define I2C_BUS_PIN             PIND
+#define I2C_BUS_SDA             _BV(1)
+#define I2C_BUS_SCL             _BV(0)
+#endif
+
+#define I2C_BUS_TWBR(hz)        (((F_CPU / (hz)) - 16) / 2)
+
+#define I2C_BUS_NEXT            (_BV(TWINT) | _BV(TWEN) | _BV(TWIE))  /* Go on to the next step, interrupt when it's done */
+
+I2cBus i2cBus;
+
+I2cBus::I2cBus() {
+    for (byte i = 0; i < I2C_BUS_DEVICES; i++) {
+        statistics[i].address = 0xFF;
+        statistics[i].priority = 0;
+        statistics[i].deadlineUs = 0L;
+    }
+    clearStatistics();
+}
+
+ISR(TWI_vect) {
+    i2cBus.interrupt();
+}
+
+/**
+ * Should be called by setup() in the .ino sketch (or by I2c.begin(), or Wire.begin() - see I2cWire).
+ */
+void I2cBus::begin() {
+    pullup(true);
+    TWSR &= ~(_BV(TWPS0) | _BV(TWPS1)); // Prescaler 1.
+    setSpeed(false);
+    TWCR = _BV(TWEN) | _BV(TWEA);
+}
+
+void I2cBus::end() {
+    TWCR = 0;
+}
+
+void I2cBus::setSpeed(uint8_t fast) {
+    speedHz = fast ? 400000L : 100000L;
+    twbr = I2C_BUS_TWBR(speedHz);
+    TWBR = twbr;
+}
+
+/**
+ * Nine clocks a byte (eight and the ACK) - the address, the register, the data, and the address again after a repeated
+ * START - and about one for each START and STOP.
+ */
+uint32_t I2cBus::timeoutUs(const I2cTransaction *transaction) {
+    byte hasRegister = !(transaction->flags & I2C_BUS_NO_REGISTER);
+    byte restarts = hasRegister && (transaction->flags & I2C_BUS_READ);
+    uint16_t bytes = 1 + hasRegister + transaction->length + restarts;
+    uint32_t clocks = bytes * 9L + 2 + restarts;
+    uint32_t hz = (transaction->flags & I2C_BUS_FAST) ? 400000L : speedHz;
+    return clocks * 1000000L / hz * I2C_BUS_TIMEOUT_FACTOR + I2C_BUS_TIMEOUT_SLACK_US;
+}
+
+uint32_t I2cBus::worstCaseUs(const I2cTransaction *transaction, const I2cRetryPolicy *policy) {
+    uint8_t attempts = max(policy->attempts, (uint8_t) 1);
+    uint32_t worst = attempts * (timeoutUs(transaction) + I2C_BUS_RECOVERY_US); // Each may time out, and recover.
+    uint16_t backoffUs = policy->backoffUs;
+    for (uint8_t i = 1; i < attempts; i++) {
+        worst += backoffUs;
+        backoffUs = min((uint32_t) backoffUs * 2, (uint32_t) policy->maxBackoffUs);
+    }
+    return worst;
+}
+
+/**
+ * Each attempt waits for whatever is queued ahead of it too. Rather than add up their timeouts at submit() (which a
+ * higher priority transaction jumping the queue would make wrong), we watch the transaction on the bus: each one gets its
+ * own timeoutUs() from its START, and is cancelled (and the bus recovered) if it overruns - ours or not, since nothing
+ * else times out a transaction which was only submit()ted. See BLOCKING.
+ * Call it with interrupts on (not from a callback).
+ */
+I2cResult I2cBus::run(I2cTransaction *transaction, const I2cRetryPolicy *policy) {
+    I2cResult result;
+    uint8_t attempts = max(policy->attempts, (uint8_t) 1);
+    uint16_t backoffUs = policy->backoffUs;
+    uint32_t startedAt = micros();
+    result.status = I2C_BUS_PENDING;
+    for (result.attempts = 1; ; result.attempts++) {
+        I2cTransaction *watched = 0;
+        uint32_t watchedStartedAt = 0L;
+        uint32_t limitUs = 0L;
+        submit(transaction);
+        while (transaction->status == I2C_BUS_PENDING) {
+            uint32_t now = micros();
+            uint8_t oldSREG = SREG;
+            cli(); // The head may finish (and the next one start) under us.
+            if (head != watched || startedAtUs != watchedStartedAt) { // Progress. (The same transaction again counts.)
+                watched = head;
+                watchedStartedAt = startedAtUs;
+                limitUs = watched != 0 ? timeoutUs(watched) : 0L;
+            } else if (watched != 0 && now - watchedStartedAt >= limitUs) {
+                cancel(watched); // Stalled. If it was ours, this attempt has failed; if not, ours moves up.
+            }
+            SREG = oldSREG;
+        }
+        result.status = transaction->status;
+        if (result.status == 0 || result.attempts >= attempts)
+            break;
+        delayMicroseconds(backoffUs);
+        backoffUs = min((uint32_t) backoffUs * 2, (uint32_t) policy->maxBackoffUs);
+    }
+    result.elapsedUs = micros() - startedAt;
+    return result;
+}
+
+void I2cBus::clearStatistics() {
+    for (byte i = 0; i < I2C_BUS_DEVICES; i++) {
+        statistics[i].transactions = statistics[i].nacks = statistics[i].timeouts = statistics[i].recoveries = 0;
+        statistics[i].maxLatencyUs = statistics[i].maxWaitUs = 0L;
+        statistics[i].deadlineMisses = 0;
+    }
+}
+
+/**
+ * Call it before the device's first transaction (setup()). A transaction already queued keeps the priority it had.
+ * @param deadlineUs 0 => none.
+ */
+byte I2cBus::setDevice(uint8_t address, uint8_t priority, uint32_t deadlineUs) {
+    uint8_t oldSREG = SREG;
+    cli();
+    I2cDeviceStatistics *device = statisticsFor(address, true);
+    if (device != 0) {
+        device->priority = priority;
+        device->deadlineUs = deadlineUs;
+    }
+    SREG = oldSREG;
+    return device != 0;
+}
+
+/**
+ * @param add take a free entry for the address if it hasn't got one.
+ * @return 0 if there's no entry (and no room, if add).
+ */
+I2cDeviceStatistics *I2cBus::statisticsFor(uint8_t address, byte add) {
+    for (byte i = 0; i < I2C_BUS_DEVICES; i++)
+        if (statistics[i].address == address)
+            return &statistics[i];
+    if (add)
+        for (byte i = 0; i < I2C_BUS_DEVICES; i++)
+            if (statistics[i].address == 0xFF) {
+                statistics[i].address = address;
+                return &statistics[i];
+            }
+    return 0;
+}
+
+/**
+ * A transaction has finished with this status. Called with interrupts off.
+ * @param waitUs in the queue, @param latencyUs on the bus - between them, submit() to finished.
+ */
+void I2cBus::tally(I2cTransaction *transaction, uint8_t status, uint32_t waitUs, uint32_t latencyUs) {
+    if ((transaction->flags & I2C_BUS_NO_REGISTER) && transaction->length == 0)
+        return; // A probe.
+    I2cDeviceStatistics *device = statisticsFor(transaction->address, true);
+    if (device == 0)
+        return;
+    if (device->transactions < 0xFFFF)
+        device->transactions++;
+    if ((status == 0x20 || status == 0x30 || status == 0x48) && device->nacks < 0xFFFF)
+        device->nacks++;
+    if (status >= 1 && status <= 7 && device->timeouts < 0xFFFF)
+        device->timeouts++;
+    if (latencyUs > device->maxLatencyUs)
+        device->maxLatencyUs = latencyUs;
+    if (waitUs > device->maxWaitUs)
+        device->maxWaitUs = waitUs;
+    if (device->deadlineUs != 0 && waitUs + latencyUs > device->deadlineUs && device->deadlineMisses < 0xFFFF)
+        device->deadlineMisses++;
+}
+
+void I2cBus::report(const char *prefix) {
+    for (byte i = 0; i < I2C_BUS_DEVICES; i++) {
+        I2cDeviceStatistics *device = &statistics[i];
+        if (device->address == 0xFF)
+            continue;
+        Serial.print(prefix);
+        Serial.print(device->address, HEX); Serial.print(" ");
+        Serial.print(device->transactions); Serial.print(" ");
+        Serial.print(device->nacks); Serial.print(" ");
+        Serial.print(device->timeouts); Serial.print(" ");
+        Serial.print(device->recoveries); Serial.print(" ");
+        Serial.print(device->maxLatencyUs); Serial.print(" ");
+        Serial.print(device->maxWaitUs); Serial.print(" ");
+        Serial.print(device->deadlineUs); Serial.print(" ");
+        Serial.println(device->deadlineMisses);
+    }
+}
+
+/**
+ * The internal pull-ups are weak (~50k), but they're better than floating. See the atmega328 datasheet, TWI.
+ */
+void I2cBus::pullup(uint8_t activate) {
+#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__)
+    if (activate)
+        PORTC |= _BV(4) | _BV(5);
+    else
+        PORTC &= ~(_BV(4) | _BV(5));
+#else
+    if (activate)
+        PORTD |= _BV(0) | _BV(1);
+    else
+        PORTD &= ~(_BV(0) | _BV(1));
+#endif
+}
+
+/**
+ * Goes in behind everything of its priority or higher - never ahead of the head, which is on the bus. See SCHEDULING.
+ * @return false (and does nothing) if the transaction is already in the queue.
+ */
+byte I2cBus::submit(I2cTransaction *transaction) {
+    uint8_t oldSREG = SREG;
+    cli();
+    for (I2cTransaction *queued = head; queued != 0; queued = queued->next)
+        if (queued == transaction) {
+            SREG = oldSREG;
+            return false;
+        }
+    transaction->status = I2C_BUS_PENDING;
+    transaction->stage = 1;
+    transaction->done = 0;
+    transaction->next = 0;
+    transaction->submittedAtUs = micros();
+    I2cDeviceStatistics *device = statisticsFor(transaction->address, false); // Not add - probes don't get an entry.
+    transaction->priority = device != 0 ? device->priority : 0;
+    if (head == 0) { // The bus was idle - start it. Otherwise the interrupt will get to it.
+        head = tail = transaction;
+        startHead(false);
+    } else {
+        I2cTransaction *after = head;
+        while (after->next != 0 && after->next->priority >= transaction->priority)
+            after = after->next;
+        transaction->next = after->next;
+        after->next = transaction;
+        if (after == tail)
+            tail = transaction;
+    }
+    SREG = oldSREG;
+    return true;
+}
+
+/**
+ * If the transaction is on the bus, the TWI is reset (whatever the slave was doing, it's abandoned).
+ * The callback is called, as for any other finish.
+ */
+void I2cBus::cancel(I2cTransaction *transaction) {
+    uint8_t oldSREG = SREG;
+    cli();
+    if (head == transaction) {
+        recover(transaction);
+        finish(transaction->stage, true);
+    } else {
+        for (I2cTransaction *queued = head; queued != 0; queued = queued->next)
+            if (queued->next == transaction) {
+                queued->next = transaction->next;
+                if (tail == transaction)
+                    tail = queued;
+                transaction->status = transaction->stage;
+                tally(transaction, transaction->status, micros() - transaction->submittedAtUs, 0L);
+                if (transaction->callback != 0)
+                    transaction->callback(transaction);
+                break;
+            }
+    }
+    SREG = oldSREG;
+}
+
+/**
+ * Puts a START on the bus for the transaction at the head of the queue.
+ * Called with interrupts off.
+ * @param afterStop the previous transaction is still on the bus - STOP it first (one step: the TWI does both).
+ */
+void I2cBus::startHead(byte afterStop) {
+    registerSent = (head->flags & I2C_BUS_NO_REGISTER) != 0;
+    head->stage = 1;
+    startedAtUs = micros();
+    TWBR = (head->flags & I2C_BUS_FAST) ? I2C_BUS_TWBR(400000L) : twbr; // See SPEED. Takes effect from the START.
+    if (afterStop) {
+        TWCR = I2C_BUS_NEXT | _BV(TWSTO) | _BV(TWSTA);
+        return;
+    }
+    // A STOP we left to finish by itself may still be going out. Writing TWSTA under it would be lost.
+    for (uint16_t spins = 0; (TWCR & _BV(TWSTO)) && spins < I2C_BUS_STOP_SPINS; spins++)
+        ;
+    TWCR = I2C_BUS_NEXT | _BV(TWSTA);
+}
+
+/**
+ * The transaction at the head of the queue is over: STOP it (unless the bus has been reset), start the next, and tell
+ * whoever is waiting.
+ * Called with interrupts off.
+ */
+void I2cBus::finish(uint8_t status, byte stopped) {
+    I2cTransaction *transaction = head;
+    tally(transaction, status, startedAtUs - transaction->submittedAtUs, micros() - startedAtUs);
+    head = transaction->next;
+    if (head == 0)
+        tail = 0;
+    if (!stopped)
+        transaction->stage = 7;
+    if (head != 0)
+        startHead(!stopped);
+    else if (!stopped)
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO); // Nothing else to do - no interrupt, the STOP finishes by itself.
+    transaction->status = status;
+    if (transaction->callback != 0)
+        transaction->callback(transaction);
+}
+
+/**
+ * Lets go of SDA and SCL, and starts the TWI again.
+ */
+void I2cBus::reset() {
+    TWCR = 0;
+    TWCR = _BV(TWEN) | _BV(TWEA);
+}
+
+/**
+ * See RECOVERY. The pins are driven open-drain style: low (output, 0) or let go (input, pulled up) - never driven high.
+ * @param transaction the one that was on the bus (for the statistics), or 0.
+ * @return true if SDA is free afterwards.
+ */
+byte I2cBus::recover(I2cTransaction *transaction) {
+    TWCR = 0; // The pins are ordinary port pins again.
+    I2C_BUS_DDR &= ~(I2C_BUS_SDA | I2C_BUS_SCL);
+    I2C_BUS_PORT |= I2C_BUS_SDA | I2C_BUS_SCL;
+    byte stretchUs = I2C_BUS_RECOVERY_STRETCH_US; // Shared by all the clocks - see RECOVERY.
+    for (byte i = 0; i < I2C_BUS_RECOVERY_CLOCKS && !(I2C_BUS_PIN & I2C_BUS_SDA); i++) {
+        I2C_BUS_PORT &= ~I2C_BUS_SCL; I2C_BUS_DDR |= I2C_BUS_SCL;    // SCL low.
+        delayMicroseconds(I2C_BUS_HALF_CLOCK_US);
+        I2C_BUS_DDR &= ~I2C_BUS_SCL; I2C_BUS_PORT |= I2C_BUS_SCL;    // Let SCL go ..
+        for (; stretchUs > 0 && !(I2C_BUS_PIN & I2C_BUS_SCL); stretchUs--) // .. (the slave may stretch it) ..
+            delayMicroseconds(1);
+        delayMicroseconds(I2C_BUS_HALF_CLOCK_US);                   // .. high.
+    }
+    // STOP: SDA rises while SCL is high.
+    I2C_BUS_PORT &= ~I2C_BUS_SCL; I2C_BUS_DDR |= I2C_BUS_SCL;
+    delayMicroseconds(I2C_BUS_HALF_CLOCK_US);
+    I2C_BUS_PORT &= ~I2C_BUS_SDA; I2C_BUS_DDR |= I2C_BUS_SDA;
+    delayMicroseconds(I2C_BUS_HALF_CLOCK_US);
+    I2C_BUS_DDR &= ~I2C_BUS_SCL; I2C_BUS_PORT |= I2C_BUS_SCL;
+    delayMicroseconds(I2C_BUS_HALF_CLOCK_US);
+    I2C_BUS_DDR &= ~I2C_BUS_SDA; I2C_BUS_PORT |= I2C_BUS_SDA;
+    delayMicroseconds(I2C_BUS_HALF_CLOCK_US);
+    byte free = (I2C_BUS_PIN & I2C_BUS_SDA) != 0;
+    reset();
+    if (transaction != 0 && !((transaction->flags & I2C_BUS_NO_REGISTER) && transaction->length == 0)) { // Not a probe.
+        I2cDeviceStatistics *device = statisticsFor(transaction->address, true);
+        if (device != 0 && device->recoveries < 0xFFFF)
+            device->recoveries++;
+    }
+    return free;
+}
+
+/**
+ * One step of the transaction at the head of the queue. See STAGES.
+ */
+void I2cBus::interrupt() {
+    I2cTransaction *transaction = head;
+    uint8_t twiStatus = TWSR & 0xF8;
+    if (transaction == 0) { // Cancelled under us. Nothing to do.
+        reset();
+        return;
+    }
+    switch (twiStatus) {
+    case I2C_BUS_START:
+    case I2C_BUS_REPEATED_START: {
+        byte reading = transaction->stage == 4 || (transaction->flags & (I2C_BUS_READ | I2C_BUS_NO_REGISTER)) == (I2C_BUS_READ | I2C_BUS_NO_REGISTER);
+        TWDR = (transaction->address << 1) | (reading ? 1 : 0);
+        transaction->stage = reading ? 5 : 2;
+        TWCR = I2C_BUS_NEXT;
+        break;
+    }
+    case I2C_BUS_MT_SLA_ACK:
+    case I2C_BUS_MT_DATA_ACK:
+        if (!registerSent) {
+            TWDR = transaction->registerAddress;
+            registerSent = true;
+            transaction->stage = 3;
+            TWCR = I2C_BUS_NEXT;
+        } else if (transaction->flags & I2C_BUS_READ) {
+            transaction->stage = 4;
+            TWCR = I2C_BUS_NEXT | _BV(TWSTA);
+        } else if (transaction->done < transaction->length) {
+            TWDR = transaction->buffer[transaction->done++];
+            transaction->stage = 3;
+            TWCR = I2C_BUS_NEXT;
+        } else
+            finish(0, false);
+        break;
+    case I2C_BUS_MR_DATA_ACK:
+        if (transaction->done < transaction->length)
+            transaction->buffer[transaction->done++] = TWDR;
+        // Fall through - ask for the next byte.
+    case I2C_BUS_MR_SLA_ACK:
+        transaction->stage = 6;
+        if (transaction->done + 1 < transaction->length)
+            TWCR = I2C_BUS_NEXT | _BV(TWEA); // ACK => we want more after this one.
+        else
+            TWCR = I2C_BUS_NEXT;             // NACK => this is the last.
+        break;
+    case I2C_BUS_MR_DATA_NACK:
+        if (transaction->done < transaction->length)
+            transaction->buffer[transaction->done++] = TWDR;
+        finish(0, false);
+        break;
+    case I2C_BUS_MT_SLA_NACK:
+    case I2C_BUS_MT_DATA_NACK:
+    case I2C_BUS_MR_SLA_NACK:
+        finish(twiStatus, false);
+        break;
+    default: // Lost arbitration, bus error, ... Let go of the bus, and make sure nobody else is holding it.
+        recover(transaction);
+        finish(twiStatus, true);
+        break;
+    }
+}
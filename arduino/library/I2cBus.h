@@ -0,0 +1,186 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     I2cBus
+ * PURPOSE
+ *     Interrupt-driven I2C (TWI) master. Runs a queue of transactions (write a register, read n bytes from a register) in
+ *     the background, so a sketch can start a sensor read and get on with control work while the bytes go over the wire.
+ *     Not a King - it is a driver. I2C.h (I2c.read(), I2c.write()) is a blocking wrapper around it, run() waits for a
+ *     transaction with retries (see BLOCKING), and I2cWire puts Wire's interface on top, for drivers written for Wire.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * DETAILS
+ *     A transaction is an I2cTransaction the caller owns (usually a global, or on the stack if the caller waits for it) - no
+ *     allocation, and the queue is just a linked list through them. submit() queues it; the TWI interrupt steps it through
+ *     START, address, register, (repeated START, address,) data and STOP, one byte per interrupt (~90us each at 100kHz),
+ *     then sets its status and calls its callback (if any), and starts the next one.
+ *     While a transaction is pending, leave it (and its buffer) alone.
+ *     The queue is in priority order - see SCHEDULING.
+ *     Each step of the transaction matches a timeout point of the old polled library (see STAGES), so a caller which gives
+ *     up waiting (cancel()) gets the same code I2c.read() always returned.
+ * STATUS
+ *     I2C_BUS_PENDING (0xFF) while queued or on the bus. Then
+ *         0         done.
+ *         1 - 7     cancelled (timed out) waiting at that stage - see STAGES.
+ *         0x20      address NACKed (write) - no such device, or it's busy.
+ *         0x30      data NACKed.
+ *         0x38      lost arbitration.
+ *         0x48      address NACKed (read).
+ *         others    unexpected TWI status (see the datasheet).
+ * STAGES
+ *     1 START, 2 address (write), 3 register / data out, 4 repeated START, 5 address (read), 6 data in, 7 STOP.
+ * SPEED
+ *     setSpeed() sets the bus speed for everything, but a transaction flagged I2C_BUS_FAST goes at 400kHz anyway: so a
+ *     device which can keep up (the LSM9DS0) gets fast mode, and one which can't shares the bus at 100kHz. The TWI's bit
+ *     rate is set before each START.
+ * SCHEDULING
+ *     setDevice() gives an address a priority (default 0, higher goes first) and a deadline. A transaction is queued behind
+ *     everything of its priority or higher, and ahead of anything lower - so an IMU read submitted while lidar reads are
+ *     waiting goes on the bus as soon as the transaction already on it finishes. Nothing is ever stopped part way: the
+ *     worst an IMU read waits is one transaction of someone else's (timeoutUs() of the longest), plus any other IMU reads.
+ *     A low priority device can be starved by a high priority one which keeps the queue full - keep high priority traffic
+ *     to what a control loop needs.
+ *     The deadline is the most a transaction of that device should take from submit() to finished (waiting in the queue
+ *     included). Nothing is dropped for missing it - it's counted (see STATISTICS), so the sketch can show the schedule works.
+ * BLOCKING
+ *     run() submits a transaction and waits for it, under an I2cRetryPolicy. While it waits it watches the transaction on
+ *     the bus (ours, or one queued ahead of it): one which has taken longer than its timeoutUs() since its START, worked
+ *     out from the bus speed and the bytes it puts on the wire, is cancelled and the bus recovered - whoever's it is, since
+ *     a transaction which was only submit()ted has nothing else to time it out. If it was ours, the attempt has failed;
+ *     if not, ours moves up. So higher priority work jumping the queue delays an attempt without timing it out, and a
+ *     stuck transaction of someone else's can't hold the bus for ever while anyone is run()ning. Failed attempts are
+ *     retried after a backoff which doubles up to a cap. It returns an I2cResult: the last status, the attempts it took,
+ *     and how long it blocked. worstCaseUs() is the most it can ever block for, so a sketch can add it up in advance.
+ * RECOVERY
+ *     Resetting the TWI only lets go of our side. A slave which was part way through sending a byte when we gave up (a
+ *     glitch, or the 5V IMU wiring) keeps holding SDA low, waiting for clocks that never come, and the bus is dead until
+ *     power-cycled. So whenever a transaction is cancelled on the bus (timed out), or the TWI reports a bus error or lost
+ *     arbitration, recover() takes the pins, clocks SCL by hand (up to 9 times) until the slave lets go of SDA, and puts a
+ *     STOP on the bus, before handing the pins back to the TWI. It runs with interrupts off (from the TWI interrupt, or
+ *     cancel()), so it is bounded: a slave stretching the clock gets I2C_BUS_RECOVERY_STRETCH_US over the whole recovery,
+ *     not per clock, which makes it at most I2C_BUS_RECOVERY_US (130us). worstCaseUs() counts one per attempt.
+ * STATISTICS
+ *     For each of the first I2C_BUS_DEVICES addresses used (or set up with setDevice()): transactions, NACKs, timeouts,
+ *     recoveries, the longest START-to-finish time, the longest wait in the queue (submit() to START), and deadlines missed.
+ *     Probes (no register, no data - eg I2c.scan()) aren't counted. report() writes them out, for a
+ *     sketch to send on when the host asks.
+ * CALLBACKS
+ *     Called from the interrupt, with interrupts off. Set a flag, or submit() the next transaction - nothing slow, no Serial.
+ * COST
+ *     A 2-byte register read is ~7 interrupts of a few microseconds each, instead of ~450us of spinning.
+ */
+
+#ifndef I2cBus_h
+#define I2cBus_h
+
+#include <Arduino.h>
+
+#define I2C_BUS_PENDING       0xFF     /* I2cTransaction.status until it's done */
+#define I2C_BUS_READ          0x01     /* I2cTransaction.flags: read into buffer (otherwise write buffer out) */
+#define I2C_BUS_NO_REGISTER   0x02     /* .. don't send registerAddress first */
+#define I2C_BUS_FAST          0x04     /* .. at 400kHz, whatever setSpeed() says. See SPEED. */
+#define I2C_BUS_STOP_SPINS    200      /* Most times we'll wait for the last STOP to finish before a new START (~40us) */
+#define I2C_BUS_TIMEOUT_FACTOR 2       /* A transaction times out after this many times its time on the wire .. */
+#define I2C_BUS_TIMEOUT_SLACK_US 200   /* .. plus this (interrupt latency, clock stretching) */
+#define I2C_BUS_DEVICES       4        /* Addresses we keep statistics for */
+#define I2C_BUS_RECOVERY_CLOCKS 9      /* Enough for a slave to finish any byte (8 bits and the ACK) */
+#define I2C_BUS_HALF_CLOCK_US 5        /* Recovery clocks at 100kHz */
+#define I2C_BUS_RECOVERY_STRETCH_US 20 /* Most clock stretching a recovery waits out, in all */
+#define I2C_BUS_RECOVERY_US ((2 * I2C_BUS_RECOVERY_CLOCKS + 4) * I2C_BUS_HALF_CLOCK_US + I2C_BUS_RECOVERY_STRETCH_US)
+                                       /* Longest a recovery takes: the clocks, the STOP, and the stretching */
+
+struct I2cTransaction;
+typedef void (*I2cCallback)(I2cTransaction *transaction);
+
+struct I2cTransaction {
+    uint8_t address;                  // 7 bit.
+    uint8_t registerAddress;          // Sent first (unless I2C_BUS_NO_REGISTER).
+    uint8_t flags;                    // I2C_BUS_READ, I2C_BUS_NO_REGISTER.
+    uint8_t *buffer;                  // Bytes to write after the register, or where to read into.
+    uint8_t length;                   // .. how many.
+    I2cCallback callback;             // Called when finished (from the interrupt). May be 0.
+    volatile uint8_t status;          // See STATUS.
+    volatile uint8_t stage;           // How far it got. See STAGES.
+    volatile uint8_t done;            // Bytes written or read so far.
+    I2cTransaction *next;             // The queue.
+    uint8_t priority;                 // Set by submit(), from setDevice(). See SCHEDULING.
+    uint32_t submittedAtUs;           // micros() at submit().
+};
+
+// How run() retries. Worst case (attempts timeouts and recoveries, and the backoffs between them) - see worstCaseUs().
+struct I2cRetryPolicy {
+    uint8_t attempts;                 // Tries in all. 0 is taken as 1.
+    uint16_t backoffUs;               // Wait this long before the first retry ..
+    uint16_t maxBackoffUs;            // .. doubling each retry, up to this. (delayMicroseconds() - keep it under 16383.)
+};
+
+// What run() did.
+struct I2cResult {
+    uint8_t status;                   // The last attempt's status (see STATUS). 0 => success.
+    uint8_t attempts;                 // Tries it took.
+    uint32_t elapsedUs;               // Time blocked in all, backoffs included.
+};
+
+// How the transactions with one address are scheduled, and what happened to them. See SCHEDULING, STATISTICS.
+struct I2cDeviceStatistics {
+    uint8_t address;                  // 0xFF => unused.
+    uint8_t priority;                 // Higher goes first.
+    uint32_t deadlineUs;              // submit() to finished. 0 => none.
+    uint16_t transactions;            // Finished (however). Counts saturate.
+    uint16_t nacks;
+    uint16_t timeouts;                // Cancelled.
+    uint16_t recoveries;              // Bus recoveries after one of its transactions.
+    uint32_t maxLatencyUs;            // Longest START to finish.
+    uint32_t maxWaitUs;               // Longest submit() to START.
+    uint16_t deadlineMisses;
+};
+
+class I2cBus {
+private:
+    I2cTransaction * volatile head = 0; // On the bus (or about to be).
+    I2cTransaction * volatile tail = 0;
+    byte registerSent = false;        // For the transaction at the head.
+    uint32_t speedHz = 100000L;       // SCL, for transactions not flagged I2C_BUS_FAST.
+    uint8_t twbr = 72;                // .. the TWI bit rate register for it.
+    uint32_t startedAtUs = 0L;        // micros() when the transaction at the head was STARTed.
+    I2cDeviceStatistics statistics[I2C_BUS_DEVICES];
+    void startHead(byte afterStop);
+    void finish(uint8_t status, byte stopped);
+    void reset();
+    byte recover(I2cTransaction *transaction);
+    void tally(I2cTransaction *transaction, uint8_t status, uint32_t waitUs, uint32_t latencyUs);
+    I2cDeviceStatistics *statisticsFor(uint8_t address, byte add);
+public:
+    I2cBus();
+    void begin();                     // Pull-ups on, 100kHz, TWI on.
+    void end();
+    void setSpeed(uint8_t fast);      // 400kHz if fast, otherwise 100kHz.
+    void pullup(uint8_t activate);
+    // Priority and deadline for the transactions with this address. Returns false if there's no room. See SCHEDULING.
+    byte setDevice(uint8_t address, uint8_t priority, uint32_t deadlineUs);
+    // Queues the transaction (status becomes I2C_BUS_PENDING), by priority. Returns false if it is already pending.
+    byte submit(I2cTransaction *transaction);
+    // Takes a pending transaction out of the queue - off the bus, if it's on it. Its status becomes its stage (1 - 7).
+    void cancel(I2cTransaction *transaction);
+    byte isIdle() { return head == 0; };
+    // Microseconds a transaction like this should take at most, on its own. See BLOCKING.
+    uint32_t timeoutUs(const I2cTransaction *transaction);
+    // The longest run() can block for this transaction under this policy (when nothing else is queued).
+    uint32_t worstCaseUs(const I2cTransaction *transaction, const I2cRetryPolicy *policy);
+    // Submits the transaction and waits for it, retrying as the policy says. See BLOCKING.
+    I2cResult run(I2cTransaction *transaction, const I2cRetryPolicy *policy);
+    // Frees a stuck bus. See RECOVERY. Returns true if SDA is high (free) afterwards.
+    byte recover() { return recover(0); };
+    // Statistics for this address, or 0 if we don't have any. See STATISTICS.
+    const I2cDeviceStatistics *getStatistics(uint8_t address) { return statisticsFor(address, false); };
+    void clearStatistics();           // The counts - not the addresses, priorities and deadlines.
+    // Writes a line for each address (hex address):
+    //     "<prefix>address transactions nacks timeouts recoveries maxLatencyUs maxWaitUs deadlineUs deadlineMisses"
+    void report(const char *prefix);
+    // The TWI interrupt. Steps the transaction at the head of the queue.
+    void interrupt();
+};
+
+extern I2cBus i2cBus;
+
+#endif /* I2cBus_h */
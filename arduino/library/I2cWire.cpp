@@ -0,0 +1,111 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     I2cWire.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <Arduino.h>
+
+#include "I2cWire.h"
+
+I2cWire Wire;
+
+/**
+ * Wire's setClock() takes any rate; the I2cBus does 100kHz and 400kHz, so anything from 400kHz up is fast.
+ */
+void I2cWire::setClock(uint32_t hz) {
+    if (hz >= 400000L)
+        flags |= I2C_BUS_FAST;
+    else
+        flags &= ~I2C_BUS_FAST;
+}
+
+void I2cWire::beginTransmission(uint8_t address) {
+    this->address = address;
+    length = 0;
+    index = 0;
+    overflowed = false;
+    held = false;
+}
+
+size_t I2cWire::write(uint8_t data) {
+    if (length >= I2C_WIRE_BUFFER) {
+        overflowed = true;
+        return 0;
+    }
+    buffer[length++] = data;
+    return 1;
+}
+
+size_t I2cWire::write(const uint8_t *data, size_t quantity) {
+    size_t written = 0;
+    while (written < quantity && write(data[written]) == 1)
+        written++;
+    return written;
+}
+
+/**
+ * Runs the transmission built up since beginTransmission() (the bytes go as they are - the first is usually a register,
+ * but that's the device's business).
+ * @return Wire's code - see RETURNS.
+ */
+uint8_t I2cWire::send() {
+    I2cTransaction transaction;
+    transaction.address = address;
+    transaction.registerAddress = 0;
+    transaction.flags = flags | I2C_BUS_NO_REGISTER;
+    transaction.buffer = buffer;
+    transaction.length = length;
+    transaction.callback = 0;
+    lastResult = i2cBus.run(&transaction, &policy);
+    length = 0;
+    index = 0;
+    switch (lastResult.status) {
+    case 0:    return 0;
+    case 0x20: return 2;
+    case 0x30: return 3;
+    default:   return lastResult.status <= 7 ? 5 : 4;
+    }
+}
+
+uint8_t I2cWire::endTransmission(uint8_t sendStop) {
+    if (overflowed) {
+        length = 0;
+        return 1;
+    }
+    if (!sendStop) { // Hold it for requestFrom(). See DETAILS.
+        held = true;
+        return 0;
+    }
+    return send();
+}
+
+/**
+ * @param sendStop ignored - a read always ends with a STOP (nothing in this tree chains a write after a read).
+ */
+uint8_t I2cWire::requestFrom(uint8_t address, uint8_t quantity, uint8_t sendStop) {
+    I2cTransaction transaction;
+    transaction.address = address;
+    transaction.registerAddress = 0;
+    transaction.flags = flags | I2C_BUS_READ | I2C_BUS_NO_REGISTER;
+    if (held) {
+        held = false;
+        if (address == this->address && length == 1) { // A register, then a repeated START: one register read.
+            transaction.registerAddress = buffer[0];
+            transaction.flags &= ~I2C_BUS_NO_REGISTER;
+        } else if (send() != 0) {
+            return 0;
+        }
+    }
+    transaction.buffer = buffer;
+    transaction.length = min(quantity, (uint8_t) I2C_WIRE_BUFFER);
+    transaction.callback = 0;
+    lastResult = i2cBus.run(&transaction, &policy);
+    index = 0;
+    length = lastResult.status == 0 ? transaction.length : 0;
+    return length;
+}
@@ -0,0 +1,73 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     I2cWire
+ * PURPOSE
+ *     Arduino's TwoWire interface (Wire.beginTransmission(), write(), endTransmission(), requestFrom(), read() ..) on top of
+ *     the I2cBus, so drivers written for Wire (Adafruit_LSM9DS0, Adafruit_LSM9DS1) and I2cBus users (the LidarLite) can
+ *     share one bus on one Nano.
+ *     Not a King - it is a driver.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * DETAILS
+ *     Arduino's Wire library drives the TWI itself (its own interrupt, its own state) - linked beside I2cBus, the two would
+ *     fight over the same hardware and pins. So it isn't linked at all: this header defines TwoWire (as I2cWire) and Wire,
+ *     and the Wire drivers include it instead of <Wire.h>. Don't include <Wire.h> anywhere in a sketch that uses this.
+ *     Every transmission and request becomes an I2cTransaction, run (blocking, as Wire's are) through I2cBus::run(). So:
+ *       - arbitration: Wire traffic queues with everything else - a Wire read waits for a LidarLite transaction already on
+ *         the bus, and vice versa. Nothing is ever interleaved mid-transaction.
+ *       - timeouts: each call gets I2cBus's timeout (worked out from its bytes), instead of Wire's forever, and the retry
+ *         policy set with setRetryPolicy() (default: one attempt, as Wire).
+ *       - speed: setClock(400000) flags Wire's transactions I2C_BUS_FAST - only Wire's. See SPEED in I2cBus.h.
+ *     endTransmission(false) (no STOP) holds the written bytes; if the next call is requestFrom() the same address, and
+ *     only one byte (a register) was written, the two go as one register read with a repeated START, as Wire would.
+ * RETURNS
+ *     endTransmission() as Wire: 0 ok, 1 too long for the buffer, 2 address NACK, 3 data NACK, 4 other, 5 timeout.
+ *     requestFrom() the bytes read (0 if it failed).
+ */
+
+#ifndef I2cWire_h
+#define I2cWire_h
+
+#include <Arduino.h>
+#include "I2cBus.h"
+
+#define I2C_WIRE_BUFFER  32                   /* Bytes - same as Wire's BUFFER_LENGTH */
+
+class I2cWire : public Stream {
+private:
+    uint8_t buffer[I2C_WIRE_BUFFER];          // Bytes to send, or received.
+    uint8_t length = 0;                       // .. how many.
+    uint8_t index = 0;                        // Next to read().
+    uint8_t address = 0;                      // Of the transmission being built (or held).
+    byte overflowed = false;                  // More written than the buffer holds.
+    byte held = false;                        // endTransmission(false) - waiting for a requestFrom().
+    uint8_t flags = 0;                        // I2C_BUS_FAST, if setClock() asked.
+    I2cRetryPolicy policy = { 1, 0, 0 };
+    I2cResult lastResult;
+    uint8_t send();
+public:
+    void begin() { i2cBus.begin(); };
+    void end() { i2cBus.end(); };
+    void setClock(uint32_t hz);
+    void setRetryPolicy(const I2cRetryPolicy &policy) { this->policy = policy; };
+    // How the last transmission or request went (status, attempts, time) - more than Wire's return codes say.
+    const I2cResult &getLastResult() { return lastResult; };
+    void beginTransmission(uint8_t address);
+    void beginTransmission(int address) { beginTransmission((uint8_t) address); };
+    uint8_t endTransmission(uint8_t sendStop = true);
+    uint8_t requestFrom(uint8_t address, uint8_t quantity, uint8_t sendStop = true);
+    uint8_t requestFrom(int address, int quantity) { return requestFrom((uint8_t) address, (uint8_t) quantity); };
+    virtual size_t write(uint8_t data);
+    virtual size_t write(const uint8_t *data, size_t quantity);
+    virtual int available() { return length - index; };
+    virtual int read() { return index < length ? buffer[index++] : -1; };
+    virtual int peek() { return index < length ? buffer[index] : -1; };
+    virtual void flush() {};
+    using Print::write;
+};
+
+typedef I2cWire TwoWire;                      // So drivers written for Wire take us as they are.
+extern I2cWire Wire;
+
+#endif /* I2cWire_h */
@@ -12,22 +12,365 @@
 
 #include <Arduino.h>
 #include "Imu.h"
+#include "I2cBus.h"
+#include "DifferentialDrive.h"
 #include <stdio.h>
 
+volatile uint16_t Imu::dataReadyCount = 0;
+volatile uint32_t Imu::dataReadyAtUs = 0L;
+
+/**
+ * Loads the magnetometer calibration.
+ */
+void Imu::setup() {
+    gyroGateWide = IMU_STILL_GYRO_WIDE_DPS / gyroScale;
+    gyroGateNarrow = IMU_STILL_GYRO_NARROW_DPS / gyroScale;
+    if (magCalibration.load(IMU_EEPROM_ADDRESS))
+        magCalibration.report("UM");
+    else
+        Serial.println("D No magnetometer calibration.");
+}
+
+/**
+ * Feed the calibration (if it's running) with the raw reading, then correct it.
+ */
+void Imu::correctMagnetic() {
+    checkReading(IMU_MAG, rawMagnetic, lastMagnetic);
+    memcpy(lastMagnetic, rawMagnetic, sizeof(lastMagnetic));
+    magCalibration.sample(rawMagnetic);
+    magCalibration.apply(rawMagnetic);
+}
+
+/**
+ * Sub-classes ask this on each read, and only read the magnetometer if it says so.
+ */
+byte Imu::magneticDue() {
+    uint32_t now = millis();
+    if ((int32_t) (now - nextMagneticAt) < 0)
+        return false;
+    nextMagneticAt = now + IMU_MAG_INTERVAL_MS;
+    return true;
+}
+
+/**
+ * Count saturated and stuck readings. See HEALTH.
+ */
+void Imu::checkReading(byte sensor, const int16_t *reading, const int16_t *previous) {
+    byte same = true;
+    for (byte a = 0; a < 3; a++) {
+        if (reading[a] >= IMU_SATURATION_COUNTS || reading[a] <= -IMU_SATURATION_COUNTS) {
+            saturatedReadings[sensor]++;
+            if (windowSaturated[sensor] < 255) windowSaturated[sensor]++;
+            break;
+        }
+    }
+    for (byte a = 0; a < 3; a++)
+        if (reading[a] != previous[a])
+            same = false;
+    if (same) {
+        stuckReadings[sensor]++;
+        if (windowStuck[sensor] < 255) windowStuck[sensor]++;
+    }
+}
+
+void Imu::readError(byte sensor) {
+    readErrors[sensor]++;
+    if (windowErrors[sensor] < 255) windowErrors[sensor]++;
+}
+
+/**
+ * At the end of each health window, work out which sensors are unhealthy, and say so if that changed.
+ */
+void Imu::checkHealth() {
+    byte newHealth = windowSlow >= IMU_HEALTH_SLOW_LIMIT ? IMU_HEALTH_SLOW : 0;
+    if (windowUntimed >= IMU_HEALTH_UNTIMED_LIMIT)
+        newHealth |= IMU_HEALTH_TIMING;
+    for (byte sensor = 0; sensor < 3; sensor++) {
+        if (windowSaturated[sensor] >= IMU_HEALTH_SATURATED_LIMIT || windowStuck[sensor] >= IMU_HEALTH_STUCK_LIMIT || windowErrors[sensor] >= IMU_HEALTH_ERROR_LIMIT)
+            newHealth |= 1 << sensor;
+        windowSaturated[sensor] = windowStuck[sensor] = windowErrors[sensor] = 0;
+    }
+    windowSlow = windowUntimed = 0;
+    if (newHealth != health) {
+        health = newHealth;
+        reportHealth();
+    }
+}
+
+void Imu::reportHealth() {
+    Serial.print("UH"); Serial.print(health);
+    for (byte sensor = 0; sensor < 3; sensor++) { Serial.print(" "); Serial.print(saturatedReadings[sensor]); }
+    for (byte sensor = 0; sensor < 3; sensor++) { Serial.print(" "); Serial.print(stuckReadings[sensor]); }
+    for (byte sensor = 0; sensor < 3; sensor++) { Serial.print(" "); Serial.print(readErrors[sensor]); }
+    Serial.print(" "); Serial.print(slowReads);
+    Serial.print(" "); Serial.println(untimedSamples);
+}
+
+void Imu::untimed(uint16_t samples) {
+    untimedSamples = min((uint32_t) untimedSamples + samples, (uint32_t) 0xFFFF);
+    windowUntimed = min(windowUntimed + samples, 255);
+}
+
+/**
+ * Subtract the current bias estimate.
+ */
+void Imu::correctGyro() {
+    rawGyro[0] -= gyroBias[0];
+    rawGyro[1] -= gyroBias[1];
+    rawGyro[2] -= gyroBias[2];
+}
+
+/**
+ * If we're still, average the (corrected) samples of the batch just read into the bias. See GYRO BIAS.
+ * Leaves the latest sample selected.
+ */
+void Imu::updateGyroBias(byte samples) {
+    if (samples == 0)
+        return;
+    int16_t change = 0;
+    for (byte a = 0; a < 3; a++) {
+        change += min(abs((int32_t) rawAcceleration[a] - lastAcceleration[a]), (int32_t) 0x2000);
+        lastAcceleration[a] = rawAcceleration[a];
+    }
+    accelJitter += (change - accelJitter) / 4;
+    byte still = accelJitter < IMU_STILL_ACCEL_JITTER;
+    if (drive != NULL && (drive->currentLeftMotorPower != 0 || drive->currentRightMotorPower != 0))
+        still = false;
+    int16_t gate = gyroGateWide - (int32_t) (gyroGateWide - gyroGateNarrow) * biasSamples / IMU_BIAS_WINDOW;
+    for (byte i = 0; still && i < samples; i++) {
+        selectSample(i);
+        for (byte a = 0; a < 3; a++)
+            if (abs(rawGyro[a]) > gate)
+                still = false;
+    }
+    stillSamples = still ? min(stillSamples + samples, IMU_STILL_SAMPLES) : 0;
+    if (stillSamples >= IMU_STILL_SAMPLES) {
+        for (byte i = 0; i < samples; i++) {
+            selectSample(i);
+            if (biasSamples < IMU_BIAS_WINDOW)
+                biasSamples++;      // Plain average to start with, then a running average over the window.
+            for (byte a = 0; a < 3; a++) {
+                int32_t uncorrected = (int32_t) rawGyro[a] + gyroBias[a];
+                gyroBiasQ8[a] += (uncorrected * 256 - gyroBiasQ8[a]) / biasSamples;
+                gyroBias[a] = (gyroBiasQ8[a] + 128) >> 8;
+            }
+        }
+    }
+    selectSample(samples - 1);
+}
+
+/**
+ * Interrupt routine - called each time the sensor has a new sample. Keep it short.
+ */
+void Imu::dataReady() {
+    dataReadyCount++;
+    dataReadyAtUs = micros();
+}
+
+/**
+ * Sample on the sensor's data-ready line, instead of a schedule.
+ * Sub-classes should override this to tell the sensor to drive the line (and call this).
+ * @param pinInterrupt must be digitalPinToInterrupt(pin) - 0 for D2, 1 for D3 on the Nano.
+ */
+void Imu::useDataReadyPin(byte pin, byte pinInterrupt) {
+    pinMode(pin, INPUT);
+    dataReadyCountAtLastRead = dataReadyCount;
+    attachInterrupt(pinInterrupt, dataReady, RISING);
+    dataReadyEnabled = true;
+}
+
+/**
+ * A sensor which doesn't queue (no sample period) is taken at its word.
+ */
+byte Imu::dataReadyLive() {
+    if (!dataReadyEnabled)
+        return false;
+    uint32_t periodUs = getSamplePeriodUs();
+    if (periodUs == 0)
+        return true;
+    noInterrupts();
+    uint32_t at = dataReadyAtUs;
+    interrupts();
+    return micros() - at < IMU_DATA_READY_STALE_PERIODS * periodUs;
+}
+
+uint16_t Imu::samplesWaiting() {
+    noInterrupts();
+    uint16_t count = dataReadyCount; // Two bytes - don't let the interrupt change it halfway through.
+    interrupts();
+    return backlog + (uint16_t) (count - dataReadyCountAtLastRead);
+}
+
+uint32_t Imu::getSampleTimestampUs() {
+    if (!dataReadyLive())
+        return micros(); // No data-ready, or it has stopped.
+    noInterrupts();
+    uint32_t at = dataReadyAtUs;
+    interrupts();
+    return at;
+}
+
+/**
+ * Call just before readBatch(), so we know how many samples the sensor had produced by then.
+ */
+uint16_t Imu::startRead() {
+    readStartedUs = micros();
+    noInterrupts();
+    uint16_t count = dataReadyCount;
+    interrupts();
+    return count;
+}
+
+/**
+ * Call with whatever readBatch() returned, to keep count of what we read twice or never, and learn the gyro bias.
+ * @param count what startRead() returned.
+ * @return number of samples read (as readBatch()).
+ */
+byte Imu::finishRead(uint16_t count, byte samples) {
+    lastReadUs = micros() - readStartedUs;
+    if (lastReadUs > maxReadUs)
+        maxReadUs = lastReadUs;
+    if (lastReadUs > IMU_HEALTH_SLOW_READ_US) {
+        slowReads++;
+        if (windowSlow < 255) windowSlow++;
+    }
+    samplesRead += samples;
+    if (samples > 0) {
+        for (byte i = 0; i < samples; i++) {
+            selectSample(i);
+            checkReading(IMU_GYRO, rawGyro, lastGyro);
+            memcpy(lastGyro, rawGyro, sizeof(lastGyro));
+        }
+        checkReading(IMU_ACCEL, rawAcceleration, lastAcceleration); // updateGyroBias() moves lastAcceleration on.
+    }
+    updateGyroBias(samples);
+    if (capturing)
+        captureBatch(samples);
+    if (!dataReadyEnabled)
+        return samples;
+    uint16_t fresh = count - dataReadyCountAtLastRead;
+    dataReadyCountAtLastRead = count;
+    samplesProduced += fresh;
+    backlog += (int) fresh - samples;
+    if (backlog < 0) {                        // We read more than was produced - ie the same sample again.
+        duplicateSamples -= backlog;
+        untimed(-backlog);
+        backlog = 0;
+    } else if (backlog > getQueueDepth()) {   // More was produced than the sensor could hold.
+        missedSamples += backlog - getQueueDepth();
+        backlog = getQueueDepth();
+    }
+    return samples;
+}
+
 // Note the loop doesn't read the sensor - it just looks after reporting.
 void Imu::loop(uint32_t now) {
+    if (now >= nextHealthAt) {
+        if (!capturing)
+            checkHealth();
+        nextHealthAt = now + IMU_HEALTH_WINDOW_MS;
+    }
+    if (capturing) {
+        if (captureUntil != 0 && (int32_t) (now - captureUntil) >= 0)
+            stopCapture(); // In case samples have stopped coming.
+        return;            // No text reports in the middle of frames.
+    }
     if (reportIntervalMs > 0 && now >= nextReportAt) {
         report();
         nextReportAt = now + reportIntervalMs;
     }
 }
 
+/**
+ * Switch to IMU_CAPTURE_BAUD and start sending frames (see CAPTURE in Imu.h).
+ * @param samples stop after this many gyro samples (0 => no limit).
+ * @param durationMs stop after this long (0 => no limit). If neither is limited, IMU_CAPTURE_DEFAULT_MS.
+ */
+void Imu::startCapture(uint32_t samples, uint32_t durationMs) {
+    if (samples == 0 && durationMs == 0)
+        durationMs = IMU_CAPTURE_DEFAULT_MS;
+    Serial.print("UC"); Serial.println(IMU_CAPTURE_BAUD);
+    Serial.flush();
+    Serial.begin(IMU_CAPTURE_BAUD);
+    captureStartAt = millis() + IMU_CAPTURE_SETTLE_MS;
+    captureUntil = durationMs > 0 ? captureStartAt + durationMs : 0L;
+    captureLimit = samples;
+    captureCount = 0;
+    captureHeaderSent = false;
+    capturing = true;
+}
+
+void Imu::stopCapture() {
+    if (captureHeaderSent)
+        captureFrame('E', (const uint8_t *) &captureCount, 4);
+    Serial.flush();
+    Serial.begin(IMU_HOST_BAUD);
+    capturing = false;
+    Serial.print("UCE"); Serial.println(captureCount);
+}
+
+void Imu::captureFrame(byte type, const uint8_t *payload, byte length) {
+    byte checksum = type + length;
+    for (byte i = 0; i < length; i++)
+        checksum += payload[i];
+    Serial.write(0xA5);
+    Serial.write(0x5A);
+    Serial.write(type);
+    Serial.write(length);
+    Serial.write(payload, length);
+    Serial.write(checksum);
+}
+
+/**
+ * Called after each batch is read (and the gyro bias updated). Leaves the latest sample selected.
+ */
+void Imu::captureBatch(byte samples) {
+    if (samples == 0 || (int32_t) (millis() - captureStartAt) < 0)
+        return; // Nothing to send, or the host may not have changed baud yet.
+    uint8_t payload[6 + 6 + 6 + 6 * IMU_CAPTURE_MAX_SAMPLES];
+    byte n = 0;
+    if (!captureHeaderSent) {
+        uint32_t periodUs = getSamplePeriodUs();
+        memcpy(payload + n, &periodUs, 4); n += 4;
+        memcpy(payload + n, &gyroScale, 4); n += 4;
+        memcpy(payload + n, &accelScale, 4); n += 4;
+        memcpy(payload + n, &magScale, 4); n += 4;
+        memcpy(payload + n, gyroBias, 6); n += 6;
+        captureFrame('H', payload, n);
+        captureHeaderSent = true;
+        n = 0;
+    }
+    // A frame holds IMU_CAPTURE_MAX_SAMPLES, so a bigger batch goes as several, each stamped with its own latest sample.
+    uint32_t latestUs = getSampleTimestampUs();
+    for (byte first = 0; first < samples; first += IMU_CAPTURE_MAX_SAMPLES) {
+        byte count = min((byte) (samples - first), (byte) IMU_CAPTURE_MAX_SAMPLES);
+        byte last = first + count == samples;
+        uint32_t timestampUs = latestUs - (uint32_t) (samples - first - count) * getSamplePeriodUs();
+        n = 0;
+        memcpy(payload + n, &timestampUs, 4); n += 4;
+        payload[n++] = last && magneticFresh; // The magnetometer goes with the latest sample.
+        payload[n++] = count;
+        memcpy(payload + n, rawAcceleration, 6); n += 6;
+        if (last && magneticFresh) {
+            memcpy(payload + n, rawMagnetic, 6); n += 6;
+        }
+        for (byte i = first; i < first + count; i++) {
+            selectSample(i);
+            memcpy(payload + n, rawGyro, 6); n += 6;
+        }
+        captureFrame('B', payload, n);
+    }
+    captureCount += samples;
+    if ((captureLimit != 0 && captureCount >= captureLimit) || (captureUntil != 0 && (int32_t) (millis() - captureUntil) >= 0))
+        stopCapture();
+}
+
 void Imu::report() {
     char b[12];
     Serial.print("IR");
-    dtostrf(gyro[0], 8, 3, b); Serial.print(b); dtostrf(gyro[1], 8, 3, b); Serial.print(b); dtostrf(gyro[2], 8, 3, b); Serial.print(b);
-    dtostrf(acceleration[0], 8, 3, b); Serial.print(b); dtostrf(acceleration[1], 8, 3, b); Serial.print(b); dtostrf(acceleration[2], 8, 3, b); Serial.print(b);
-    dtostrf(magnetic[0], 8, 3, b); Serial.print(b); dtostrf(magnetic[1], 8, 3, b); Serial.print(b); dtostrf(magnetic[2], 8, 3, b); Serial.print(b);
+    for (byte i = 0; i < 3; i++) { dtostrf(getGyro(i), 8, 3, b); Serial.print(b); }
+    for (byte i = 0; i < 3; i++) { dtostrf(getAcceleration(i), 8, 3, b); Serial.print(b); }
+    for (byte i = 0; i < 3; i++) { dtostrf(getMagnetic(i), 8, 3, b); Serial.print(b); }
     Serial.println();
 }
 
@@ -37,6 +380,57 @@ void Imu::report() {
 void Imu::command(char *commandLine) {
     if (commandLine[0] != 'U') // Look for lines like 'U....' for IMU.
         return; // Not for us.
-    if (commandLine[1] == 'R') // Report interval.
+    if (commandLine[1] == 'R') { // Report interval.
         setReportInterval(atoi(commandLine + 2));
+    } else if (commandLine[1] == 'D') { // Data-ready counters.
+        Serial.print("UD"); Serial.print(samplesProduced); Serial.print(" "); Serial.print(samplesRead);
+        Serial.print(" "); Serial.print(duplicateSamples); Serial.print(" "); Serial.println(missedSamples);
+    } else if (commandLine[1] == 'B') { // Gyro bias.
+        Serial.print("UB");
+        for (byte a = 0; a < 3; a++) {
+            Serial.print((int) (gyroBias[a] * gyroScale * 1000)); Serial.print(" ");
+        }
+        Serial.println(getGyroBiasConfidence());
+    } else if (commandLine[1] == 'H') { // Health.
+        reportHealth();
+    } else if (commandLine[1] == 'I') { // I2C statistics.
+        i2cBus.report("UI");
+    } else if (commandLine[1] == 'C') { // Capture.
+        if (commandLine[2] == 'X') {
+            if (capturing)
+                stopCapture();
+        } else if (!capturing) {
+            if (commandLine[2] == 'T')
+                startCapture(0L, atol(commandLine + 3));
+            else
+                startCapture(atol(commandLine + 2), 0L);
+        }
+    } else if (commandLine[1] == 'M') { // Magnetometer calibration.
+        switch (commandLine[2]) {
+        case '\0':
+            Serial.println("D Magnetometer calibration started. Spin the rover.");
+            magCalibration.start();
+            break;
+        case 'S':
+            if (!magCalibration.isCalibrating())
+                break;
+            if (magCalibration.finish() == 0) {
+                Serial.println("D Magnetometer calibration failed - not enough rotation.");
+                break;
+            }
+            magCalibration.save(IMU_EEPROM_ADDRESS);
+            magCalibration.report("UM");
+            break;
+        case 'A':
+            magCalibration.abort();
+            break;
+        case 'R':
+            magCalibration.report("UM");
+            break;
+        case 'X':
+            magCalibration.forget(IMU_EEPROM_ADDRESS);
+            magCalibration.setIdentity();
+            break;
+        }
+    }
 }
@@ -7,8 +7,29 @@
  * PROTOCOL FROM HOST
  *     By default, does not report, but
  *     "IRnnn" will make the IMU report at nnn ms intervals.
+ *     "UD" report data-ready counters.
+ *     "UM"  start magnetometer calibration - then spin the rover (and tip it, if you want Z corrected too).
+ *     "UMS" finish magnetometer calibration, and save it to EEPROM.
+ *     "UMA" abandon magnetometer calibration.
+ *     "UMR" report the magnetometer calibration.
+ *     "UMX" forget the magnetometer calibration (in EEPROM and in use).
+ *     "UB"  report the gyro bias.
+ *     "UCnnn"  capture the next nnn gyro samples (see CAPTURE). "UC" alone captures for IMU_CAPTURE_DEFAULT_MS.
+ *     "UCTnnn" capture for nnn ms.
+ *     "UCX"    stop capturing (send at IMU_CAPTURE_BAUD).
+ *     "UH"  report health.
+ *     "UI"  report I2C statistics, for the IMU (and anything else on the bus).
  * PROTOCOL TO HOST
  *     If reporting, outputs "IRgx gy gz ax ay az mx my mz"
+ *     "UDproduced read duplicates missed" sample counters (see DATA READY).
+ *     "UMox oy oz sx sy sz" magnetometer calibration - offsets (counts) and scales (1/1000ths). On "UMS" or "UMR".
+ *     "UBbx by bz confidence" gyro bias (millidegrees/s) being subtracted, and confidence in it (0 .. 100%). On "UB".
+ *     "UCbaud" capture is starting - switch to baud now. Binary frames follow (see CAPTURE).
+ *     "UCEsamples" capture finished (sent at IMU_HOST_BAUD again).
+ *     "UHhealth satG satA satM stuckG stuckA stuckM errG errA errM slow untimed" health bits (see HEALTH) and the counters since startup.
+ *         Sent whenever health changes, and on "UH".
+ *     "UIaddress transactions nacks timeouts recoveries maxLatencyUs maxWaitUs deadlineUs deadlineMisses" per device, on "UI"
+ *         (see I2cBus.h STATISTICS). The IMU's reads should show no deadline misses - see I2C.
  * AUTHOR
  *     Scott BARNES 2019. IP freely on non-commercial applications.
  * COORDINATE SYSTEM
@@ -19,36 +40,209 @@
  *     are probably better of on a 'real time' platform.
  *     Unfortunately this means puting 0-5V into the SCL/SDA lines of the Imu (instead of the recomended 0-3.3V), but the LSM modules seem
  *     to cope.
+ * DATA READY
+ *     If the sensor's data-ready line is wired to an interrupt pin (useDataReadyPin()), the interrupt counts and timestamps every new
+ *     sample, and the Ahrs reads when samples are waiting, instead of on a millis() schedule. (A schedule aliases with the sensor's
+ *     own output rate, so some samples get read twice and some not at all.)
+ *     readNew() counts duplicates (we read, but nothing new had arrived) and misses (more arrived than we read, and the sensor
+ *     couldn't queue them - see getQueueDepth()).
+ *     If no edge comes for IMU_DATA_READY_STALE_PERIODS sample periods (the line isn't wired after all, or has stopped),
+ *     dataReadyLive() is false and the Ahrs polls, as without data-ready, until edges come again.
+ *     The interrupt state is static, so only one Imu per Arduino can do this.
+ * I2C
+ *     The sensor's addresses get IMU_I2C_PRIORITY on the I2cBus, above the default, so with a LidarLite (or anything else)
+ *     on the same bus, a gyro read waits for at most the one transaction already on the wire. Each transaction should be
+ *     done within IMU_I2C_DEADLINE_US of being queued. See I2cBus.h SCHEDULING.
+ * MAGNETOMETER CALIBRATION
+ *     See MagCalibration. Sub-classes call correctMagnetic() as soon as rawMagnetic is read, so everyone sees corrected readings.
+ * MULTI-RATE
+ *     The magnetometer is slow and noisy, and only there to stop yaw drifting, so drivers read it every IMU_MAG_INTERVAL_MS
+ *     (magneticDue()), not with every gyro/accel read. magneticFresh says whether the last read included it.
+ *     That's 100ms, not the 80ms of the LSM9DS0's 12.5Hz: reading at its own period, a read now and then lands just before
+ *     the next sample and gets the last one again - which HEALTH would count as stuck.
+ * GYRO BIAS
+ *     The gyro's zero-rate output wanders with temperature, and the Ahrs integrates it into yaw drift (which the Helm then steers).
+ *     So whenever we're still, readNew() averages the gyro into a bias estimate, and sub-classes subtract it (correctGyro()) from
+ *     every sample. Still means: the accelerometer is quiet (it jiggles when the rover moves, even at constant speed), the motors
+ *     are at zero power (if setDrive() was called), and every gyro sample is near the current bias - for IMU_STILL_SAMPLES in a row.
+ *     The gate on the gyro starts wide (the bias is unknown at power up) and narrows as the estimate firms up.
+ *     The first still samples are simply averaged, so there is no "don't move" delay at startup - the estimate is usable after a
+ *     fraction of a second of stillness, and converges to a running average over IMU_BIAS_WINDOW samples.
+ *     Confidence is how much of that window has been filled.
+ * HEALTH
+ *     A bad I2C day (see NOTES) used to show up only as the rover veering. So for each sensor (gyro, accel, mag) we count
+ *     readings at (nearly) full scale, readings identical to the one before (real sensors are noisy - identical means stuck,
+ *     or not updating), and failed reads; and we count reads slower than IMU_HEALTH_SLOW_READ_US, and (with data-ready)
+ *     samples data-ready didn't time - duplicates (see DATA READY), and reads whose timestamp hadn't moved (see Ahrs TIMING).
+ *     A data-ready line that has stalled shows up as IMU_HEALTH_TIMING.
+ *     Every IMU_HEALTH_WINDOW_MS, any sensor over its limits for that window is marked unhealthy (IMU_HEALTH_GYRO etc), and
+ *     a clean window marks it healthy again. getHealth() is 0 when all is well - the sketch can blink about it, and the Ahrs
+ *     stops using the magnetometer (or accelerometer) while it is unhealthy.
+ * CAPTURE
+ *     For tuning filters offline against real data. "IR" reports (nine dtostrf()s a line) only manage a few Hz at 19200 baud,
+ *     so this streams every sample, raw, in binary frames - the one deliberate exception to the readable-lines protocol.
+ *     We say "UC57600", switch Serial to IMU_CAPTURE_BAUD, wait IMU_CAPTURE_SETTLE_MS for the host to follow, then send a frame
+ *     per batch read (several, if it's over IMU_CAPTURE_MAX_SAMPLES), until the sample count or time is up (or "UCX"). Then back to IMU_HOST_BAUD and "UCEsamples".
+ *     Frame: 0xA5 0x5A type length payload[length] checksum (sum of type, length and payload, mod 256). Little-endian.
+ *         'H' header: samplePeriodUs(u32) gyroScale accelScale magScale (float) gyroBias[3] (i16)
+ *         'B' batch:  timestampUs(u32, of the latest sample) magneticFresh(u8) samples(u8) rawAcceleration[3]
+ *                     [rawMagnetic[3] if magneticFresh] rawGyro[3] * samples (oldest first) - all i16, as the Ahrs sees them.
+ *         'E' end:    samples(u32)
+ *     Other modules' text lines may be interleaved - the host skips anything that isn't a good frame. See tools/imucapture.py.
+ * EEPROM
+ *     Bytes [IMU_EEPROM_ADDRESS .. IMU_EEPROM_ADDRESS + 31] belong to the Imu (after the Helm's).
+ * RAW READINGS
+ *     Readings are kept as the sensor's own int16 counts (already turned into NWU), with a float scale per sensor set in setup().
+ *     Users call getGyro(axis) etc. (or multiply by the scale themselves) at the point they need floats, once.
+ *     On the Nano, per Imu:
+ *         SRAM  - 18 bytes of readings + 12 of scales, where there were 36 bytes of float readings + 12 of scales (in Lsm9ds0Imu).
+ *                 Lsm9ds1Imu no longer puts four sensors_event_t (36 bytes each) on the stack every read.
+ *         Cycles - a sample is stored with int16 copies (~10 cycles/axis), where it was an int-to-float and a float multiply
+ *                 (~200 cycles/axis, ~110us for nine axes at 16MHz), even for readings nobody used (batched accel/mag, reports off).
+ *                 getEvent() (Lsm9ds1Imu) also did a float divide per axis (~500 cycles) and cleared four structs.
  */
 
 #ifndef Imu_h
 #define Imu_h
 
-// Chose only one of these ..
-#define DS0
-// NOTE THERE ARE STILL ISSUES WITH DS1 (ie using the LSM9DS1).
-// Something to do with the magnetometer readings.
-// An interweb search suggests there are calibration issues with the LSM9DS1 magnetometer, but nothing that serious.
-// HINT: LSM9DS1? Just say NO! (Use the LSM9DS0).
-//#define DS1
-
 #include <Arduino.h>
 #include "King.h"
+#include "MagCalibration.h"
+
+#define IMU_EEPROM_ADDRESS  32   /* Where the magnetometer calibration lives in EEPROM */
+
+#define IMU_MAG_INTERVAL_MS       100   /* Read the magnetometer this often. Slower than its 12.5Hz, so every read is new (see HEALTH). */
+
+#define IMU_GYRO                    0   /* Sensor indexes, for the health counters */
+#define IMU_ACCEL                   1
+#define IMU_MAG                     2
+#define IMU_HEALTH_GYRO          0x01   /* getHealth() bits: (1 << sensor) => that sensor is unhealthy */
+#define IMU_HEALTH_ACCEL         0x02
+#define IMU_HEALTH_MAG           0x04
+#define IMU_HEALTH_SLOW          0x08   /* Reads are slow */
+#define IMU_HEALTH_TIMING        0x10   /* Data-ready isn't timing the samples */
+#define IMU_HEALTH_WINDOW_MS     1000
+#define IMU_SATURATION_COUNTS   32000   /* A reading this far from zero (on any axis) is at full scale. */
+#define IMU_HEALTH_SATURATED_LIMIT 10   /* Per window. Bumps saturate the accelerometer now and then, which is fine. */
+#define IMU_HEALTH_STUCK_LIMIT      5   /* Per window. */
+#define IMU_HEALTH_ERROR_LIMIT      1   /* Per window. */
+#define IMU_HEALTH_SLOW_READ_US  4000   /* A read (readBatch()) taking longer than this is slow .. */
+#define IMU_HEALTH_SLOW_LIMIT       5   /* .. and this many in a window is unhealthy. */
+#define IMU_HEALTH_UNTIMED_LIMIT   10   /* Per window. A dead data-ready line gives ~190. */
+#define IMU_DATA_READY_STALE_PERIODS 2 /* No data-ready edge for this many sample periods => the line isn't working */
+#define IMU_I2C_PRIORITY           10   /* I2cBus priority for the sensor's addresses. Others default to 0. */
+#define IMU_I2C_DEADLINE_US      2000   /* A 32 byte read at 400kHz is ~0.8ms, after up to ~1ms of someone else's at 100kHz. */
+
+#define IMU_STILL_ACCEL_JITTER    300   /* Counts. Smoothed change in acceleration (all axes) between reads must be below this .. */
+#define IMU_STILL_GYRO_WIDE_DPS    20   /* .. and gyro within this of the bias, when we have no confidence in it .. */
+#define IMU_STILL_GYRO_NARROW_DPS   2   /* .. narrowing to this at full confidence .. */
+#define IMU_STILL_SAMPLES          20   /* .. for this many samples in a row, before we call it still. */
+#define IMU_BIAS_WINDOW          1024   /* Samples in the running average. ~5s of stillness at 190Hz. */
+
+#define IMU_HOST_BAUD          19200   /* What the sketch opens Serial at. Restored after a capture. */
+#define IMU_CAPTURE_BAUD       57600   /* 190Hz of gyro, with accel and mag, is ~2kB/s - more than 19200 baud carries. */
+#define IMU_CAPTURE_SETTLE_MS    200   /* Time for the host to change baud, before the first frame. */
+#define IMU_CAPTURE_MAX_SAMPLES    8   /* Gyro samples per frame. */
+#define IMU_CAPTURE_DEFAULT_MS 10000   /* How long "UC" (with no count) captures for. */
+
+class DifferentialDrive;
 
 class Imu : public King {
     int reportIntervalMs = 0;
     uint32_t nextReportAt = 0L;
+    byte dataReadyEnabled = false;
+    uint16_t dataReadyCountAtLastRead = 0;
+    int backlog = 0;                          // Samples produced but not yet read (ie still queued in the sensor).
+    static volatile uint16_t dataReadyCount;  // Samples the sensor has produced (counted in the interrupt).
+    static volatile uint32_t dataReadyAtUs;   // micros() when the latest one was produced.
+    static void dataReady();
+    DifferentialDrive *drive = NULL;          // To check the motors are off, if we know about them.
+    int16_t gyroBias[3] = { 0, 0, 0 };        // Counts. Subtracted from every gyro sample.
+    int32_t gyroBiasQ8[3] = { 0, 0, 0 };      // .. the running average (counts * 256) it is rounded from.
+    uint16_t biasSamples = 0;                 // Still samples averaged, up to IMU_BIAS_WINDOW.
+    uint16_t stillSamples = 0;                // Still samples in a row.
+    int16_t lastAcceleration[3] = { 0, 0, 0 };
+    int16_t accelJitter = 0x7FFF;             // Smoothed change in acceleration between reads. Start "not still".
+    int16_t gyroGateWide;                     // IMU_STILL_GYRO_WIDE_DPS in counts (set in setup()).
+    int16_t gyroGateNarrow;
+    void updateGyroBias(byte samples);
+    uint32_t nextMagneticAt = 0L;
+    byte capturing = false;
+    byte captureHeaderSent = false;
+    uint32_t captureStartAt = 0L;             // millis() - once the host has changed baud.
+    uint32_t captureUntil = 0L;               // millis(), or 0 => no time limit.
+    uint32_t captureLimit = 0L;               // Samples, or 0 => no limit.
+    uint32_t captureCount = 0L;
+    void startCapture(uint32_t samples, uint32_t durationMs);
+    void stopCapture();
+    void captureBatch(byte samples);
+    void captureFrame(byte type, const uint8_t *payload, byte length);
+    uint32_t readStartedUs = 0L;
+    byte health = 0;                          // IMU_HEALTH_* bits.
+    uint32_t nextHealthAt = 0L;
+    byte windowSaturated[3] = { 0, 0, 0 };    // Counts in this health window, per sensor.
+    byte windowStuck[3] = { 0, 0, 0 };
+    byte windowErrors[3] = { 0, 0, 0 };
+    byte windowSlow = 0;
+    byte windowUntimed = 0;
+    int16_t lastGyro[3] = { 0, 0, 0 };        // Previous readings, to spot stuck ones.
+    int16_t lastMagnetic[3] = { 0, 0, 0 };
+    void checkReading(byte sensor, const int16_t *reading, const int16_t *previous);
+    void checkHealth();
+    void reportHealth();
+protected:
+    void readError(byte sensor);     // Sub-classes call this when a read of sensor (IMU_GYRO etc) fails.
+    byte magneticDue();              // Whether it's time to read the magnetometer again. Sub-classes set magneticFresh from this.
+    MagCalibration magCalibration;
+    void correctMagnetic();          // Sub-classes call this after reading rawMagnetic.
+    void correctGyro();              // .. and this after loading rawGyro.
 public:
     Imu() {};                        // Does not assume Serial is initialized.
     void setReportInterval(int reportIntervalMs) { this->reportIntervalMs = reportIntervalMs; }; // 0 => no reporting
-    virtual void setup();            // Assumes Serial is initialized.
+    virtual void setup();            // Assumes Serial is initialized. Sub-classes call this after setting up the sensor.
     virtual void loop(uint32_t now);
     virtual void command(char *commandLine);
     virtual void report();           // Write out the current readings to Serial. A: m/s^2; mag: gauss; gyro: dps; rpy: deg;
-    virtual void readSensor();       // Must populate gyro, acceleration and magnetic in XYZ=NWU
-    float gyro[3];                   // NWU
-    float acceleration[3];           // NWU
-    float magnetic[3];               // NWU
+    virtual void readSensor() = 0;   // Must populate rawGyro, rawAcceleration and rawMagnetic in XYZ=NWU
+    virtual byte readBatch() { readSensor(); return 1; }; // Reads everything queued in the sensor. Returns the number of samples (0 => nothing new).
+    virtual void selectSample(byte i) {}; // Loads sample i of the last batch into rawGyro, rawAcceleration and rawMagnetic. readBatch() leaves the latest selected.
+    virtual uint32_t getSamplePeriodUs() { return 0; }; // Time between batched samples. 0 => no batching (one sample per readBatch()).
+    virtual byte getQueueDepth() { return 0; }; // Samples the sensor holds for us between reads. 0 => only the latest.
+    virtual void useDataReadyPin(byte pin, byte pinInterrupt); // Sample on the sensor's data-ready line. pinInterrupt must be digitalPinToInterrupt(pin).
+    byte usesDataReady() { return dataReadyEnabled; };
+    byte dataReadyLive();            // usesDataReady(), and the line is actually working. See DATA READY.
+    uint16_t samplesWaiting();       // Samples produced but not yet read. Only meaningful if usesDataReady().
+    uint32_t getSampleTimestampUs(); // micros() when the latest sample was produced (or read, without data-ready).
+    byte readNew() { uint16_t produced = startRead(); return finishRead(produced, readBatch()); }; // readBatch(), keeping the duplicate and missed counts and the gyro bias.
+    uint16_t startRead();            // readNew() in two halves, for callers which call readBatch() themselves (see Ahrs<IMU>) ..
+    byte finishRead(uint16_t produced, byte samples); // .. with startRead()'s result, and readBatch()'s. Returns samples.
+    void setDrive(DifferentialDrive *drive) { this->drive = drive; }; // Only estimate gyro bias when its motors are off.
+    byte getGyroBiasConfidence() { return (uint32_t) biasSamples * 100 / IMU_BIAS_WINDOW; }; // 0 .. 100%
+    uint32_t samplesProduced = 0;    // Counters, for "UD".
+    uint32_t samplesRead = 0;
+    uint32_t duplicateSamples = 0;
+    uint32_t missedSamples = 0;
+    uint16_t saturatedReadings[3] = { 0, 0, 0 }; // Health counters since startup, per sensor, for "UH".
+    uint16_t stuckReadings[3] = { 0, 0, 0 };
+    uint16_t readErrors[3] = { 0, 0, 0 };
+    uint16_t slowReads = 0;
+    uint16_t untimedSamples = 0;
+    void untimed(uint16_t samples);  // Samples data-ready didn't time. See HEALTH.
+    uint16_t lastReadUs = 0;         // How long the last readBatch() took (via readNew()/startRead()).
+    uint16_t maxReadUs = 0;          // .. and the slowest since someone reset it.
+    byte getHealth() { return health; }; // 0 => healthy. See HEALTH.
+    byte isAccelerationHealthy() { return !(health & IMU_HEALTH_ACCEL); };
+    byte isMagneticHealthy() { return !(health & IMU_HEALTH_MAG); };
+    int16_t rawGyro[3];              // NWU, sensor counts. * gyroScale => dps
+    int16_t rawAcceleration[3];      // NWU, sensor counts. * accelScale => m/s^2
+    int16_t rawMagnetic[3];          // NWU, sensor counts. * magScale => gauss
+    byte magneticFresh = false;      // rawMagnetic was read by the last readBatch() (otherwise it is older).
+    float gyroScale = 1.0;           // dps per count, for the range set in setup().
+    float accelScale = 1.0;          // m/s^2 per count
+    float magScale = 1.0;            // gauss per count
+    float getGyro(byte axis) { return rawGyro[axis] * gyroScale; };
+    float getAcceleration(byte axis) { return rawAcceleration[axis] * accelScale; };
+    float getMagnetic(byte axis) { return rawMagnetic[axis] * magScale; };
 };
 
 #endif /* Imu_h */
@@ -15,7 +15,7 @@
 #include "Lsm9ds0Imu.h"
 
 #include <stdio.h>
-#include <Wire.h>
+#include "I2cWire.h" // Not <Wire.h> - see I2cWire.h
 #include <SPI.h>
 
 
@@ -30,7 +30,19 @@
 //Adafruit_LSM9DS1 lsm = Adafruit_LSM9DS1(LSM9DS1_XGCS, LSM9DS1_MCS);
 
 
-#define IMU_SAMPLE_RATE_MS 50
+// Gyro registers not in Adafruit_LSM9DS0.
+#define LSM9DS0_REGISTER_CTRL_REG5_G       0x24
+#define LSM9DS0_I2_DRDY                    0x08 /* CTRL_REG3_G: data ready on DRDY_G */
+#define LSM9DS0_REGISTER_FIFO_CTRL_REG_G   0x2E
+#define LSM9DS0_REGISTER_FIFO_SRC_REG_G    0x2F
+#define LSM9DS0_FIFO_EN                    0x40 /* CTRL_REG5_G */
+#define LSM9DS0_FIFO_MODE_STREAM           0x40 /* FIFO_CTRL_REG_G: FM2:0 = 010 */
+#define LSM9DS0_FIFO_SRC_OVRN              0x40 /* FIFO_SRC_REG_G */
+#define LSM9DS0_FIFO_SRC_EMPTY             0x20
+#define LSM9DS0_FIFO_SRC_FSS               0x1F
+#define LSM9DS0_M_ODR_MASK                 0x1C /* CTRL_REG5_XM: magnetometer data rate */
+#define LSM9DS0_M_ODR_12_5HZ               0x0C
+#define LSM9DS0_GYRO_190HZ                 0x4F /* CTRL_REG1_G: DR = 01 (190Hz), BW = 00, PD = 1, XYZ enabled */
 
 Lsm9ds0Imu::Lsm9ds0Imu() {
     // Hmm .. Serial may not yet be up. Wait for setup() to be called to do stuff.
@@ -48,35 +60,130 @@ void Lsm9ds0Imu::setup() {
         while (1);
     }
     Serial.println("D Found LSM9DS0");
+    Wire.setClock(400000L); // Fast mode for the IMU's transactions (a LidarLite on the same bus keeps 100kHz). Quarters the time we block the loop on each read.
+    i2cBus.setDevice(LSM9DS0_ADDRESS_GYRO, IMU_I2C_PRIORITY, IMU_I2C_DEADLINE_US); // Ahead of anyone else's. See Imu.h I2C.
+    i2cBus.setDevice(LSM9DS0_ADDRESS_ACCELMAG, IMU_I2C_PRIORITY, IMU_I2C_DEADLINE_US);
     // 1.) Set the accelerometer range
     lsm9ds0.setupAccel(lsm9ds0.LSM9DS0_ACCELRANGE_2G);
+    accelScale = LSM9DS0_ACCEL_MG_LSB_2G / 1000.0 * SENSORS_GRAVITY_STANDARD;
     //lsm9ds0.setupAccel(lsm9ds0.LSM9DS1_ACCELRANGE_4G);
     //lsm9ds0.setupAccel(lsm9ds0.LSM9DS1_ACCELRANGE_8G);
     //lsm9ds0.setupAccel(lsm9ds0.LSM9DS1_ACCELRANGE_16G);
     
     // 2.) Set the magnetometer sensitivity
     lsm9ds0.setupMag(lsm9ds0.LSM9DS0_MAGGAIN_4GAUSS);
+    // Magnetometer at 12.5Hz - we only read it every IMU_MAG_INTERVAL_MS.
+    lsm9ds0.write8(XMTYPE, lsm9ds0.LSM9DS0_REGISTER_CTRL_REG5_XM, (lsm9ds0.read8(XMTYPE, lsm9ds0.LSM9DS0_REGISTER_CTRL_REG5_XM) & ~LSM9DS0_M_ODR_MASK) | LSM9DS0_M_ODR_12_5HZ);
+    magScale = LSM9DS0_MAG_MGAUSS_4GAUSS / 1000.0;
     //lsm9ds0.setupMag(lsm9ds0.LSM9DS1_MAGGAIN_8GAUSS);
     //lsm9ds0.setupMag(lsm9ds0.LSM9DS1_MAGGAIN_12GAUSS);
     //lsm9ds0.setupMag(lsm9ds0.LSM9DS1_MAGGAIN_16GAUSS);
     
     // 3.) Setup the gyroscope
     lsm9ds0.setupGyro(lsm9ds0.LSM9DS0_GYROSCALE_245DPS);
+    gyroScale = LSM9DS0_GYRO_DPS_DIGIT_245DPS;
+
+    // 4.) Gyro at 190Hz into the FIFO, in stream mode (oldest samples are dropped if we don't keep up).
+    lsm9ds0.write8(GYROTYPE, lsm9ds0.LSM9DS0_REGISTER_CTRL_REG1_G, LSM9DS0_GYRO_190HZ);
+    lsm9ds0.write8(GYROTYPE, LSM9DS0_REGISTER_CTRL_REG5_G, lsm9ds0.read8(GYROTYPE, LSM9DS0_REGISTER_CTRL_REG5_G) | LSM9DS0_FIFO_EN);
+    lsm9ds0.write8(GYROTYPE, LSM9DS0_REGISTER_FIFO_CTRL_REG_G, LSM9DS0_FIFO_MODE_STREAM);
     //lsm9ds0.setupGyro(lsm9ds0.LSM9DS1_GYROSCALE_500DPS);
     //lsm9ds0.setupGyro(lsm9ds0.LSM9DS1_GYROSCALE_2000DPS);
+    Imu::setup();
+}
+
+/**
+ * Burst read three axes (X_L, X_H, Y_L .. Z_H) into raw[].
+ * The chip sends them low byte first, which is how the AVR stores an int16, so they go straight in.
+ * @return false if the read failed.
+ */
+byte Lsm9ds0Imu::readRaw(boolean type, byte reg, int16_t *raw) {
+    return lsm9ds0.readBuffer(type, 0x80 | reg, 6, (uint8_t *) raw) != 0; // 0x80 => auto-increment register address.
 }
 
+/**
+ * With the FIFO on, the gyro output registers ARE the FIFO, so the latest reading is the end of a batch.
+ */
 void Lsm9ds0Imu::readSensor() {
-    lsm9ds0.read();
-    sensors_event_t a, m, g, temp;
-    lsm9ds0.getEvent(&a, &m, &g, &temp);
-    gyro[0] = g.gyro.x;
-    gyro[1] = g.gyro.y;
-    gyro[2] = g.gyro.z;
-    acceleration[0] = a.acceleration.x;
-    acceleration[1] = a.acceleration.y;
-    acceleration[2] = a.acceleration.z;
-    magnetic[0] = m.magnetic.x;
-    magnetic[1] = m.magnetic.y;
-    magnetic[2] = -m.magnetic.z; // Z for magnet on LSM0DS0 is wrong way, this fixes it.
+    readBatch();
+}
+
+/**
+ * Drain the gyro FIFO (up to LSM9DS0_MAX_BATCH samples), and read accel and mag once.
+ * @return number of gyro samples read. The latest is left selected.
+ */
+byte Lsm9ds0Imu::readBatch() {
+    byte fifoSource;
+    if (!lsm9ds0.readBuffer(GYROTYPE, LSM9DS0_REGISTER_FIFO_SRC_REG_G, 1, &fifoSource)) {
+        readError(IMU_GYRO);
+        fifoSource = LSM9DS0_FIFO_SRC_EMPTY; // Try again next time.
+    }
+    byte queued = fifoSource & LSM9DS0_FIFO_SRC_FSS;
+    if (fifoSource & LSM9DS0_FIFO_SRC_OVRN) {
+        fifoOverruns++;
+        queued = 32; // Full.
+    } else if (fifoSource & LSM9DS0_FIFO_SRC_EMPTY) {
+        queued = 0;
+    }
+    batchSize = min(queued, (byte) LSM9DS0_MAX_BATCH);
+    // In FIFO mode the register address wraps from OUT_Z_H_G back to OUT_X_L_G, so one burst reads several samples.
+    for (byte i = 0; i < batchSize; i += LSM9DS0_FIFO_CHUNK) {
+        byte n = min((byte) (batchSize - i), (byte) LSM9DS0_FIFO_CHUNK);
+        if (!lsm9ds0.readBuffer(GYROTYPE, 0x80 | lsm9ds0.LSM9DS0_REGISTER_OUT_X_L_G, 6 * n, (uint8_t *) batchGyro[i])) {
+            readError(IMU_GYRO);
+            batchSize = i; // Keep what we got.
+            break;
+        }
+    }
+    if (!readRaw(XMTYPE, lsm9ds0.LSM9DS0_REGISTER_OUT_X_L_A, rawAcceleration))
+        readError(IMU_ACCEL);
+    magneticFresh = magneticDue();
+    if (magneticFresh && !readRaw(XMTYPE, lsm9ds0.LSM9DS0_REGISTER_OUT_X_L_M, rawMagnetic)) {
+        readError(IMU_MAG);
+        magneticFresh = false;
+    }
+    if (magneticFresh) {
+        rawMagnetic[2] = -rawMagnetic[2]; // Z for magnet on LSM0DS0 is wrong way, this fixes it.
+        correctMagnetic();
+    }
+    if (readTemperature) {
+        lsm9ds0.readTemp();
+        temperature = lsm9ds0.temperature;
+    }
+    if (batchSize > 0)
+        Lsm9ds0Imu::selectSample(batchSize - 1);
+    return batchSize;
+}
+
+/**
+ * Load gyro sample i of the last batch. Acceleration and magnetic are the same for the whole batch.
+ */
+void Lsm9ds0Imu::selectSample(byte i) {
+    rawGyro[0] = batchGyro[i][0];
+    rawGyro[1] = batchGyro[i][1];
+    rawGyro[2] = batchGyro[i][2];
+    correctGyro();
+}
+
+/**
+ * Tell the gyro to pulse DRDY_G for each new sample, and count them on pin.
+ */
+void Lsm9ds0Imu::useDataReadyPin(byte pin, byte pinInterrupt) {
+    lsm9ds0.write8(GYROTYPE, lsm9ds0.LSM9DS0_REGISTER_CTRL_REG3_G, lsm9ds0.read8(GYROTYPE, lsm9ds0.LSM9DS0_REGISTER_CTRL_REG3_G) | LSM9DS0_I2_DRDY);
+    Imu::useDataReadyPin(pin, pinInterrupt);
+}
+
+/**
+ * @param commandLine the line received from the host. Note that the line may not be for this object.
+ */
+void Lsm9ds0Imu::command(char *commandLine) {
+    Imu::command(commandLine);
+    if (commandLine[0] != 'U')
+        return; // Not for us.
+    if (commandLine[1] == 'T') {               // "UT1" / "UT0" - read temperature (or not).
+        setReadTemperature(commandLine[2] == '1');
+    } else if (commandLine[1] == 'P') {        // "UP" - report read timing.
+        Serial.print("UP"); Serial.print(lastReadUs); Serial.print(" "); Serial.print(maxReadUs); Serial.print(" "); Serial.println(fifoOverruns);
+        maxReadUs = 0;
+    }
 }
@@ -5,9 +5,29 @@
  * PURPOSE
  *     An LSM9DS0 inertial measurement unit on an Arduino.
  * PROTOCOL FROM HOST
- *     See parent class.
+ *     See parent class, plus
+ *     "UT1" also read the temperature each sample, "UT0" don't (default).
+ *     "UP" report how long reads take.
  * PROTOCOL TO HOST
- *     See parent class.
+ *     See parent class, plus
+ *     "UPlast max overruns" microseconds taken by the last (and slowest since the previous "UP") read, and gyro FIFO overruns so far.
+ *     Failed reads are counted (see Imu HEALTH).
+ * PERFORMANCE
+ *     readSensor() blocks the whole loop, so it's kept lean:
+ *     The bus runs at 400kHz (the LSM9DS0 is happy with that).
+ *     Burst reads (gyro, accel, and mag when due) straight into the Imu's raw int16 readings - no scaling here (see Imu RAW READINGS).
+ *     No sensors_event_t (four of them, mostly unused fields), and no temperature read unless asked for.
+ * FIFO
+ *     The gyro runs at 190Hz into its FIFO (stream mode), and readBatch() drains it - so the Ahrs sees every gyro sample,
+ *     not just one per read, for about the same number of I2C transactions.
+ *     Wire only buffers 32 bytes, so we read at most LSM9DS0_FIFO_CHUNK samples per transaction, and at most LSM9DS0_MAX_BATCH per batch
+ *     - enough for the longest the Ahrs leaves between reads (IMU_BACKSTOP_MS), so a batch is only ever cut short by a read
+ *     held up on the bus (anything more stays in the FIFO for next time).
+ *     The accelerometer is only read once per batch (the latest value) and used with every gyro sample in it, and the
+ *     magnetometer (at 12.5Hz) only every IMU_MAG_INTERVAL_MS. They are only there to correct drift, so they don't need the rate.
+ * DATA READY
+ *     If DRDY_G is wired to an interrupt pin (D2 on the kangarouter) and useDataReadyPin() called, each gyro sample is counted and
+ *     timestamped as it is produced (see Imu).
  * AUTHOR
  *     Scott BARNES 2019. IP freely on non-commercial applications.
  * COORDINATE SYSTEM
@@ -23,13 +43,30 @@
 #include "Adafruit_LSM9DS0.h"
 #include "Adafruit_Sensor.h"
 
+#define LSM9DS0_GYRO_PERIOD_US  5263   /* 190Hz gyro output data rate */
+#define LSM9DS0_FIFO_CHUNK      5      /* Samples per I2C read: 5 * 6 bytes fits in the 32 byte Wire buffer */
+#define LSM9DS0_MAX_BATCH       20     /* Samples we hold per batch. 190Hz * 100ms (the Ahrs's longest read interval), and one over. */
+
 class Lsm9ds0Imu : public Imu {
 private:
     Adafruit_LSM9DS0 lsm9ds0 = Adafruit_LSM9DS0();
+    byte readTemperature = false;    // Only read the temperature if someone wants it.
+    int16_t batchGyro[LSM9DS0_MAX_BATCH][3]; // Raw gyro samples from the FIFO, oldest first.
+    byte batchSize = 0;
+    byte readRaw(boolean type, byte reg, int16_t *raw);
 public:
     Lsm9ds0Imu();
     virtual void setup();
+    virtual void command(char *commandLine);
     virtual void readSensor();
+    virtual byte readBatch();
+    virtual void selectSample(byte i);
+    virtual uint32_t getSamplePeriodUs() { return LSM9DS0_GYRO_PERIOD_US; };
+    virtual byte getQueueDepth() { return 32; }; // The gyro FIFO.
+    virtual void useDataReadyPin(byte pin, byte pinInterrupt); // Wire DRDY_G to pin.
+    uint16_t fifoOverruns = 0;       // Times the gyro FIFO filled up before we drained it (ie we lost samples).
+    void setReadTemperature(byte readTemperature) { this->readTemperature = readTemperature; };
+    int16_t temperature = 0;         // Raw (LSB = 1/8 deg C, offset undocumented). Only updated if setReadTemperature(true).
 };
 
 #endif /* Lsm9ds0Imu_h */
@@ -15,7 +15,7 @@
 #include "Lsm9ds1Imu.h"
 
 #include <stdio.h>
-#include <Wire.h>
+#include "I2cWire.h" // Not <Wire.h> - see I2cWire.h
 #include <SPI.h>
 
 
@@ -30,8 +30,6 @@
 //Adafruit_LSM9DS1 lsm = Adafruit_LSM9DS1(LSM9DS1_XGCS, LSM9DS1_MCS);
 
 
-#define IMU_SAMPLE_RATE_MS 50
-
 Lsm9ds1Imu::Lsm9ds1Imu() {
     // Hmm .. Serial may not yet be up. Wait for setup() to be called to do stuff.
 }
@@ -48,39 +46,58 @@ void Lsm9ds1Imu::setup() {
         while (1);
     }
     Serial.println("D Found LSM9DS1");
+    i2cBus.setDevice(LSM9DS1_ADDRESS_ACCELGYRO, IMU_I2C_PRIORITY, IMU_I2C_DEADLINE_US); // Ahead of anyone else's. See Imu.h I2C.
+    i2cBus.setDevice(LSM9DS1_ADDRESS_MAG, IMU_I2C_PRIORITY, IMU_I2C_DEADLINE_US);
     // 1.) Set the accelerometer range
     lsm9ds1.setupAccel(lsm9ds1.LSM9DS1_ACCELRANGE_2G);
+    accelScale = LSM9DS1_ACCEL_MG_LSB_2G / 1000.0 * SENSORS_GRAVITY_STANDARD;
     //lsm9ds1.setupAccel(lsm9ds1.LSM9DS1_ACCELRANGE_4G);
     //lsm9ds1.setupAccel(lsm9ds1.LSM9DS1_ACCELRANGE_8G);
     //lsm9ds1.setupAccel(lsm9ds1.LSM9DS1_ACCELRANGE_16G);
     
     // 2.) Set the magnetometer sensitivity
     lsm9ds1.setupMag(lsm9ds1.LSM9DS1_MAGGAIN_4GAUSS);
+    magScale = LSM9DS1_MAG_MGAUSS_4GAUSS / 1000.0;
     //lsm9ds1.setupMag(lsm9ds1.LSM9DS1_MAGGAIN_8GAUSS);
     //lsm9ds1.setupMag(lsm9ds1.LSM9DS1_MAGGAIN_12GAUSS);
     //lsm9ds1.setupMag(lsm9ds1.LSM9DS1_MAGGAIN_16GAUSS);
     
     // 3.) Setup the gyroscope
     lsm9ds1.setupGyro(lsm9ds1.LSM9DS1_GYROSCALE_245DPS);
+    gyroScale = LSM9DS1_GYRO_DPS_DIGIT_245DPS;
     //lsm9ds1.setupGyro(lsm9ds1.LSM9DS1_GYROSCALE_500DPS);
     //lsm9ds1.setupGyro(lsm9ds1.LSM9DS1_GYROSCALE_2000DPS);
+    Imu::setup();
 }
 
 
+/**
+ * Burst read three axes (X_L, X_H, Y_L .. Z_H) into raw[], low byte first - the same as the AVR, so they go straight in.
+ */
+byte Lsm9ds1Imu::readRaw(boolean type, byte reg, int16_t *raw) {
+    return lsm9ds1.readBuffer(type, 0x80 | reg, 6, (uint8_t *) raw) != 0;
+}
+
+/**
+ * Raw reads, rather than read() and getEvent() - see Imu RAW READINGS.
+ */
 void Lsm9ds1Imu::readSensor() {
-    lsm9ds1.read();
-    sensors_event_t a, m, g, temp;    
-    lsm9ds1.getEvent(&a, &m, &g, &temp);
+    if (!readRaw(XGTYPE, lsm9ds1.LSM9DS1_REGISTER_OUT_X_L_G, rawGyro))
+        readError(IMU_GYRO);
+    if (!readRaw(XGTYPE, lsm9ds1.LSM9DS1_REGISTER_OUT_X_L_XL, rawAcceleration))
+        readError(IMU_ACCEL);
+    magneticFresh = magneticDue();
+    if (magneticFresh && !readRaw(MAGTYPE, lsm9ds1.LSM9DS1_REGISTER_OUT_X_L_M, rawMagnetic)) {
+        readError(IMU_MAG);
+        magneticFresh = false;
+    }
     // This section is seriously messed up.
     // It need to be thought through from scratch, and then compared to whatever TF the LSM9DS1 magnetometer is actually up to.
-    gyro[0] = g.gyro.x;
-    gyro[1] = -g.gyro.y;
-    gyro[2] = g.gyro.z;
-    acceleration[0] = a.acceleration.x;
-    acceleration[1] = -a.acceleration.y;
-    acceleration[2] = a.acceleration.z;
-    magnetic[0] = -m.magnetic.x;
-    magnetic[1] = m.magnetic.y;
-    magnetic[2] = m.magnetic.z;
+    rawGyro[1] = -rawGyro[1];
+    correctGyro();
+    rawAcceleration[1] = -rawAcceleration[1];
+    if (magneticFresh) {
+        rawMagnetic[0] = -rawMagnetic[0];
+        correctMagnetic();
+    }
 }
-
@@ -28,11 +28,12 @@
 class Lsm9ds1Imu : public Imu {
 private:
     Adafruit_LSM9DS1 lsm9ds1 = Adafruit_LSM9DS1();
+    byte readRaw(boolean type, byte reg, int16_t *raw);
 public:
     Lsm9ds1Imu();
     virtual void setup();
     virtual void readSensor();
-    virtual void report();
+    virtual byte readBatch() { Lsm9ds1Imu::readSensor(); return 1; }; // No FIFO - one sample. Static call, so Ahrs<Lsm9ds1Imu> inlines it.
 };
 
 #endif /* Lsm9ds1Imu_h */
@@ -21,6 +21,7 @@
 
 #include "MadgwickAHRS.h"
 #include <math.h>
+#include <stdint.h>
 
 //-------------------------------------------------------------------------------------------
 // Definitions
@@ -230,10 +231,10 @@ void Madgwick::updateIMU(float gx, float gy, float gz, float ax, float ay, float
 
 float Madgwick::invSqrt(float x) {
 	float halfx = 0.5f * x;
-	float y = x;
-	long i = *(long*)&y;
-	i = 0x5f3759df - (i>>1);
-	y = *(float*)&i;
+	union { float f; int32_t i; } conv;	// Not pointer casts - those break strict aliasing (eg g++ -O2 on the host)
+	conv.f = x;
+	conv.i = 0x5f3759df - (conv.i>>1);
+	float y = conv.f;
 	y = y * (1.5f - (halfx * y * y));
 	y = y * (1.5f - (halfx * y * y));
 	return y;
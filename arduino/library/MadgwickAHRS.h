@@ -42,6 +42,16 @@ public:
     void begin(float sampleFrequency) { invSampleFreq = 1.0f / sampleFrequency; }
     void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
     void updateIMU(float gx, float gy, float gz, float ax, float ay, float az);
+    // As above, but integrating over dt seconds (eg measured with micros()) instead of 1 / sampleFrequency.
+    void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt) {
+        invSampleFreq = dt;
+        update(gx, gy, gz, ax, ay, az, mx, my, mz);
+    }
+    void updateIMU(float gx, float gy, float gz, float ax, float ay, float az, float dt) {
+        invSampleFreq = dt;
+        updateIMU(gx, gy, gz, ax, ay, az);
+    }
+    void setBeta(float beta) { this->beta = beta; }   // Algorithm gain. Default 0.1.
     //float getPitch(){return atan2f(2.0f * q2 * q3 - 2.0f * q0 * q1, 2.0f * q0 * q0 + 2.0f * q3 * q3 - 1.0f);};
     //float getRoll(){return -1.0f * asinf(2.0f * q1 * q3 + 2.0f * q0 * q2);};
     //float getYaw(){return atan2f(2.0f * q1 * q2 - 2.0f * q0 * q3, 2.0f * q0 * q0 + 2.0f * q1 * q1 - 1.0f);};
@@ -69,6 +79,8 @@ public:
         if (!anglesComputed) computeAngles();
         return yaw;
     }
+    // The filter's actual state (w x y z) - roll, pitch and yaw are derived from it. Costs nothing.
+    void getQuaternion(float *q) { q[0] = q0; q[1] = q1; q[2] = q2; q[3] = q3; }
 };
 #endif
 
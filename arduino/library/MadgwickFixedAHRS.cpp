@@ -0,0 +1,265 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     MadgwickFixedAHRS.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * DERIVATION
+ *     MadgwickAHRS.cpp, rewritten as Madgwick's paper has it - gradient = J' f, with f the difference between where the
+ *     quaternion says gravity (and the earth's field) should be and where it was measured - because in that form every
+ *     term has a known bound:
+ *         f for gravity is in [-2, 2], so we use f/2.        J's entries are up to 4q, so we use J/4.
+ *         f for the field is in [-1.5, 1.5] (Madgwick's reference field is half strength - kept, so the answers match).
+ *     Each gradient term (and partial sum) is then a dot product of vectors no longer than 1, and 1/8 of Madgwick's.
+ *     Only its direction is used, so the 1/8 doesn't matter.
+ */
+
+#include <math.h>
+
+#include "MadgwickFixedAHRS.h"
+
+#define betaDef         0.1f            // As MadgwickAHRS.cpp
+#define sampleFreqDef   512.0f
+#define HALF            (MADGWICK_FIXED_ONE / 2)
+#define MAX_HALF_ANGLE  (MADGWICK_FIXED_ONE / 2)   /* 1 radian step, halved. See LIMITS. */
+
+/**
+ * a * b, Q2.30, rounded to nearest. The product must be in [-2, 2).
+ * Four 16x16->32 multiplies (the AVR has an 8x8 hardware multiply, so these are a few instructions each, not a library
+ * call - unlike a 32x32->64 multiply). Rounding, not truncating, matters: a bias of even one bit per multiply, a few
+ * hundred multiplies a second, shows up as steady drift in yaw.
+ */
+static inline int32_t mul(int32_t a, int32_t b) {
+    int16_t ah = a >> 16;
+    uint16_t al = a;
+    int16_t bh = b >> 16;
+    uint16_t bl = b;
+    // a * b = ah*bh << 32 + (ah*bl + al*bh) << 16 + al*bl. The middle is halved first, so the sum can't overflow.
+    int32_t middle = (((int32_t) ah * bl) >> 1) + (((int32_t) bh * al) >> 1) + (int32_t) (((uint32_t) al * bl) >> 17);
+    return (int32_t) ah * bh * 4 + ((middle + (1L << 12)) >> 13);
+}
+
+/**
+ * 1/sqrt(x) for x in [0.5, 2). Q2.30 in and out (the answer is in (0.707, 1.414]).
+ * Straight line guess (under 6% out), then three Newton steps (6% -> 0.5% -> 0.004% -> nothing).
+ */
+static int32_t invSqrt(int32_t x) {
+    int32_t y = x < MADGWICK_FIXED_ONE
+        ? 1963258676L - mul(x, 889516852L)        // 1.8284 - 0.8284x on [0.5, 1)
+        : 1388233523L - mul(x, 314491699L);       // 1.2929 - 0.2929x on [1, 2)
+    int32_t halfX = x / 2;
+    for (uint8_t i = 0; i < 3; i++)
+        y = mul(y, 3 * HALF - mul(mul(halfX, y), y));     // y^2 could be 2 - out of range - so not that way round.
+    return y;
+}
+
+/**
+ * Scales v (n components, each in [-2, 2)) to length 1. Returns false, and leaves v alone, if it is zero.
+ * Works on v/4, shifted up (by whole bits, so exactly) until its biggest component is at least 1/4 - so the sum of squares
+ * can't overflow, and a short vector (the gradient, near convergence) doesn't lose its direction in the bottom bits.
+ * Then up by pairs of bits until the sum of squares is in [0.5, 2), for invSqrt().
+ */
+static char normalise(int32_t *v, uint8_t n) {
+    int32_t u[4];
+    int32_t biggest = 0;
+    for (uint8_t i = 0; i < n; i++) {
+        u[i] = v[i] / 4;
+        int32_t size = u[i] < 0 ? -u[i] : u[i];
+        if (size > biggest)
+            biggest = size;
+    }
+    if (biggest == 0)
+        return false;
+    char shift = 0;
+    while (biggest < MADGWICK_FIXED_ONE / 4) {
+        biggest *= 2;
+        shift++;
+    }
+    int32_t sumSquares = 0;
+    for (uint8_t i = 0; i < n; i++) {
+        u[i] *= (1L << shift);
+        sumSquares += mul(u[i], u[i]);
+    }
+    shift = 0;
+    while (sumSquares < HALF) {   // At least 1/16, so twice at most.
+        sumSquares *= 4;
+        shift++;
+    }
+    int32_t scale = invSqrt(sumSquares);
+    for (uint8_t i = 0; i < n; i++)
+        v[i] = mul(u[i] * (1L << shift), scale);
+    return true;
+}
+
+/**
+ * sqrt(x) for x in [0, 1]. Q2.30.
+ */
+static int32_t squareRoot(int32_t x) {
+    if (x <= 0)
+        return 0;
+    char shift = 0;
+    while (x < HALF) {
+        x *= 4;
+        shift++;
+    }
+    return mul(x, invSqrt(x)) >> shift;
+}
+
+// Converts a float in [-1, 1] to Q2.30.
+static int32_t toFixed(float f) {
+    return (int32_t) (f * (float) MADGWICK_FIXED_ONE);
+}
+
+//============================================================================================
+
+MadgwickFixed::MadgwickFixed() {
+    beta = betaDef;
+    q0 = MADGWICK_FIXED_ONE;
+    q1 = 0;
+    q2 = 0;
+    q3 = 0;
+    invSampleFreq = 1.0f / sampleFreqDef;
+    anglesComputed = 0;
+}
+
+/**
+ * Works out the dt dependent constants again - only when dt has changed, which with measured dts is once a batch.
+ */
+void MadgwickFixed::rescale() {
+    scaledFor = invSampleFreq;
+    gyroToHalfAngle = 0.5f * 0.0174533f * invSampleFreq * (float) MADGWICK_FIXED_ONE;
+    betaDt = toFixed(beta * invSampleFreq);
+}
+
+/**
+ * The gyro's part of the step: q * (0, w dt) / 2.
+ */
+void MadgwickFixed::gyroStep(float gx, float gy, float gz, int32_t *qDot) {
+    if (invSampleFreq != scaledFor)
+        rescale();
+    float g[3] = { gx * gyroToHalfAngle, gy * gyroToHalfAngle, gz * gyroToHalfAngle };
+    int32_t h[3];
+    for (uint8_t i = 0; i < 3; i++)
+        h[i] = g[i] > (float) MAX_HALF_ANGLE ? MAX_HALF_ANGLE : g[i] < (float) -MAX_HALF_ANGLE ? -MAX_HALF_ANGLE : (int32_t) g[i];
+    qDot[0] = -mul(q1, h[0]) - mul(q2, h[1]) - mul(q3, h[2]);
+    qDot[1] = mul(q0, h[0]) + mul(q2, h[2]) - mul(q3, h[1]);
+    qDot[2] = mul(q0, h[1]) - mul(q1, h[2]) + mul(q3, h[0]);
+    qDot[3] = mul(q0, h[2]) + mul(q1, h[1]) - mul(q2, h[0]);
+}
+
+/**
+ * Normalises the accelerometer into a[], in float, unless it's the same reading as last time (it usually is).
+ * @return false if there's no reading (all zero) - no feedback then.
+ */
+char MadgwickFixed::normaliseAcceleration(float ax, float ay, float az) {
+    if (ax == 0.0f && ay == 0.0f && az == 0.0f)
+        return false;
+    if (ax != lastAx || ay != lastAy || az != lastAz) {
+        lastAx = ax; lastAy = ay; lastAz = az;
+        float recipNorm = 1.0f / sqrtf(ax * ax + ay * ay + az * az);
+        a[0] = toFixed(ax * recipNorm);
+        a[1] = toFixed(ay * recipNorm);
+        a[2] = toFixed(az * recipNorm);
+    }
+    return true;
+}
+
+/**
+ * q += qDot - beta dt s/|s|, then normalise q. s may be null (no feedback).
+ */
+void MadgwickFixed::integrate(int32_t *qDot, int32_t *s) {
+    int32_t q[4] = { q0, q1, q2, q3 };
+    char steer = s != 0 && normalise(s, 4);
+    for (uint8_t i = 0; i < 4; i++) {
+        q[i] += qDot[i];
+        if (steer)
+            q[i] -= mul(betaDt, s[i]);
+    }
+    if (normalise(q, 4)) {
+        q0 = q[0]; q1 = q[1]; q2 = q[2]; q3 = q[3];
+    }
+    anglesComputed = 0;
+}
+
+void MadgwickFixed::updateIMU(float gx, float gy, float gz, float ax, float ay, float az) {
+    int32_t qDot[4];
+    gyroStep(gx, gy, gz, qDot);
+    if (!normaliseAcceleration(ax, ay, az)) {
+        integrate(qDot, 0);
+        return;
+    }
+    // f/2: half of (estimated - measured) gravity direction.
+    int32_t f0 = mul(q1, q3) - mul(q0, q2) - a[0] / 2;
+    int32_t f1 = mul(q0, q1) + mul(q2, q3) - a[1] / 2;
+    int32_t f2 = HALF - mul(q1, q1) - mul(q2, q2) - a[2] / 2;
+    // s/8 = (J/4)' (f/2)
+    int32_t s[4];
+    s[0] = -mul(q2 / 2, f0) + mul(q1 / 2, f1);
+    s[1] = mul(q3 / 2, f0) + mul(q0 / 2, f1) - mul(q1, f2);
+    s[2] = -mul(q0 / 2, f0) + mul(q3 / 2, f1) - mul(q2, f2);
+    s[3] = mul(q1 / 2, f0) + mul(q2 / 2, f1);
+    integrate(qDot, s);
+}
+
+void MadgwickFixed::update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz) {
+    // Use IMU algorithm if magnetometer measurement invalid (avoids NaN in magnetometer normalisation)
+    if (mx == 0.0f && my == 0.0f && mz == 0.0f) {
+        updateIMU(gx, gy, gz, ax, ay, az);
+        return;
+    }
+    int32_t qDot[4];
+    gyroStep(gx, gy, gz, qDot);
+    if (!normaliseAcceleration(ax, ay, az)) {
+        integrate(qDot, 0);
+        return;
+    }
+    float recipNorm = 1.0f / sqrtf(mx * mx + my * my + mz * mz);
+    int32_t m0 = toFixed(mx * recipNorm);
+    int32_t m1 = toFixed(my * recipNorm);
+    int32_t m2 = toFixed(mz * recipNorm);
+
+    int32_t q0q0 = mul(q0, q0), q0q1 = mul(q0, q1), q0q2 = mul(q0, q2), q0q3 = mul(q0, q3);
+    int32_t q1q1 = mul(q1, q1), q1q2 = mul(q1, q2), q1q3 = mul(q1, q3);
+    int32_t q2q2 = mul(q2, q2), q2q3 = mul(q2, q3), q3q3 = mul(q3, q3);
+
+    // Earth frame field h = q m q*, one rotation matrix row at a time (each row is a unit vector, so each is in [-1, 1]).
+    int32_t hx = mul(q0q0 + q1q1 - q2q2 - q3q3, m0) + mul(2 * (q1q2 - q0q3), m1) + mul(2 * (q1q3 + q0q2), m2);
+    int32_t hy = mul(2 * (q1q2 + q0q3), m0) + mul(q0q0 - q1q1 + q2q2 - q3q3, m1) + mul(2 * (q2q3 - q0q1), m2);
+    int32_t hz = mul(2 * (q1q3 - q0q2), m0) + mul(2 * (q2q3 + q0q1), m1) + mul(q0q0 - q1q1 - q2q2 + q3q3, m2);
+    // Madgwick's reference field: _2bx = |h in the horizontal|, _2bz = h vertical. (Despite the names, not doubled.)
+    int32_t bx = squareRoot(mul(hx, hx) + mul(hy, hy));
+    int32_t bz = hz;
+
+    // f/2, gravity then field.
+    int32_t f0 = q1q3 - q0q2 - a[0] / 2;
+    int32_t f1 = q0q1 + q2q3 - a[1] / 2;
+    int32_t f2 = HALF - q1q1 - q2q2 - a[2] / 2;
+    int32_t f3 = (mul(bx, HALF - q2q2 - q3q3) + mul(bz, q1q3 - q0q2) - m0) / 2;
+    int32_t f4 = (mul(bx, q1q2 - q0q3) + mul(bz, q0q1 + q2q3) - m1) / 2;
+    int32_t f5 = (mul(bx, q0q2 + q1q3) + mul(bz, HALF - q1q1 - q2q2) - m2) / 2;
+    // J/4 for the field rows, in terms of bx/4 and bz/4.
+    int32_t bx4 = bx / 4, bz4 = bz / 4;
+    int32_t s[4];
+    s[0] = -mul(q2 / 2, f0) + mul(q1 / 2, f1)
+        - mul(mul(bz4, q2), f3) + mul(mul(bz4, q1) - mul(bx4, q3), f4) + mul(mul(bx4, q2), f5);
+    s[1] = mul(q3 / 2, f0) + mul(q0 / 2, f1) - mul(q1, f2)
+        + mul(mul(bz4, q3), f3) + mul(mul(bx4, q2) + mul(bz4, q0), f4) + mul(mul(bx4, q3) - 2 * mul(bz4, q1), f5);
+    s[2] = -mul(q0 / 2, f0) + mul(q3 / 2, f1) - mul(q2, f2)
+        - mul(2 * mul(bx4, q2) + mul(bz4, q0), f3) + mul(mul(bx4, q1) + mul(bz4, q3), f4) + mul(mul(bx4, q0) - 2 * mul(bz4, q2), f5);
+    s[3] = mul(q1 / 2, f0) + mul(q2 / 2, f1)
+        + mul(mul(bz4, q1) - 2 * mul(bx4, q3), f3) + mul(mul(bz4, q2) - mul(bx4, q0), f4) + mul(mul(bx4, q1), f5);
+    integrate(qDot, s);
+}
+
+//-------------------------------------------------------------------------------------------
+
+void MadgwickFixed::computeAngles() {
+    float f0 = q0 / (float) MADGWICK_FIXED_ONE, f1 = q1 / (float) MADGWICK_FIXED_ONE;
+    float f2 = q2 / (float) MADGWICK_FIXED_ONE, f3 = q3 / (float) MADGWICK_FIXED_ONE;
+    roll = atan2f(f0*f1 + f2*f3, 0.5f - f1*f1 - f2*f2);
+    pitch = asinf(-2.0f * (f1*f3 - f0*f2));
+    yaw = atan2f(f1*f2 + f0*f3, 0.5f - f2*f2 - f3*f3);
+    anglesComputed = 1;
+}
@@ -0,0 +1,105 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     MadgwickFixed
+ * PURPOSE
+ *     Madgwick's filter (MadgwickAHRS) in fixed point, for the Nano, which has no floating point hardware.
+ *     Same interface, same algorithm, same answers to within MADGWICK_FIXED_ERROR_DEGREES - so it drops into
+ *     Ahrs<IMU, MadgwickFixed> in place of Madgwick.
+ *     Not a King.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * FORMAT
+ *     Q2.30: int32_t, 1.0 is 1 << 30, range [-2, 2). The quaternion, the normalised accelerometer and magnetometer
+ *     directions, and everything in between are Q2.30.
+ *     A multiply is four 16x16->32 bit multiplies (a few AVR hardware multiplies each), rounded back to Q2.30;
+ *     adds are adds. Against avr-libc's software float multiplies and adds that ought to be a good deal faster, but it is
+ *     an estimate: it hasn't been timed on a Nano yet. ahrsbenchmark measures it against Madgwick (see RESULTS there).
+ *     Every intermediate is arranged to stay inside [-2, 2) (see MadgwickFixedAHRS.cpp), given a unit quaternion and unit
+ *     measurements - which is why the gradient is computed as 1/8 of Madgwick's (its direction is all that's used).
+ * FLOATS
+ *     Only at the edges: the gyro (degrees/second) is scaled by dt and converted (3 multiplies), the accelerometer is
+ *     normalised in float once per new reading (Ahrs hands it the same reading for a whole batch, so once a batch), the
+ *     magnetometer once per fresh reading, and roll/pitch/yaw are worked out in float only when asked for.
+ * LIMITS
+ *     A single step may not rotate more than 1 radian about any axis (eg 400 degrees/second with a 50ms dt) - the gyro step
+ *     is clamped there. Madgwick's first order integration is meaningless well before that anyway.
+ * ACCURACY
+ *     Checked against the float version with tools/ahrsbench.cpp (run it over an imucapture.py recording, or a simulated run
+ *     in the same format). Roll, pitch and yaw stay within MADGWICK_FIXED_ERROR_DEGREES of it, with rover-like tilts.
+ *     Near pitch +-90 degrees roll and yaw are ill defined, and any two filters' Euler angles can differ much more there.
+ *     Its own rounding is unbiased, so, unlike truncating fixed point, it doesn't add a drift of its own.
+ */
+
+#ifndef MadgwickFixedAHRS_h
+#define MadgwickFixedAHRS_h
+
+#include <stdint.h>
+
+#define MADGWICK_FIXED_ONE            1073741824L   /* 1.0 in Q2.30 */
+#define MADGWICK_FIXED_ERROR_DEGREES  0.05f         /* Bound on the difference from float Madgwick (ahrsbench saw 0.01 at worst) */
+
+class MadgwickFixed {
+private:
+    int32_t q0, q1, q2, q3;              // Quaternion of sensor frame relative to auxiliary frame. Q2.30.
+    float beta;                          // Algorithm gain.
+    float invSampleFreq;                 // dt, seconds.
+    float scaledFor = -1.0f;             // The dt that gyroToHalfAngle and betaDt were worked out for.
+    float gyroToHalfAngle;               // Degrees/second -> half the angle turned in dt, radians Q2.30.
+    int32_t betaDt;                      // beta * dt, Q2.30.
+    float lastAx = 0.0f, lastAy = 0.0f, lastAz = 0.0f;   // The accelerometer reading a[] was normalised from.
+    int32_t a[3];                        // Normalised accelerometer. Q2.30.
+    float roll, pitch, yaw;
+    char anglesComputed;
+    void computeAngles();
+    void rescale();
+    void gyroStep(float gx, float gy, float gz, int32_t *qDot);
+    char normaliseAcceleration(float ax, float ay, float az);
+    void integrate(int32_t *qDot, int32_t *s);
+public:
+    MadgwickFixed();
+    void begin(float sampleFrequency) { invSampleFreq = 1.0f / sampleFrequency; }
+    void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+    void updateIMU(float gx, float gy, float gz, float ax, float ay, float az);
+    // As above, but integrating over dt seconds instead of 1 / sampleFrequency.
+    void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt) {
+        invSampleFreq = dt;
+        update(gx, gy, gz, ax, ay, az, mx, my, mz);
+    }
+    void updateIMU(float gx, float gy, float gz, float ax, float ay, float az, float dt) {
+        invSampleFreq = dt;
+        updateIMU(gx, gy, gz, ax, ay, az);
+    }
+    void setBeta(float beta) { this->beta = beta; scaledFor = -1.0f; }   // Algorithm gain. Default 0.1.
+    float getRoll() {
+        if (!anglesComputed) computeAngles();
+        return roll * 57.29578f;
+    }
+    float getPitch() {
+        if (!anglesComputed) computeAngles();
+        return pitch * 57.29578f;
+    }
+    float getYaw() {
+        if (!anglesComputed) computeAngles();
+        return yaw * 57.29578f + 180.0f;
+    }
+    float getRollRadians() {
+        if (!anglesComputed) computeAngles();
+        return roll;
+    }
+    float getPitchRadians() {
+        if (!anglesComputed) computeAngles();
+        return pitch;
+    }
+    float getYawRadians() {
+        if (!anglesComputed) computeAngles();
+        return yaw;
+    }
+    // The filter's actual state (w x y z), as floats - roll, pitch and yaw are derived from it. Four int->float conversions.
+    void getQuaternion(float *q) {
+        q[0] = q0 / (float) MADGWICK_FIXED_ONE; q[1] = q1 / (float) MADGWICK_FIXED_ONE;
+        q[2] = q2 / (float) MADGWICK_FIXED_ONE; q[3] = q3 / (float) MADGWICK_FIXED_ONE;
+    }
+};
+
+#endif /* MadgwickFixedAHRS_h */
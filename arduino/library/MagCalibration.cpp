@@ -0,0 +1,130 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     MagCalibration.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include "MagCalibration.h"
+
+// What actually goes into the EEPROM.
+struct MagCalibrationEeprom {
+    uint16_t magic;
+    int16_t offset[3];
+    int16_t scale[3];
+};
+
+MagCalibration::MagCalibration() {
+    setIdentity();
+}
+
+void MagCalibration::setIdentity() {
+    for (byte i = 0; i < 3; i++) {
+        offset[i] = 0;
+        scale[i] = MAG_CALIBRATION_ONE;
+    }
+}
+
+/**
+ * Called for every magnetometer reading, so keep it cheap.
+ */
+void MagCalibration::apply(int16_t *m) {
+    for (byte i = 0; i < 3; i++) {
+        int32_t corrected = (((int32_t) m[i] - offset[i]) * scale[i]) >> MAG_CALIBRATION_SHIFT;
+        m[i] = constrain(corrected, (int32_t) -32767, (int32_t) 32767);
+    }
+}
+
+void MagCalibration::start() {
+    samples = 0;
+    calibrating = true;
+}
+
+void MagCalibration::sample(const int16_t *m) {
+    if (!calibrating)
+        return;
+    for (byte i = 0; i < 3; i++) {
+        if (samples == 0) {
+            smoothed[i] = lo[i] = hi[i] = m[i];
+            continue;
+        }
+        smoothed[i] += ((int32_t) m[i] - smoothed[i]) / 4;
+        if (smoothed[i] < lo[i]) lo[i] = smoothed[i];
+        if (smoothed[i] > hi[i]) hi[i] = smoothed[i];
+    }
+    if (samples < 0xFFFF)
+        samples++;
+}
+
+/**
+ * Axes that swung far enough get a new offset and scale; the rest keep what they had.
+ * The scales stretch each calibrated axis to the average radius of the calibrated axes, so the field strength is about unchanged.
+ */
+byte MagCalibration::finish() {
+    calibrating = false;
+    int32_t radiusSum = 0;
+    byte axes = 0;
+    for (byte i = 0; i < 3; i++)
+        if (samples > 0 && (int32_t) hi[i] - lo[i] >= MAG_CALIBRATION_MIN_RANGE) {
+            radiusSum += ((int32_t) hi[i] - lo[i]) / 2;
+            axes++;
+        }
+    if (axes == 0)
+        return 0;
+    int32_t radius = radiusSum / axes;
+    for (byte i = 0; i < 3; i++)
+        if ((int32_t) hi[i] - lo[i] >= MAG_CALIBRATION_MIN_RANGE) {
+            offset[i] = ((int32_t) hi[i] + lo[i]) / 2;
+            int32_t s = (radius << MAG_CALIBRATION_SHIFT) / (((int32_t) hi[i] - lo[i]) / 2);
+            scale[i] = constrain(s, (int32_t) 1, (int32_t) 32767);
+        }
+    return axes;
+}
+
+/**
+ * @return true if valid coefficients were found (and are now in use).
+ */
+byte MagCalibration::load(int address) {
+    MagCalibrationEeprom stored;
+    EEPROM.get(address, stored);
+    if (stored.magic != MAG_CALIBRATION_MAGIC)
+        return false;
+    for (byte i = 0; i < 3; i++) {
+        offset[i] = stored.offset[i];
+        scale[i] = stored.scale[i];
+    }
+    return true;
+}
+
+void MagCalibration::save(int address) {
+    MagCalibrationEeprom stored;
+    stored.magic = MAG_CALIBRATION_MAGIC;
+    for (byte i = 0; i < 3; i++) {
+        stored.offset[i] = offset[i];
+        stored.scale[i] = scale[i];
+    }
+    EEPROM.put(address, stored); // put() uses update(), so rewriting unchanged coefficients doesn't wear the EEPROM.
+}
+
+void MagCalibration::forget(int address) {
+    uint16_t noMagic = 0;
+    EEPROM.put(address, noMagic);
+}
+
+void MagCalibration::report(const char *prefix) {
+    Serial.print(prefix);
+    for (byte i = 0; i < 3; i++) {
+        Serial.print(offset[i]); Serial.print(" ");
+    }
+    for (byte i = 0; i < 3; i++) {
+        if (i > 0) Serial.print(" ");
+        Serial.print((int) ((int32_t) scale[i] * 1000 / MAG_CALIBRATION_ONE));
+    }
+    Serial.println();
+}
@@ -0,0 +1,58 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     MagCalibration
+ * PURPOSE
+ *     Hard-iron (offset) and soft-iron (per-axis scale) correction for a magnetometer, fitted on board from streaming samples.
+ *     Not a King - it is owned by the Imu, which feeds it and applies it to every magnetometer reading.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * DETAILS
+ *     The motors, their currents and the chassis steel add a constant field (hard iron) and squash the earth's field more along
+ *     some axes than others (soft iron), so a full turn traces an off-centre ellipse, not a circle about zero - and yaw is skewed.
+ *     While calibrating we only keep the (lightly smoothed) min and max seen on each axis - constant memory, no sample cloud.
+ *     On finish(), the offset is the middle of each range, and the scale stretches each axis to the average radius.
+ *     That's the axis-aligned ellipse fit; it doesn't model cross-axis soft iron, but it is a handful of bytes and subtracts and
+ *     multiplies, which is what the Nano can afford.
+ *     An axis which didn't swing through at least MAG_CALIBRATION_MIN_RANGE is left as it was (eg Z, if the rover only spins flat).
+ * APPLYING
+ *     apply() is three subtracts, three long multiplies and shifts (scale is in 1/4096ths) - a few microseconds, no floats.
+ * EEPROM
+ *     The coefficients are saved with a magic number, so a blank (or foreign) EEPROM is ignored.
+ */
+
+#ifndef MagCalibration_h
+#define MagCalibration_h
+
+#include <Arduino.h>
+
+#define MAG_CALIBRATION_MAGIC      0x4D43     /* "MC" - marks valid coefficients in EEPROM */
+#define MAG_CALIBRATION_ONE        4096       /* A scale of 1.0 */
+#define MAG_CALIBRATION_SHIFT      12         /* .. ie 1 << MAG_CALIBRATION_SHIFT */
+#define MAG_CALIBRATION_MIN_RANGE  500        /* Counts (max - min) an axis must swing through to be calibrated. ~0.08 gauss at 4 gauss range. */
+
+class MagCalibration {
+private:
+    int16_t offset[3];                        // Counts, subtracted first.
+    int16_t scale[3];                         // Then multiplied by scale / MAG_CALIBRATION_ONE.
+    byte calibrating = false;
+    uint16_t samples = 0;                     // Seen since start().
+    int16_t smoothed[3];                      // Low-passed samples, so a single glitch doesn't stretch the range.
+    int16_t lo[3];
+    int16_t hi[3];
+public:
+    MagCalibration();
+    void setIdentity();                       // No correction.
+    void apply(int16_t *m);                   // Correct a raw (NWU) reading in place.
+    void start();                             // Start collecting. Spin the rover (through every axis you want corrected).
+    void sample(const int16_t *m);            // Feed a raw, uncorrected reading. Ignored unless calibrating.
+    byte finish();                            // Fit. Returns the number of axes calibrated (0 => nothing changed).
+    void abort() { calibrating = false; };
+    byte isCalibrating() { return calibrating; };
+    byte load(int address);                   // From EEPROM. Returns false (and leaves the coefficients alone) if nothing valid there.
+    void save(int address);                   // To EEPROM.
+    void forget(int address);                 // Invalidates the EEPROM copy. Doesn't change the coefficients in use.
+    void report(const char *prefix);          // Writes "<prefix>ox oy oz sx sy sz" to Serial. Scales in 1/1000ths.
+};
+
+#endif /* MagCalibration_h */
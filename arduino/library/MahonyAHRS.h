@@ -0,0 +1,84 @@
+//=============================================================================================
+// MahonyAHRS.h
+//=============================================================================================
+//
+// Madgwick's implementation of Mayhony's AHRS algorithm.
+// See: http://www.x-io.co.uk/open-source-imu-and-ahrs-algorithms/
+//
+// From the x-io website "Open-source resources available on this website are
+// provided under the GNU General Public Licence unless an alternative licence
+// is provided in source."
+//
+// Date			Author			Notes
+// 29/09/2011	SOH Madgwick    Initial release
+// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
+//
+// Same interface as Madgwick (see MadgwickAHRS.h), so Ahrs can use either.
+// A cross-product error and a PI correction, instead of a normalised gradient step: 2 invSqrt per updateIMU (Madgwick 3),
+// 3 per update (Madgwick 4). That should make it cheaper, but it hasn't been timed on a Nano yet - see ahrsbenchmark.
+//
+//=============================================================================================
+#ifndef MahonyAHRS_h
+#define MahonyAHRS_h
+#include <math.h>
+
+//--------------------------------------------------------------------------------------------
+// Variable declaration
+class Mahony {
+private:
+	static float invSqrt(float x);
+	float twoKp;		// 2 * proportional gain (Kp)
+	float twoKi;		// 2 * integral gain (Ki)
+	float q0, q1, q2, q3;	// quaternion of sensor frame relative to auxiliary frame
+	float integralFBx, integralFBy, integralFBz;  // integral error terms scaled by Ki
+	float invSampleFreq;
+	float roll, pitch, yaw;
+	char anglesComputed;
+	void computeAngles();
+
+//-------------------------------------------------------------------------------------------
+// Function declarations
+public:
+	Mahony();
+	void begin(float sampleFrequency) { invSampleFreq = 1.0f / sampleFrequency; }
+	void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+	void updateIMU(float gx, float gy, float gz, float ax, float ay, float az);
+	// As above, but integrating over dt seconds instead of 1 / sampleFrequency.
+	void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt) {
+		invSampleFreq = dt;
+		update(gx, gy, gz, ax, ay, az, mx, my, mz);
+	}
+	void updateIMU(float gx, float gy, float gz, float ax, float ay, float az, float dt) {
+		invSampleFreq = dt;
+		updateIMU(gx, gy, gz, ax, ay, az);
+	}
+	void setGains(float kp, float ki) { twoKp = 2.0f * kp; twoKi = 2.0f * ki; }
+	float getRoll() {
+		if (!anglesComputed) computeAngles();
+		return roll * 57.29578f;
+	}
+	float getPitch() {
+		if (!anglesComputed) computeAngles();
+		return pitch * 57.29578f;
+	}
+	float getYaw() {
+		if (!anglesComputed) computeAngles();
+		return yaw * 57.29578f + 180.0f;
+	}
+	float getRollRadians() {
+		if (!anglesComputed) computeAngles();
+		return roll;
+	}
+	float getPitchRadians() {
+		if (!anglesComputed) computeAngles();
+		return pitch;
+	}
+	float getYawRadians() {
+		if (!anglesComputed) computeAngles();
+		return yaw;
+	}
+	// The filter's actual state (w x y z) - roll, pitch and yaw are derived from it. Costs nothing.
+	void getQuaternion(float *q) { q[0] = q0; q[1] = q1; q[2] = q2; q[3] = q3; }
+};
+
+#endif
@@ -0,0 +1,118 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     PowerCurve.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include "PowerCurve.h"
+
+// What actually goes into the EEPROM.
+struct PowerCurveEeprom {
+    uint16_t magic;
+    int speedAtPowerMmPS[POWER_CURVE_STEPS];
+};
+
+/**
+ * Does not touch the EEPROM (the constructor runs before setup()). Call load() for that.
+ * @param speedAtFullPowerMmPS estimated speed at 100% power, used until the curve is calibrated or loaded.
+ */
+PowerCurve::PowerCurve(int speedAtFullPowerMmPS) {
+    setLinear(speedAtFullPowerMmPS);
+}
+
+void PowerCurve::setLinear(int speedAtFullPowerMmPS) {
+    for (byte i = 0; i < POWER_CURVE_STEPS; i++)
+        speedAtPowerMmPS[i] = (long) speedAtFullPowerMmPS * i / (POWER_CURVE_STEPS - 1);
+    rebuild();
+}
+
+/**
+ * Builds the inverse (speed -> power) table from the forward (power -> speed) table.
+ * This is the only place we search. It's done once after calibration/load, not every update.
+ */
+void PowerCurve::rebuild() {
+    // Measured speeds can wobble down a little at the top. Power never makes us slower, so flatten them.
+    for (byte i = 1; i < POWER_CURVE_STEPS; i++)
+        if (speedAtPowerMmPS[i] < speedAtPowerMmPS[i - 1])
+            speedAtPowerMmPS[i] = speedAtPowerMmPS[i - 1];
+    int topSpeed = getTopSpeedMmPS();
+    inverseStepMmPS = max(1, (topSpeed + POWER_CURVE_INVERSE_STEPS - 1) / POWER_CURVE_INVERSE_STEPS);
+    // Breakaway power: the highest power at which we still don't move. Any non-zero speed needs at least this.
+    byte j = 0;
+    while (j < POWER_CURVE_STEPS - 1 && speedAtPowerMmPS[j + 1] <= speedAtPowerMmPS[0])
+        j++;
+    powerAtSpeed[0] = 100 * j;
+    for (byte k = 1; k <= POWER_CURVE_INVERSE_STEPS; k++) {
+        long target = (long) k * inverseStepMmPS;
+        if (target >= topSpeed) {
+            powerAtSpeed[k] = 1000;
+            continue;
+        }
+        while (j < POWER_CURVE_STEPS - 2 && speedAtPowerMmPS[j + 1] < target)
+            j++;
+        int lo = speedAtPowerMmPS[j];
+        int hi = speedAtPowerMmPS[j + 1];
+        powerAtSpeed[k] = (hi > lo) ? 100 * j + 100L * (target - lo) / (hi - lo) : 100 * (j + 1);
+    }
+}
+
+/**
+ * O(1): one divide to find the inverse table interval, then interpolate within it.
+ * @param speedMmPS desired speed, -ve is backwards (assumed symmetric with forwards).
+ * @return percent power [-100 .. 100]. Zero speed is always zero power.
+ */
+int PowerCurve::powerForSpeed(int speedMmPS) {
+    if (speedMmPS == 0)
+        return 0;
+    int sign = speedMmPS < 0 ? -1 : 1;
+    int s = speedMmPS * sign;
+    int k = s / inverseStepMmPS;
+    if (k >= POWER_CURVE_INVERSE_STEPS)
+        return sign * 100;
+    int frac = s - k * inverseStepMmPS;
+    int tenths = powerAtSpeed[k] + (long) (powerAtSpeed[k + 1] - powerAtSpeed[k]) * frac / inverseStepMmPS;
+    return sign * ((tenths + 5) / 10);
+}
+
+/**
+ * @return true if a valid table was found (and is now in use).
+ */
+byte PowerCurve::load(int address) {
+    PowerCurveEeprom stored;
+    EEPROM.get(address, stored);
+    if (stored.magic != POWER_CURVE_MAGIC || stored.speedAtPowerMmPS[POWER_CURVE_STEPS - 1] <= 0)
+        return false;
+    for (byte i = 0; i < POWER_CURVE_STEPS; i++)
+        speedAtPowerMmPS[i] = stored.speedAtPowerMmPS[i];
+    rebuild();
+    return true;
+}
+
+void PowerCurve::save(int address) {
+    PowerCurveEeprom stored;
+    stored.magic = POWER_CURVE_MAGIC;
+    for (byte i = 0; i < POWER_CURVE_STEPS; i++)
+        stored.speedAtPowerMmPS[i] = speedAtPowerMmPS[i];
+    EEPROM.put(address, stored); // put() uses update(), so rewriting an unchanged table doesn't wear the EEPROM.
+}
+
+void PowerCurve::forget(int address) {
+    uint16_t noMagic = 0;
+    EEPROM.put(address, noMagic);
+}
+
+void PowerCurve::report(const char *prefix) {
+    Serial.print(prefix);
+    for (byte i = 0; i < POWER_CURVE_STEPS; i++) {
+        if (i > 0) Serial.print(" ");
+        Serial.print(speedAtPowerMmPS[i]);
+    }
+    Serial.println();
+}
@@ -0,0 +1,49 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     PowerCurve
+ * PURPOSE
+ *     Maps speed (mm/s) to motor power (percent) for a DifferentialDrive, using a piecewise-linear table.
+ *     Not a King - it is owned by the Helm, which does the calibration sweep and asks for power at runtime.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ * DETAILS
+ *     The forward table holds the achieved speed at 0%, 10%, 20% .. 100% power (measured by the Helm's calibration sweep).
+ *     BLDC hoverboard motors don't move at all below some breakaway power, and flatten out at the top, so a single
+ *     linear constant (speedAtFullPowerMmPS) is wrong at both ends.
+ *     From the forward table we build an inverse table at evenly spaced speeds, so powerForSpeed() is one divide and one
+ *     interpolation - no searching - which matters because the Helm calls it twice every update.
+ *     Until calibrated (or loaded from EEPROM) the curve is the old linear one, so nothing changes for an uncalibrated rover.
+ * EEPROM
+ *     The forward table is saved with a magic number, so a blank (or foreign) EEPROM is ignored.
+ */
+
+#ifndef PowerCurve_h
+#define PowerCurve_h
+
+#include <Arduino.h>
+
+#define POWER_CURVE_STEPS          11         /* Forward table entries: 0%, 10% .. 100% power */
+#define POWER_CURVE_INVERSE_STEPS  16         /* Inverse table intervals, evenly spaced over [0 .. top speed] */
+#define POWER_CURVE_MAGIC          0x5043     /* "PC" - marks a valid table in EEPROM */
+
+class PowerCurve {
+private:
+    int speedAtPowerMmPS[POWER_CURVE_STEPS];                  // Speed at (10 * i)% power. Non-decreasing.
+    int powerAtSpeed[POWER_CURVE_INVERSE_STEPS + 1];          // Power (tenths of a percent) at (i * inverseStepMmPS).
+    int inverseStepMmPS = 1;                                  // Speed between inverse table entries.
+public:
+    PowerCurve(int speedAtFullPowerMmPS);
+    void setLinear(int speedAtFullPowerMmPS);                 // Straight line from 0 to speedAtFullPowerMmPS.
+    void setSpeedAtStep(byte step, int speedMmPS) { speedAtPowerMmPS[step] = speedMmPS; }; // Call rebuild() after setting.
+    int getSpeedAtStep(byte step) { return speedAtPowerMmPS[step]; };
+    int getTopSpeedMmPS() { return speedAtPowerMmPS[POWER_CURVE_STEPS - 1]; };
+    void rebuild();                                           // Rebuild inverse table from forward table.
+    int powerForSpeed(int speedMmPS);                         // Percent power [-100 .. 100] to go at speedMmPS (-ve is backwards).
+    byte load(int address);                                   // From EEPROM. Returns false (and leaves curve alone) if nothing valid there.
+    void save(int address);                                   // To EEPROM.
+    void forget(int address);                                 // Invalidates the EEPROM copy. Doesn't change the curve in use.
+    void report(const char *prefix);                          // Writes "<prefix>s0 s1 .. s10" to Serial.
+};
+
+#endif /* PowerCurve_h */
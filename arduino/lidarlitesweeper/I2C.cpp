@@ -1 +0,0 @@
-../library/I2C.cpp
\ No newline at end of file
@@ -1 +0,0 @@
-../library/I2C.h
\ No newline at end of file
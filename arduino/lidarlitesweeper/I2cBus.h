@@ -0,0 +1 @@
+../library/I2cBus.h
\ No newline at end of file
@@ -78,23 +78,26 @@ void step0();
 
 #define INTERRUPTER_PIN 3 // D3
 //#include "SoftI2CMaster.h"
-// Why do we use I2C.h and not Wire.h?
-// I2C has a I2c.timeout()
-#include "I2C.h"
+// Why do we use I2cBus.h and not Wire.h?
+// I2cBus has timeouts (worked out from the bytes on the wire) and a bounded retry policy - see I2cBus.h.
+#include "I2cBus.h"
 
 #define LIDARLITE_ADDRESS     0x62          // Default I2C Address of LIDAR-Lite.
 #define REGISTER_MEASURE      0x00          // Register to write to initiate ranging.
 #define MEASURE_VALUE         0x04          // Value to initiate ranging.
 #define REGISTER_HIGH_LOW_B   0x8F          // Register to get both High and Low bytes in 1 call.
+#define LIDARLITE_I2C_DEADLINE_US 5000      // Each transaction, queued to done. Default priority - an IMU on the bus goes first.
 
 #define STATE_STOPPED            0
 #define STATE_WORKING            1
 #define DELAY_TIME_US          2000           // Delay between each motor step (u-sec, not m-sec).
 
-// Sets a timeout to ensure no locking up of sketch if I2c communication fails.
-// Making this lower will reduce the amount of time 'in stall' where the Lidar cannot get a value, and waits and waits, but may also
-// increase the number of bad reads.
-#define I2C_TIMEOUT_MS          50
+// How hard we try. Each attempt times out after about twice its time on the wire (~1ms), so the worst a flaky read can
+// cost is bounded: measure ~7ms, range ~44ms (I2cBus::worstCaseUs(), reported by "LD").
+// The LidarLite NACKs while it's ranging (~10ms), so the range read generally fails 8 times and works on the 9th - hence
+// the retries, and the 1ms backoff between them to stop overpolling.
+const I2cRetryPolicy measurePolicy = { 5, 250, 1000 };  // attempts, first backoff (us), max backoff (us)
+const I2cRetryPolicy rangePolicy = { 20, 500, 1000 };
 
 int state = STATE_STOPPED;
 int stepperPosition = 0;       // [0 .. SWEEP_STEPS - 1] the current position of the neck.
@@ -116,6 +119,14 @@ int stepperPosition = 0;       // [0 .. SWEEP_STEPS - 1] the current position of
 #define LD_SYNCHRONIZE         'z'
 #define LD_DEBUG               'd'
 
+BYTE measureValue = MEASURE_VALUE;
+BYTE rangeBytes[2];
+// Every field, in I2cTransaction's order - the ones after the callback are I2cBus's (status, stage, done, next, priority,
+// submittedAtUs), and start at 0.
+I2cTransaction measureTransaction = { LIDARLITE_ADDRESS, REGISTER_MEASURE, 0, &measureValue, 1, 0, 0, 0, 0, 0, 0, 0L };
+I2cTransaction rangeTransaction = { LIDARLITE_ADDRESS, REGISTER_HIGH_LOW_B, I2C_BUS_READ, rangeBytes, 2, 0, 0, 0, 0, 0, 0, 0L };
+I2cResult lastMeasureResult; // How the latest attempts went (status, attempts, us) - for debugging.
+I2cResult lastRangeResult;
 int lidarErrorsInARow = 0; // Number of bad lidar reads in a row. If this gets too high we are boned, and should let the host know.
 
 #define LED_PIN 13            /* The LED which we can flash */
@@ -225,6 +236,10 @@ void processCommand(char c) {
     switch (c) {
     case 'D': // Debug mode. Debuging commands.
         Serial.println("d Debugging mode on");
+        Serial.print("d I2C worst case us measure ");
+        Serial.print(i2cBus.worstCaseUs(&measureTransaction, &measurePolicy));
+        Serial.print(" range ");
+        Serial.println(i2cBus.worstCaseUs(&rangeTransaction, &rangePolicy));
         debug = 1;
         break;
     case 'P': // Production mode, but no debugging.
@@ -243,6 +258,9 @@ void processCommand(char c) {
         debug = 0;
         break;
         */
+    case 'I': // I2C statistics - "Iaddress transactions nacks timeouts recoveries maxLatencyUs maxWaitUs deadlineUs deadlineMisses" per device (see I2cBus.h).
+        i2cBus.report("I");
+        break;
     case 'G': // Go
         //sendByte(LD_STATUS_WORKING);
         sendInfo(LD_STATUS_WORKING);
@@ -696,34 +714,30 @@ void disableStepper() {
  */
 void initializeLidarLite() {
     if (debug) Serial.println("d InitializeLidarLite ..");
-    I2c.begin(); // Opens & joins the I2C bus as master.
+    i2cBus.begin(); // Opens & joins the I2C bus as master.
+    i2cBus.setDevice(LIDARLITE_ADDRESS, 0, LIDARLITE_I2C_DEADLINE_US);
     if (debug) Serial.println("d Delay 10ms ..");
     delay(10); // Waits to make sure everything is powered up before sending or receiving data.
-    if (debug) Serial.println("d set I2c.timeOut 50 ..");
-    I2c.timeOut(I2C_TIMEOUT_MS); // Sets a timeout to ensure no locking up of sketch if I2c communication fails.
     if (debug) Serial.println("d .. initializeLidarLite");
 }
 
 /**
  * Request the range from the Lidar Lite (cm)
- * @return range (cm) -1 is error.
+ * @return 0 on success, otherwise the I2C status of the last attempt (see I2cBus.h STATUS).
  */
 int requestLidarLiteRange() {
-    //Serial.println("d readLidarLite ..");
-    int count = 100;
-    int cc = 0;
-    while (count > 0 && (cc = I2c.write(LIDARLITE_ADDRESS, REGISTER_MEASURE, MEASURE_VALUE)) != 0) {
-        count--;
-        //if (debug) Serial.print("W");
-        delay(1); // Stop overpolling.
-        blinkIfNecessary();
-    }
-    if (count == 0) {
+    lastMeasureResult = i2cBus.run(&measureTransaction, &measurePolicy);
+    if (lastMeasureResult.status != 0) {
         if (debug) {
-            Serial.print("E I2c.write failed: ");
-            Serial.println(cc);
+            Serial.print("E I2C measure failed: ");
+            Serial.print(lastMeasureResult.status);
+            Serial.print(" after ");
+            Serial.print(lastMeasureResult.attempts);
+            Serial.print(" attempts ");
+            Serial.print(lastMeasureResult.elapsedUs);
+            Serial.println("us");
         }
-        return cc; // Error
+        return lastMeasureResult.status; // Error
     }
     return 0; // SUCCESS
 }
@@ -734,18 +748,11 @@ int requestLidarLiteRange() {
  * @return range (cm) -1 is error. 0 is 'no opinion'. + is range in cm.
  */
 int readLidarLiteRange() {
-    int count = 100;
-    // Generally, this I2c.read will fail 8 times, and work on the 9th - it's a limitation of the LidarLite-V1 (100 times per second).
-    // We could set count = 10, and then just drop out in cases where it was going to take longer than that. Maybe for a later experiment.
-    while (count > 0 && I2c.read(LIDARLITE_ADDRESS, REGISTER_HIGH_LOW_B, 2) != 0) {
-        //DEBUG(Serial.print("R"));
-        count--;
-        delay(1); // Stop overpolling.
-        blinkIfNecessary();
-    }
-    if (count > 0) {
+    lastRangeResult = i2cBus.run(&rangeTransaction, &rangePolicy);
+    blinkIfNecessary();
+    if (lastRangeResult.status == 0) {
         lidarErrorsInARow = 0;
-        return (I2c.receive() << 8) | I2c.receive();
+        return (rangeBytes[0] << 8) | rangeBytes[1];
     }
     lidarErrorsInARow++;
     setBlinkPattern(BLINK_PATTERN_ERROR);
@@ -0,0 +1,136 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     ahrsbench.cpp
+ * PURPOSE
+ *     Accuracy half of the filter benchmark (the cycle counts come from the ahrsbenchmark sketch, on the Nano).
+ *     Runs every orientation filter Ahrs can use over an imucapture.py recording, feeding them exactly as Ahrs does, and
+ *     reports how far each strays from Madgwick, and how far each one's yaw moved between the start and the end.
+ * USAGE
+ *     ahrsbench run1.csv [settle_s]
+ *     settle_s (default 5) is skipped before comparing, while the filters pull in from their start-up guesses.
+ *     For the yaw change to mean anything, record a loop closure: start and finish the run pointing the same way. Then the
+ *     yaw change is that filter's heading error over the run.
+ * BUILD
+ *     It uses the library's own filter sources, so the numbers are for the code that runs on the rover. From this directory:
+ *         g++ -O2 -I../library ahrsbench.cpp ../library/MadgwickAHRS.cpp ../library/MahonyAHRS.cpp ../library/ComplementaryAHRS.cpp \
+ *             ../library/MadgwickFixedAHRS.cpp -o ahrsbench
+ * OUTPUT
+ *     One line per filter:
+ *         filter rms(roll pitch yaw) max(roll pitch yaw) yaw_change
+ *     Degrees. rms and max are differences from Madgwick (so Madgwick's own are zero). yaw_change is end minus start.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MadgwickAHRS.h"
+#include "MahonyAHRS.h"
+#include "ComplementaryAHRS.h"
+#include "MadgwickFixedAHRS.h"
+#include "imulog.h"
+
+#define FILTERS 4
+
+static const char *filterNames[FILTERS] = { "Madgwick", "Mahony", "Complementary", "MadgwickFixed" };
+
+// One filter's running comparison against Madgwick.
+struct Score {
+    double sumSquares[3];
+    double maxError[3];
+    float startYaw;
+    float endYaw;
+};
+
+// Wraps an angle difference (degrees) into -180 .. 180.
+static double wrap180(double degrees) {
+    while (degrees > 180.0) degrees -= 360.0;
+    while (degrees < -180.0) degrees += 360.0;
+    return degrees;
+}
+
+template <class FILTER> static void feed(FILTER &filter, const float *g, const float *a, const float *m, int magFresh, float dt) {
+    if (magFresh)
+        filter.update(g[0], g[1], g[2], a[0], a[1], a[2], m[0], m[1], m[2], dt);
+    else
+        filter.updateIMU(g[0], g[1], g[2], a[0], a[1], a[2], dt);
+}
+
+template <class FILTER> static void angles(FILTER &filter, float *rpy) {
+    rpy[0] = filter.getRoll();
+    rpy[1] = filter.getPitch();
+    rpy[2] = filter.getYaw();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s capture.csv [settle_s]\n", argv[0]);
+        return 2;
+    }
+    ImuLog log;
+    char error[200];
+    if (!log.load(argv[1], error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    double settleS = argc > 2 ? atof(argv[2]) : 5.0;
+
+    Madgwick madgwick;
+    Mahony mahony;
+    Complementary complementary;
+    MadgwickFixed madgwickFixed;
+    Score scores[FILTERS];
+    memset(scores, 0, sizeof(scores));
+    long compared = 0;
+    for (size_t j = 0; j < log.samples; j++) {
+        float g[3], a[3], m[3];
+        for (int i = 0; i < 3; i++) {
+            g[i] = log.g[i][j];
+            a[i] = log.a[i][j];
+            m[i] = log.m[i][j];
+        }
+        int magFresh = log.magFresh[j];
+        float dt = log.dt[j];
+        feed(madgwick, g, a, m, magFresh, dt);
+        feed(mahony, g, a, m, magFresh, dt);
+        feed(complementary, g, a, m, magFresh, dt);
+        feed(madgwickFixed, g, a, m, magFresh, dt);
+        if (log.tS[j] < settleS)
+            continue;
+        float rpy[FILTERS][3];
+        angles(madgwick, rpy[0]);
+        angles(mahony, rpy[1]);
+        angles(complementary, rpy[2]);
+        angles(madgwickFixed, rpy[3]);
+        for (int f = 0; f < FILTERS; f++) {
+            if (compared == 0)
+                scores[f].startYaw = rpy[f][2];
+            scores[f].endYaw = rpy[f][2];
+            for (int i = 0; i < 3; i++) {
+                double error = fabs(wrap180(rpy[f][i] - rpy[0][i]));
+                scores[f].sumSquares[i] += error * error;
+                if (error > scores[f].maxError[i])
+                    scores[f].maxError[i] = error;
+            }
+        }
+        compared++;
+    }
+    if (compared == 0) {
+        fprintf(stderr, "%s: %zu samples, none after the %.1fs settle\n", argv[1], log.samples, settleS);
+        return 1;
+    }
+    printf("# %zu samples, %.1fs, compared after %.1fs\n", log.samples, log.tS[log.samples - 1], settleS);
+    printf("# filter rms(roll pitch yaw) max(roll pitch yaw) yaw_change\n");
+    for (int f = 0; f < FILTERS; f++) {
+        Score &s = scores[f];
+        printf("%-14s %6.2f %6.2f %6.2f  %6.2f %6.2f %6.2f  %7.2f\n", filterNames[f],
+               sqrt(s.sumSquares[0] / compared), sqrt(s.sumSquares[1] / compared), sqrt(s.sumSquares[2] / compared),
+               s.maxError[0], s.maxError[1], s.maxError[2], wrap180(s.endYaw - s.startYaw));
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     ahrstune.cpp
+ * PURPOSE
+ *     Tunes the Ahrs's filter on the host, instead of reflashing and driving the rover for each guess.
+ *     Replays one imucapture.py recording through the library's own filter code, once per parameter set - all the sets at
+ *     once, one thread per core - and reports how well each one held yaw.
+ * USAGE
+ *     ahrstune [-j threads] [-s settle_s] [-n best] capture.csv sweep ...
+ *     A sweep is a filter name, then its parameters, each a single value or lo:hi:step - every combination is run.
+ *         madgwick,beta=0.01:0.5:0.01
+ *         madgwickfixed,beta=0.05:0.2:0.05
+ *         mahony,kp=0.1:2:0.1,ki=0:0.1:0.02
+ *         complementary,tilt=0.5:4:0.5,heading=1:20:1
+ *     Parameters left out take the filter's defaults. A filter name alone runs it once, with its defaults.
+ *     -j defaults to the number of cores, -s (skipped while the filters pull in) to 5, -n (lines printed) to all.
+ * BUILD
+ *     From this directory:
+ *         g++ -O3 -march=native -pthread -I../library ahrstune.cpp ../library/MadgwickAHRS.cpp ../library/MahonyAHRS.cpp \
+ *             ../library/ComplementaryAHRS.cpp ../library/MadgwickFixedAHRS.cpp -o ahrstune
+ * OUTPUT
+ *     One line per parameter set, best (lowest yaw_rms) first:
+ *         filter params yaw_rms yaw_max drift jitter
+ *     All degrees, yaw CW of (magnetic) North as the Ahrs reports it, after the settle time.
+ *         yaw_rms, yaw_max - error against the recording's yaw_ref column if it has one (see imulog.h), otherwise against the
+ *                            tilt compensated magnetometer heading (noisy, but it doesn't drift).
+ *         drift            - yaw change from start to end, less the reference's change (with no yaw_ref, none: so record a
+ *                            loop closure - finish pointing the way you started).
+ *         jitter           - RMS of what the corrections added to yaw, per sample, on top of the gyro's turn. The phantom
+ *                            heading changes the Helm steers against - higher gains buy lower error with more of this.
+ * PARALLELISM
+ *     The recording is loaded (and converted to floats, vectorised) once, and shared read-only. Each thread takes the next
+ *     parameter set, runs a fresh filter over the whole recording, and stores the scores. The filters are the library's, run
+ *     one sample at a time exactly as on the rover, so there's no SIMD across parameter sets - that would mean a second,
+ *     vectorised, copy of each filter, and the point is to tune the code that actually runs.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MadgwickAHRS.h"
+#include "MahonyAHRS.h"
+#include "ComplementaryAHRS.h"
+#include "MadgwickFixedAHRS.h"
+#include "imulog.h"
+
+#define MAX_PARAMS 2
+
+enum FilterType { MADGWICK, MADGWICK_FIXED, MAHONY, COMPLEMENTARY };
+
+// The filters, and the parameters each takes (with defaults, as in their sources).
+struct FilterSpec {
+    const char *name;
+    FilterType type;
+    const char *paramNames[MAX_PARAMS];
+    float defaults[MAX_PARAMS];
+};
+
+static const FilterSpec filterSpecs[] = {
+    { "madgwick", MADGWICK, { "beta", NULL }, { 0.1f, 0.0f } },
+    { "madgwickfixed", MADGWICK_FIXED, { "beta", NULL }, { 0.1f, 0.0f } },
+    { "mahony", MAHONY, { "kp", "ki" }, { 0.5f, 0.0f } },
+    { "complementary", COMPLEMENTARY, { "tilt", "heading" }, { COMPLEMENTARY_TILT_TAU_S, COMPLEMENTARY_HEADING_TAU_S } },
+};
+
+// One parameter set, and (once run) how it did.
+struct Run {
+    const FilterSpec *spec;
+    float params[MAX_PARAMS];
+    double yawRms, yawMax, drift, jitter;
+};
+
+// Wraps an angle difference (degrees) into -180 .. 180.
+static double wrap180(double degrees) {
+    while (degrees > 180.0) degrees -= 360.0;
+    while (degrees < -180.0) degrees += 360.0;
+    return degrees;
+}
+
+static void configure(Madgwick &filter, const float *p) { filter.setBeta(p[0]); }
+static void configure(MadgwickFixed &filter, const float *p) { filter.setBeta(p[0]); }
+static void configure(Mahony &filter, const float *p) { filter.setGains(p[0], p[1]); }
+static void configure(Complementary &filter, const float *p) { filter.setTimeConstants(p[0], p[1]); }
+
+/**
+ * Yaw CW of North (degrees) from the magnetometer, levelled with the filter's own roll and pitch.
+ */
+static double magneticYaw(double roll, double pitch, float mx, float my, float mz) {
+    double levelX = mx * cos(pitch) + (my * sin(roll) + mz * cos(roll)) * sin(pitch);
+    double levelY = my * cos(roll) - mz * sin(roll);
+    return -atan2(-levelY, levelX) * 57.29578;
+}
+
+/**
+ * Feeds the whole recording through a fresh FILTER, as Ahrs does, scoring yaw after the settle time.
+ */
+template <class FILTER> static void replay(const ImuLog &log, double settleS, Run &run) {
+    FILTER filter;
+    configure(filter, run.params);
+    bool hasRef = !log.yawRef.empty();
+    double sumSquares = 0.0, maxError = 0.0, jitterSquares = 0.0;
+    double startYaw = 0.0, startRef = 0.0, endYaw = 0.0, endRef = 0.0;
+    double lastYaw = 0.0;
+    long scored = 0, errors = 0;
+    for (size_t j = 0; j < log.samples; j++) {
+        if (log.magFresh[j])
+            filter.update(log.g[0][j], log.g[1][j], log.g[2][j], log.a[0][j], log.a[1][j], log.a[2][j],
+                          log.m[0][j], log.m[1][j], log.m[2][j], log.dt[j]);
+        else
+            filter.updateIMU(log.g[0][j], log.g[1][j], log.g[2][j], log.a[0][j], log.a[1][j], log.a[2][j], log.dt[j]);
+        double yaw = -filter.getYawRadians() * 57.29578;  // CW of North, as the Ahrs reports it.
+        if (log.tS[j] >= settleS) {
+            double roll = filter.getRollRadians(), pitch = filter.getPitchRadians();
+            if (scored > 0) {
+                // What the gyro alone would have turned yaw by (CW) - the rest came from the corrections.
+                double gyroTurn = -(log.g[1][j] * sin(roll) + log.g[2][j] * cos(roll)) / cos(pitch) * log.dt[j];
+                double extra = wrap180(yaw - lastYaw) - gyroTurn;
+                jitterSquares += extra * extra;
+            }
+            double ref = NAN;
+            if (hasRef)
+                ref = log.yawRef[j];
+            else if (log.magFresh[j])
+                ref = magneticYaw(roll, pitch, log.m[0][j], log.m[1][j], log.m[2][j]);
+            if (!isnan(ref)) {
+                double error = fabs(wrap180(yaw - ref));
+                sumSquares += error * error;
+                maxError = std::max(maxError, error);
+                errors++;
+            }
+            if (scored == 0) {
+                startYaw = yaw;
+                startRef = hasRef ? log.yawRef[j] : 0.0;
+            }
+            endYaw = yaw;
+            endRef = hasRef ? log.yawRef[j] : 0.0;
+            scored++;
+        }
+        lastYaw = yaw;
+    }
+    run.yawRms = errors > 0 ? sqrt(sumSquares / errors) : NAN;
+    run.yawMax = errors > 0 ? maxError : NAN;
+    run.drift = wrap180(wrap180(endYaw - startYaw) - wrap180(endRef - startRef));
+    run.jitter = scored > 1 ? sqrt(jitterSquares / (scored - 1)) : NAN;
+}
+
+static void replay(const ImuLog &log, double settleS, Run &run) {
+    switch (run.spec->type) {
+    case MADGWICK: replay<Madgwick>(log, settleS, run); break;
+    case MADGWICK_FIXED: replay<MadgwickFixed>(log, settleS, run); break;
+    case MAHONY: replay<Mahony>(log, settleS, run); break;
+    case COMPLEMENTARY: replay<Complementary>(log, settleS, run); break;
+    }
+}
+
+/**
+ * "lo:hi:step" or "value" -> the values to try.
+ */
+static bool parseRange(const char *text, std::vector<float> &values) {
+    float lo, hi, step;
+    int fields = sscanf(text, "%f:%f:%f", &lo, &hi, &step);
+    if (fields == 1) {
+        values.push_back(lo);
+        return true;
+    }
+    if (fields != 3 || step <= 0.0f || hi < lo)
+        return false;
+    for (int i = 0; lo + i * step <= hi + step * 1e-3f; i++)
+        values.push_back(lo + i * step);
+    return true;
+}
+
+/**
+ * "filter,param=range,param=range" -> one Run per combination, appended to runs.
+ */
+static bool parseSweep(const char *sweep, std::vector<Run> &runs) {
+    std::string text(sweep);
+    size_t comma = text.find(',');
+    std::string name = text.substr(0, comma);
+    const FilterSpec *spec = NULL;
+    for (const FilterSpec &s : filterSpecs)
+        if (name == s.name)
+            spec = &s;
+    if (spec == NULL) {
+        fprintf(stderr, "Unknown filter \"%s\"\n", name.c_str());
+        return false;
+    }
+    std::vector<float> values[MAX_PARAMS];
+    while (comma != std::string::npos) {
+        size_t next = text.find(',', comma + 1);
+        std::string param = text.substr(comma + 1, next == std::string::npos ? std::string::npos : next - comma - 1);
+        comma = next;
+        size_t equals = param.find('=');
+        int p = -1;
+        for (int i = 0; i < MAX_PARAMS; i++)
+            if (spec->paramNames[i] != NULL && param.substr(0, equals) == spec->paramNames[i])
+                p = i;
+        if (p < 0 || equals == std::string::npos || !parseRange(param.c_str() + equals + 1, values[p])) {
+            fprintf(stderr, "Bad parameter \"%s\" for %s\n", param.c_str(), spec->name);
+            return false;
+        }
+    }
+    for (int i = 0; i < MAX_PARAMS; i++)
+        if (values[i].empty())
+            values[i].push_back(spec->defaults[i]);
+    for (float v0 : values[0])
+        for (float v1 : values[1]) {
+            Run run;
+            run.spec = spec;
+            run.params[0] = v0;
+            run.params[1] = v1;
+            runs.push_back(run);
+        }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    double settleS = 5.0;
+    size_t best = 0;
+    int arg = 1;
+    for (; arg < argc - 1 && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-j") == 0)
+            threads = std::max(1, atoi(argv[arg + 1]));
+        else if (strcmp(argv[arg], "-s") == 0)
+            settleS = atof(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-n") == 0)
+            best = atoi(argv[arg + 1]);
+        else
+            break;
+    }
+    if (arg > argc - 2) {
+        fprintf(stderr, "usage: %s [-j threads] [-s settle_s] [-n best] capture.csv sweep ...\n", argv[0]);
+        fprintf(stderr, "  eg: %s run1.csv madgwick,beta=0.01:0.5:0.01 mahony,kp=0.1:2:0.1,ki=0:0.1:0.02\n", argv[0]);
+        return 2;
+    }
+    ImuLog log;
+    char error[200];
+    if (!log.load(argv[arg], error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    std::vector<Run> runs;
+    for (int i = arg + 1; i < argc; i++)
+        if (!parseSweep(argv[i], runs))
+            return 2;
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.push_back(std::thread([&]() {
+            for (size_t r = next++; r < runs.size(); r = next++)
+                replay(log, settleS, runs[r]);
+        }));
+    for (std::thread &worker : workers)
+        worker.join();
+
+    std::stable_sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) {
+        return isnan(b.yawRms) ? !isnan(a.yawRms) : a.yawRms < b.yawRms;
+    });
+    printf("# %zu samples, %.1fs, %zu parameter sets on %d threads, scored after %.1fs, yaw against %s\n", log.samples,
+           log.tS[log.samples - 1], runs.size(), threads, settleS, log.yawRef.empty() ? "magnetometer" : "yaw_ref");
+    printf("# filter params yaw_rms yaw_max drift jitter\n");
+    for (size_t r = 0; r < runs.size() && (best == 0 || r < best); r++) {
+        const Run &run = runs[r];
+        std::string params;
+        for (int i = 0; i < MAX_PARAMS; i++)
+            if (run.spec->paramNames[i] != NULL) {
+                char buffer[40];
+                snprintf(buffer, sizeof(buffer), "%s%s=%g", params.empty() ? "" : ",", run.spec->paramNames[i], run.params[i]);
+                params += buffer;
+            }
+        printf("%-14s %-22s %7.2f %7.2f %7.2f %7.4f\n", run.spec->name, params.c_str(), run.yawRms, run.yawMax, run.drift, run.jitter);
+    }
+    return 0;
+}
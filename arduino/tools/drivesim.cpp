@@ -0,0 +1,324 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     drivesim.cpp
+ * PURPOSE
+ *     Test of HoverboardDrive's SYNCHRONOUS UPDATE, on the host: runs the kangarouter's drive (same pins) against a model of
+ *     the Nano's Timer0 and Timer2 PWM outputs, and checks, period by period, what the motor drivers would see.
+ *     Then its ODOMETRY: turns the wheels' Hall sensors, and checks getDistanceMm().
+ * USAGE
+ *     drivesim [-v]
+ *     -v prints every PWM period of every case: the pulse (timer counts, 0 .. 256) and direction pin of each channel.
+ *     Exits 0 if every check passes, 1 if not.
+ * BUILD
+ *     From this directory:
+ *         g++ -O2 -DARDUINO=185 -Ihost -I../library drivesim.cpp host/Arduino.cpp ../library/HoverboardDrive.cpp -o drivesim
+ * CHECKS
+ *     For each case (a change of powers, issued at some point in a PWM period):
+ *         together  - both channels' new pulses start in the same period.
+ *         reversal  - a direction pin only changes while its channel's output is low (no pulse under way, and none
+ *                     starting at the period's start - fast PWM's one count pulse at OCR == 0 counts).
+ *         settled   - the pulses and directions end up as the powers say.
+ *     And that Timer2 was switched to fast PWM (Timer0's mode), so the two have the same boundaries.
+ *     For each odometry case (the wheels turned some Hall steps each, while the PWM carries on):
+ *         distance  - getDistanceMm() moved as far as the wheels did, forwards positive (the right motor is reversed).
+ * MODEL
+ *     Both timers count 0 .. 255 at 16MHz / 64 (4us a count), from the same boundary. At a boundary the OCRs' buffered
+ *     values take effect and each connected output goes high, until the count passes its OCR (so OCR + 1 counts; 255 is
+ *     all of it). The overflow interrupt (if enabled) runs then, or when interrupts come back on. Disconnecting an output
+ *     (its COM bit) drops it to its port bit - low - at once; connecting it part way through a period starts its pulse
+ *     late.
+ *     Each Hall sensor is an input pin, set as the wheel turns. A change raises its pin change interrupt, if it's enabled.
+ * OUTPUT
+ *     "PASS case" or "FAIL case: what", per check.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "HoverboardDrive.h"
+
+#define PWM_SIM_COUNT_US       4      /* 16MHz / 64 */
+#define PWM_SIM_PERIOD_US   1024      /* 256 counts */
+#define PWM_SIM_PERIODS       12      /* Recorded after each change - plenty for ZERO, APPLY, CONNECT */
+#define PWM_SIM_CHANNELS       2
+#define HALL_SIM_STEP_US    5000      /* Between Hall steps - 200 steps/s, about 1.1m/s */
+
+extern "C" void TIMER2_OVF_vect(void); // HoverboardDrive.cpp's ISR()s.
+extern "C" void PCINT0_vect(void);
+extern "C" void PCINT1_vect(void);
+extern "C" void PCINT2_vect(void);
+
+// As the kangarouter.
+HoverboardDrive drive(false, true, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12);
+
+/**
+ * One speed pin's PWM output, and its direction pin.
+ */
+struct PwmChannel {
+    volatile uint8_t *tccr;
+    uint8_t com;
+    volatile uint8_t *ocr;
+    uint8_t directionMask;            // On port D.
+    uint8_t active = 0;               // The OCR in effect this period.
+    byte connectedAtBoundary = false;
+    uint16_t pulse = 0;               // Counts high this period.
+    byte connected() { return (*tccr & com) != 0; };
+    byte direction() { return (PORTD.value & directionMask) != 0; };
+};
+
+static PwmChannel channels[PWM_SIM_CHANNELS] = {
+    { &TCCR2A, _BV(COM2B1), &OCR2B, _BV(4) }, // Left: pin 3, direction pin 4.
+    { &TCCR0A, _BV(COM0B1), &OCR0B, _BV(6) }, // Right: pin 5, direction pin 6.
+};
+
+struct PwmPeriod {
+    uint16_t pulse[PWM_SIM_CHANNELS];
+    byte direction[PWM_SIM_CHANNELS];
+};
+
+static byte verbose = false;
+static uint64_t boundaryUs = 0;       // Start of this period.
+static uint32_t reversedWhileDriven = 0;
+static PwmPeriod periods[PWM_SIM_PERIODS];
+static uint8_t periodCount = 0;
+static uint32_t failures = 0;
+
+/**
+ * Whether the channel's output is high now.
+ */
+static byte high(PwmChannel *channel) {
+    uint32_t counts = (uint32_t) (hostNowUs - boundaryUs) / PWM_SIM_COUNT_US;
+    return channel->connected() && channel->connectedAtBoundary && counts <= channel->active;
+}
+
+/**
+ * The overflow interrupt, watched: a direction pin which changes while its output is high drives the motor the wrong way.
+ * Outputs the ISR connects or disconnects cut or start this period's pulse.
+ */
+static void overflow() {
+    byte before[PWM_SIM_CHANNELS], wasHigh[PWM_SIM_CHANNELS], wasConnected[PWM_SIM_CHANNELS];
+    for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+        before[i] = channels[i].direction();
+        wasHigh[i] = high(&channels[i]);
+        wasConnected[i] = channels[i].connected();
+    }
+    TIFR2 &= ~_BV(TOV2);
+    TIMER2_OVF_vect();
+    uint16_t counts = (uint16_t) ((hostNowUs - boundaryUs) / PWM_SIM_COUNT_US);
+    for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+        PwmChannel *channel = &channels[i];
+        if (channel->direction() != before[i] && wasHigh[i])
+            reversedWhileDriven++;
+        if (wasConnected[i] && !channel->connected())
+            channel->pulse = min(channel->pulse, (uint16_t) (counts + 1)); // Cut short.
+        else if (!wasConnected[i] && channel->connected())
+            channel->pulse = channel->active + 1 > counts ? channel->active + 1 - counts : 0; // Late start.
+    }
+}
+
+/**
+ * Timers 0 and 2, together. See MODEL.
+ */
+class PwmSim : public HostPeripheral {
+public:
+    uint64_t nextUs = PWM_SIM_PERIOD_US;
+    PwmSim() { hostAttach(this); };
+    ~PwmSim() { hostDetach(this); };
+    virtual uint64_t dueUs() { return nextUs; };
+    virtual void fire() {
+        if (periodCount < PWM_SIM_PERIODS) // The period just finished.
+            for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+                periods[periodCount].pulse[i] = channels[i].pulse;
+                periods[periodCount].direction[i] = channels[i].direction();
+            }
+        periodCount++;
+        boundaryUs = nextUs;
+        nextUs += PWM_SIM_PERIOD_US;
+        for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+            PwmChannel *channel = &channels[i];
+            channel->active = *channel->ocr;
+            channel->connectedAtBoundary = channel->connected();
+            channel->pulse = channel->connectedAtBoundary ? channel->active + 1 : 0;
+        }
+        TIFR2 |= _BV(TOV2);
+        if (TIMSK2 & _BV(TOIE2))
+            hostInterrupt(overflow);
+    }
+};
+
+/**
+ * A motor's Hall sensors. See MODEL.
+ */
+struct HallSensors {
+    uint8_t pins[3];                  // A, B, C.
+    uint8_t position = 0;             // In the sequence.
+};
+
+static const uint8_t hallSequence[6] = { 1, 3, 2, 6, 4, 5 }; // C B A. See HoverboardDrive.h ODOMETRY.
+
+// As the kangarouter: left on 7, 8, 9, right on 10, 11, 12.
+static HallSensors halls[PWM_SIM_CHANNELS] = { { { 7, 8, 9 } }, { { 10, 11, 12 } } };
+
+/**
+ * Sets a motor's Hall pins to a state, raising the pin change interrupt for each one which changes (if enabled).
+ */
+static void setHalls(HallSensors *motor, uint8_t state) {
+    static void (* const vectors[3])(void) = { PCINT0_vect, PCINT1_vect, PCINT2_vect };
+    for (byte i = 0; i < 3; i++) {
+        uint8_t pin = motor->pins[i];
+        uint8_t value = (state >> i) & 1;
+        if (digitalRead(pin) == value)
+            continue;
+        hostSetPin(pin, value);
+        if ((PCICR & _BV(digitalPinToPCICRbit(pin))) && (*digitalPinToPCMSK(pin) & _BV(digitalPinToPCMSKbit(pin))))
+            hostInterrupt(vectors[digitalPinToPCICRbit(pin)]);
+    }
+}
+
+/**
+ * Turns the motors the given Hall steps (+ up the sequence), a step (of each) every HALL_SIM_STEP_US.
+ */
+static void turnWheels(int leftSteps, int rightSteps) {
+    int steps[PWM_SIM_CHANNELS] = { leftSteps, rightSteps };
+    while (steps[0] != 0 || steps[1] != 0) {
+        delayMicroseconds(HALL_SIM_STEP_US);
+        for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+            if (steps[i] == 0)
+                continue;
+            int8_t step = steps[i] > 0 ? 1 : -1;
+            halls[i].position = (halls[i].position + 6 + step) % 6;
+            setHalls(&halls[i], hallSequence[halls[i].position]);
+            steps[i] -= step;
+        }
+    }
+}
+
+static void quiet(uint8_t c) {
+    // The drive's own chatter.
+}
+
+static void check(const char *name, byte passed, const char *what) {
+    if (passed) {
+        printf("PASS %s\n", name);
+    } else {
+        printf("FAIL %s: %s\n", name, what);
+        failures++;
+    }
+}
+
+/**
+ * Sets the powers offsetUs into a period, records the periods that follow, and checks them. See CHECKS.
+ */
+static void runCase(const char *name, int leftPower, int rightPower, uint16_t offsetUs) {
+    while (hostNowUs - boundaryUs != offsetUs)
+        delayMicroseconds((offsetUs - (hostNowUs - boundaryUs) + PWM_SIM_PERIOD_US) % PWM_SIM_PERIOD_US);
+    byte oldDirection[PWM_SIM_CHANNELS];
+    uint16_t oldPulse[PWM_SIM_CHANNELS];
+    for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+        oldDirection[i] = channels[i].direction();
+        oldPulse[i] = channels[i].connectedAtBoundary ? channels[i].active + 1 : 0;
+    }
+    reversedWhileDriven = 0;
+    periodCount = 0;
+    drive.setMotorPowers(leftPower, rightPower);
+    delay(PWM_SIM_PERIODS + 2);
+
+    // What the pins should end up as (HoverboardDrive.setMotorPowers(), with the right motor reversed).
+    int powers[PWM_SIM_CHANNELS] = { leftPower, rightPower };
+    byte reversed[PWM_SIM_CHANNELS] = { false, true };
+    byte newDirection[PWM_SIM_CHANNELS];
+    uint16_t newPulse[PWM_SIM_CHANNELS];
+    int8_t changedAt[PWM_SIM_CHANNELS];
+    byte settled = true;
+    for (byte i = 0; i < PWM_SIM_CHANNELS; i++) {
+        byte duty = 255 * abs(powers[i]) / 100;
+        newDirection[i] = reversed[i] ? powers[i] < 0 : powers[i] >= 0;
+        newPulse[i] = duty == 0 ? 0 : duty + 1;
+        changedAt[i] = -1;
+        for (int8_t p = 0; p < PWM_SIM_PERIODS && changedAt[i] < 0; p++)
+            if (periods[p].pulse[i] == newPulse[i] && periods[p].direction[i] == newDirection[i])
+                changedAt[i] = p;
+        const PwmPeriod *last = &periods[PWM_SIM_PERIODS - 1];
+        if (last->pulse[i] != newPulse[i] || last->direction[i] != newDirection[i])
+            settled = false;
+    }
+    if (verbose) {
+        printf("%s: was %u%c %u%c\n", name, oldPulse[0], oldDirection[0] ? '+' : '-', oldPulse[1], oldDirection[1] ? '+' : '-');
+        for (byte p = 0; p < PWM_SIM_PERIODS; p++)
+            printf("    %2u %3u%c %3u%c\n", p, periods[p].pulse[0], periods[p].direction[0] ? '+' : '-',
+                   periods[p].pulse[1], periods[p].direction[1] ? '+' : '-');
+    }
+    char label[64];
+    // A channel which doesn't change can't be late - only compare the ones which do.
+    byte leftChanges = newPulse[0] != oldPulse[0] || newDirection[0] != oldDirection[0];
+    byte rightChanges = newPulse[1] != oldPulse[1] || newDirection[1] != oldDirection[1];
+    snprintf(label, sizeof(label), "%s together", name);
+    check(label, !(leftChanges && rightChanges) || changedAt[0] == changedAt[1], "the channels changed in different periods");
+    snprintf(label, sizeof(label), "%s reversal", name);
+    check(label, reversedWhileDriven == 0, "a direction pin changed while its output was high");
+    snprintf(label, sizeof(label), "%s settled", name);
+    check(label, settled, "the pins don't match the powers");
+}
+
+/**
+ * Turns the wheels, and checks getDistanceMm() moved by expectedMm (to the mm).
+ */
+static void odometryCase(const char *name, int leftSteps, int rightSteps, int32_t expectedMm) {
+    int32_t before = drive.getDistanceMm();
+    turnWheels(leftSteps, rightSteps);
+    int32_t moved = drive.getDistanceMm() - before;
+    if (verbose)
+        printf("%s: %d %d steps, %d mm\n", name, leftSteps, rightSteps, moved);
+    char label[64];
+    snprintf(label, sizeof(label), "%s distance", name);
+    check(label, abs(moved - expectedMm) <= 1, "getDistanceMm() is out");
+}
+
+int main(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "v")) != -1) {
+        switch (option) {
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: drivesim [-v]\n");
+            return 2;
+        }
+    }
+    PwmSim pwm;
+    hostSerialOut = quiet;
+    for (byte i = 0; i < PWM_SIM_CHANNELS; i++)
+        setHalls(&halls[i], hallSequence[0]);
+    drive.setup();
+    check("fast PWM", (TCCR2A & (_BV(WGM21) | _BV(WGM20))) == (_BV(WGM21) | _BV(WGM20)), "Timer2 isn't in fast PWM");
+
+    runCase("start", 40, 40, 100);
+    runCase("turn", 80, 20, 500);
+    runCase("straighten", 60, 60, 1000);
+    runCase("reverse", -60, -60, 3);
+    runCase("spin", 60, -60, 700);
+    runCase("spin back", -60, 60, 0);
+    runCase("full", 100, 100, 300);
+    runCase("one side", 100, 0, 900);
+    runCase("stop", 0, 0, 200);
+
+    check("odometry", drive.hasOdometry(), "no pin change interrupts on the Hall pins");
+    odometryCase("forwards", HOVERBOARD_STEPS_PER_REV, -HOVERBOARD_STEPS_PER_REV, HOVERBOARD_MM_PER_REV);
+    odometryCase("backwards", -HOVERBOARD_STEPS_PER_REV / 2, HOVERBOARD_STEPS_PER_REV / 2, -HOVERBOARD_MM_PER_REV / 2);
+    odometryCase("spin", HOVERBOARD_STEPS_PER_REV, HOVERBOARD_STEPS_PER_REV, 0);
+    odometryCase("left only", 2 * HOVERBOARD_STEPS_PER_REV, 0, HOVERBOARD_MM_PER_REV);
+    // A glitch to 000 and back, and a missed state (2 steps at once), on the left.
+    int32_t before = drive.getDistanceMm();
+    setHalls(&halls[0], 0);
+    setHalls(&halls[0], hallSequence[halls[0].position]);
+    halls[0].position = (halls[0].position + 2) % 6;
+    setHalls(&halls[0], hallSequence[halls[0].position]);
+    check("glitch distance", abs(drive.getDistanceMm() - before - 2 * HOVERBOARD_MM_PER_REV / (2 * HOVERBOARD_STEPS_PER_REV)) <= 1,
+          "a glitch or a missed state was miscounted");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     Arduino.cpp (host)
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "SPI.h"
+
+#define HOST_PENDING_INTERRUPTS 8
+
+HostRegister TWCR, TWSR, TWBR, TWDR, TWAR, SREG;
+HostRegister PORTB, DDRB, PINB, PORTC, DDRC, PINC, PORTD, DDRD, PIND;
+// As init() leaves them: Timer0 fast PWM, Timer2 phase correct, both /64.
+volatile uint8_t TCCR0A = _BV(WGM01) | _BV(WGM00), TCCR0B = _BV(CS01) | _BV(CS00), TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR2A = _BV(WGM20), TCCR2B = _BV(CS22), TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, GTCCR;
+volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+SPIClass SPI;
+
+uint64_t hostNowUs = 0;
+void (*hostPinHook)(uint8_t pin, uint8_t value) = 0;
+
+static void stdoutSerialOut(uint8_t c) {
+    putchar(c);
+}
+void (*hostSerialOut)(uint8_t c) = stdoutSerialOut;
+
+static HostPeripheral *peripherals = 0;
+static byte advancing = false;        // hostAdvance() is firing peripherals. See hostAdvance().
+static byte inInterrupt = false;
+static void (*pending[HOST_PENDING_INTERRUPTS])(void);
+static uint8_t pendingCount = 0;
+static void (*externalIsr[HOST_EXTERNAL_INTERRUPTS])(void);
+static uint8_t pins[HOST_PINS];
+
+/**
+ * Interrupts come on when SREG's I bit does - sei(), or SREG = oldSREG after a cli().
+ */
+static void deliverPending() {
+    while (pendingCount > 0 && (SREG.value & _BV(SREG_I)) && !inInterrupt) {
+        void (*isr)(void) = pending[0];
+        pendingCount--;
+        memmove(pending, pending + 1, pendingCount * sizeof(pending[0]));
+        hostInterrupt(isr);
+    }
+}
+
+static void sregWritten(HostRegister *reg, uint8_t old) {
+    if (!(old & _BV(SREG_I)) && (reg->value & _BV(SREG_I)))
+        deliverPending();
+}
+
+// Interrupts are on when a sketch starts, as on the Nano (init() turns them on before setup()).
+static struct HostStart {
+    HostStart() {
+        SREG.value = _BV(SREG_I);
+        SREG.onWrite = sregWritten;
+    }
+} hostStart;
+
+void hostAttach(HostPeripheral *peripheral) {
+    peripheral->nextPeripheral = peripherals;
+    peripherals = peripheral;
+}
+
+void hostDetach(HostPeripheral *peripheral) {
+    for (HostPeripheral **p = &peripherals; *p != 0; p = &(*p)->nextPeripheral)
+        if (*p == peripheral) {
+            *p = peripheral->nextPeripheral;
+            return;
+        }
+}
+
+/**
+ * Fires everything due between now and now + us, earliest first. Peripherals (and the ISRs they raise) can look at the
+ * clock too - then time just moves on (we're already firing), and anything due by then fires late, in this same loop.
+ */
+void hostAdvance(uint32_t us) {
+    uint64_t target = hostNowUs + us;
+    if (advancing) {
+        hostNowUs = target;
+        return;
+    }
+    advancing = true;
+    for (;;) {
+        HostPeripheral *first = 0;
+        uint64_t firstDueUs = UINT64_MAX;
+        for (HostPeripheral *p = peripherals; p != 0; p = p->nextPeripheral) {
+            uint64_t dueUs = p->dueUs();
+            if (dueUs < firstDueUs) {
+                first = p;
+                firstDueUs = dueUs;
+            }
+        }
+        if (first == 0 || firstDueUs > (target > hostNowUs ? target : hostNowUs))
+            break;
+        if (firstDueUs > hostNowUs)
+            hostNowUs = firstDueUs;
+        first->fire();
+    }
+    if (target > hostNowUs)
+        hostNowUs = target;
+    advancing = false;
+}
+
+void hostInterrupt(void (*isr)(void)) {
+    if (isr == 0)
+        return;
+    if (!(SREG.value & _BV(SREG_I)) || inInterrupt) {
+        for (uint8_t i = 0; i < pendingCount; i++)
+            if (pending[i] == isr)
+                return; // One flag per vector - raising it again changes nothing.
+        if (pendingCount < HOST_PENDING_INTERRUPTS)
+            pending[pendingCount++] = isr;
+        return;
+    }
+    inInterrupt = true;
+    SREG.value &= ~_BV(SREG_I);
+    isr();
+    SREG.value |= _BV(SREG_I);
+    inInterrupt = false;
+    deliverPending();
+}
+
+void hostExternalInterrupt(uint8_t interrupt) {
+    if (interrupt < HOST_EXTERNAL_INTERRUPTS)
+        hostInterrupt(externalIsr[interrupt]);
+}
+
+void hostSetPin(uint8_t pin, uint8_t value) {
+    if (pin >= HOST_PINS)
+        return;
+    pins[pin] = value;
+    volatile uint8_t *input = portInputRegister(digitalPinToPort(pin));
+    *input = value ? *input | digitalPinToBitMask(pin) : *input & ~digitalPinToBitMask(pin);
+}
+
+void hostSerialFeed(const char *text) {
+    Serial.feed(text);
+}
+
+unsigned long micros() {
+    hostAdvance(HOST_MICROS_COST_US);
+    return (unsigned long) (uint32_t) hostNowUs; // Wraps every ~72 minutes, as on the Nano.
+}
+
+unsigned long millis() {
+    hostAdvance(HOST_MICROS_COST_US);
+    return (unsigned long) (uint32_t) (hostNowUs / 1000);
+}
+
+void delay(unsigned long ms) {
+    while (ms-- > 0)
+        hostAdvance(1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    hostAdvance(us);
+}
+
+uint8_t digitalPinToPort(uint8_t pin) {
+    return pin < 8 ? PD : (pin < 14 ? PB : (pin < HOST_PINS ? PC : NOT_A_PORT));
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin) {
+    return _BV(pin < 8 ? pin : (pin < 14 ? pin - 8 : pin - 14));
+}
+
+uint8_t digitalPinToTimer(uint8_t pin) {
+    switch (pin) {
+    case 3: return TIMER2B;
+    case 5: return TIMER0B;
+    case 6: return TIMER0A;
+    case 9: return TIMER1A;
+    case 10: return TIMER1B;
+    case 11: return TIMER2A;
+    }
+    return NOT_ON_TIMER;
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port) {
+    switch (port) {
+    case PB: return &PORTB.value;
+    case PC: return &PORTC.value;
+    case PD: return &PORTD.value;
+    }
+    return 0;
+}
+
+volatile uint8_t *portInputRegister(uint8_t port) {
+    switch (port) {
+    case PB: return &PINB.value;
+    case PC: return &PINC.value;
+    case PD: return &PIND.value;
+    }
+    return 0;
+}
+
+/**
+ * The timer control register and COM bit (non-inverting) which connect a pin to its PWM output, if it has one.
+ */
+static volatile uint8_t *pwmControl(uint8_t pin, uint8_t *com) {
+    switch (digitalPinToTimer(pin)) {
+    case TIMER0A: *com = _BV(COM0A1); return &TCCR0A;
+    case TIMER0B: *com = _BV(COM0B1); return &TCCR0A;
+    case TIMER2A: *com = _BV(COM2A1); return &TCCR2A;
+    case TIMER2B: *com = _BV(COM2B1); return &TCCR2A;
+    }
+    return 0;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin < HOST_PINS && mode == INPUT_PULLUP)
+        pins[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    uint8_t com;
+    volatile uint8_t *tccr = pwmControl(pin, &com);
+    if (tccr != 0)
+        *tccr &= ~com; // As the core's turnOffPWM().
+    volatile uint8_t *port = portOutputRegister(digitalPinToPort(pin));
+    if (port != 0)
+        *port = value ? *port | digitalPinToBitMask(pin) : *port & ~digitalPinToBitMask(pin);
+    if (pin < HOST_PINS)
+        pins[pin] = value;
+    if (hostPinHook != 0)
+        hostPinHook(pin, value);
+}
+
+int digitalRead(uint8_t pin) {
+    return pin < HOST_PINS ? pins[pin] : LOW;
+}
+
+int analogRead(uint8_t pin) {
+    return 0;
+}
+
+void analogWrite(uint8_t pin, int value) {
+    uint8_t com;
+    volatile uint8_t *tccr = pwmControl(pin, &com);
+    if (tccr == 0 || value <= 0 || value >= 255) {
+        digitalWrite(pin, value > 127 ? HIGH : LOW);
+        return;
+    }
+    switch (digitalPinToTimer(pin)) {
+    case TIMER0A: OCR0A = value; break;
+    case TIMER0B: OCR0B = value; break;
+    case TIMER2A: OCR2A = value; break;
+    case TIMER2B: OCR2B = value; break;
+    }
+    *tccr |= com;
+}
+
+void cli() {
+    SREG = SREG.value & ~_BV(SREG_I);
+}
+
+void sei() {
+    SREG = SREG.value | _BV(SREG_I);
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+    if (interrupt < HOST_EXTERNAL_INTERRUPTS)
+        externalIsr[interrupt] = isr;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+    if (interrupt < HOST_EXTERNAL_INTERRUPTS)
+        externalIsr[interrupt] = 0;
+}
+
+char *dtostrf(double value, signed char width, unsigned char precision, char *buffer) {
+    sprintf(buffer, "%*.*f", width, precision, value);
+    return buffer;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size-- > 0)
+        n += write(*buffer++);
+    return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+    char digits[8 * sizeof(long) + 1];
+    char *p = &digits[sizeof(digits) - 1];
+    *p = '\0';
+    if (base < 2)
+        base = 10;
+    do {
+        uint8_t digit = n % base;
+        n /= base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    } while (n > 0);
+    return write(p);
+}
+
+size_t Print::print(long n, int base) {
+    if (base == DEC && n < 0)
+        return print('-') + printNumber(-(unsigned long) n, DEC);
+    return printNumber(base == DEC ? (unsigned long) n : (unsigned long) (uint32_t) n, base); // 32 bits, as the AVR.
+}
+
+size_t Print::print(unsigned long n, int base) {
+    return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) {
+    char buffer[32];
+    if (isnan(n))
+        return write("nan");
+    if (isinf(n))
+        return write("inf");
+    snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+    return write(buffer);
+}
+
+void HardwareSerial::feed(const char *text) {
+    while (*text != '\0' && (uint16_t) (tail + 1) % HOST_SERIAL_INPUT != head) {
+        input[tail] = *text++;
+        tail = (tail + 1) % HOST_SERIAL_INPUT;
+    }
+}
+
+int HardwareSerial::available() {
+    return (tail + HOST_SERIAL_INPUT - head) % HOST_SERIAL_INPUT;
+}
+
+int HardwareSerial::read() {
+    if (head == tail)
+        return -1;
+    uint8_t c = input[head];
+    head = (head + 1) % HOST_SERIAL_INPUT;
+    return c;
+}
+
+int HardwareSerial::peek() {
+    return head == tail ? -1 : input[head];
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    hostSerialOut(c);
+    return 1;
+}
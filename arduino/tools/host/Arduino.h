@@ -0,0 +1,254 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     Arduino.h (host)
+ * PURPOSE
+ *     Just enough of the Arduino core (and of the Nano's ATmega328) for the library and sketches to build and run on Linux,
+ *     in simulated time, against simulated devices - see i2csim.h. Not used on the Nano.
+ * DETAILS
+ *     Time is simulated: it only moves when the code waits - delay(), delayMicroseconds() - or looks at the clock: each
+ *     micros() or millis() call costs HOST_MICROS_COST_US, a stand-in for the CPU time between looks (so busy-wait loops
+ *     finish). While time moves, the HostPeripherals due in that time fire, in order - a TWI byte finishing, a sensor
+ *     sample landing - and may raise interrupts.
+ *     Interrupts behave as on the AVR: a raised interrupt runs at once if SREG's I bit is set (and we're not in an ISR
+ *     already), otherwise when it next is. ISR(TWI_vect) defines TWI_vect() - i2csim calls it.
+ *     The registers the library touches (TWI, SREG, the ports) are HostRegisters: a byte, with optional hooks that see
+ *     every write, and can work out every read, so a simulated peripheral can sit behind them.
+ *     Timers 0 and 2 (the PWM pins 3, 5, 6, 11) are plain bytes instead, since the library keeps pointers to them (as to
+ *     the ports - portOutputRegister()). They start as the core's init() leaves them; a simulation (see drivesim.cpp)
+ *     looks at them on each PWM period boundary. digitalWrite() and analogWrite() connect and disconnect the PWM outputs
+ *     as the core does.
+ *     The pin change interrupt registers (PCICR, PCMSKn) are plain bytes too. hostSetPin() keeps the PINx registers up to
+ *     date (for portInputRegister()), but raises no interrupt - a simulation raises PCINTn_vect itself, if they say so.
+ *     Serial writes go to hostSerialOut (stdout, unless a tool captures them); reads come from hostSerialFeed().
+ *     Everything is deterministic - run the same thing twice, get the same bytes out.
+ * BUILD
+ *     Put this directory (tools/host) first on the include path, and add Arduino.cpp to the build. -DARDUINO=185, since some
+ *     headers look at ARDUINO before they include this one. See sweepersim.cpp, imusim.cpp, drivesim.cpp.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef ARDUINO
+#define ARDUINO 185
+#endif
+#define F_CPU 16000000L
+#define __AVR_ATmega328P__ 1          /* The Nano - so the library picks port C for the TWI pins */
+
+#define HOST_MICROS_COST_US 4          /* Simulated time each micros()/millis() call takes (the AVR's micros() resolution) */
+#define HOST_PINS 20                   /* D0 .. D13, A0 .. A5 */
+#define HOST_EXTERNAL_INTERRUPTS 2     /* INT0 (D2), INT1 (D3) */
+#define HOST_SERIAL_INPUT 256          /* Bytes of Serial input we can queue */
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define LED_BUILTIN 13
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+// As the AVR core - macros, so mixed types work as they do on the Nano. (Include any C++ library headers before this.)
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define radians(deg) ((deg)*DEG_TO_RAD)
+#define degrees(rad) ((rad)*RAD_TO_DEG)
+#define sq(x) ((x)*(x))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+
+#define _BV(bit) (1 << (bit))
+#define PROGMEM
+#define F(string) (string)
+#define ISR(vector) extern "C" void vector(void); extern "C" void vector(void)
+
+/**
+ * A memory-mapped register. See DETAILS.
+ */
+class HostRegister {
+public:
+    typedef void (*WriteHook)(HostRegister *reg, uint8_t old);
+    typedef uint8_t (*ReadHook)(const HostRegister *reg);
+    uint8_t value = 0;
+    WriteHook onWrite = 0;
+    ReadHook onRead = 0;
+    operator uint8_t() const { return onRead != 0 ? onRead(this) : value; };
+    HostRegister &operator=(uint8_t v) {
+        uint8_t old = value;
+        value = v;
+        if (onWrite != 0)
+            onWrite(this, old);
+        return *this;
+    };
+    HostRegister &operator|=(uint8_t v) { return *this = (uint8_t) (*this | v); };
+    HostRegister &operator&=(uint8_t v) { return *this = (uint8_t) (*this & v); };
+};
+
+extern HostRegister TWCR, TWSR, TWBR, TWDR, TWAR, SREG;
+extern HostRegister PORTB, DDRB, PINB, PORTC, DDRC, PINC, PORTD, DDRD, PIND;
+
+// TWCR, TWSR bits.
+enum { TWINT = 7, TWEA = 6, TWSTA = 5, TWSTO = 4, TWWC = 3, TWEN = 2, TWIE = 0, TWPS1 = 1, TWPS0 = 0 };
+#define SREG_I 7
+
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+extern volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, GTCCR;
+
+// Timer 0 and 2 bits (the same places in both).
+enum { COM0A1 = 7, COM0A0 = 6, COM0B1 = 5, COM0B0 = 4, WGM01 = 1, WGM00 = 0, WGM02 = 3, CS02 = 2, CS01 = 1, CS00 = 0 };
+enum { COM2A1 = 7, COM2A0 = 6, COM2B1 = 5, COM2B0 = 4, WGM21 = 1, WGM20 = 0, WGM22 = 3, CS22 = 2, CS21 = 1, CS20 = 0 };
+enum { OCIE2B = 2, OCIE2A = 1, TOIE2 = 0, OCF2B = 2, OCF2A = 1, TOV2 = 0 };
+enum { TSM = 7, PSRASY = 1, PSRSYNC = 0 };
+
+extern volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+enum { PCIE2 = 2, PCIE1 = 1, PCIE0 = 0, PCIF2 = 2, PCIF1 = 1, PCIF0 = 0 };
+
+// The Nano's pins, as the core's pins_arduino.h.
+#define NOT_A_PORT 0
+#define PB 2
+#define PC 3
+#define PD 4
+#define NOT_ON_TIMER 0
+#define TIMER0A 1
+#define TIMER0B 2
+#define TIMER1A 3
+#define TIMER1B 4
+#define TIMER2A 7
+#define TIMER2B 8
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+uint8_t digitalPinToTimer(uint8_t pin);
+volatile uint8_t *portOutputRegister(uint8_t port);
+volatile uint8_t *portInputRegister(uint8_t port);
+#define digitalPinToPCICR(p) (((p) >= 0 && (p) < HOST_PINS) ? (&PCICR) : ((volatile uint8_t *) 0))
+#define digitalPinToPCICRbit(p) (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+#define digitalPinToPCMSK(p) (((p) <= 7) ? (&PCMSK2) : (((p) <= 13) ? (&PCMSK0) : (((p) < HOST_PINS) ? (&PCMSK1) : ((volatile uint8_t *) 0))))
+#define digitalPinToPCMSKbit(p) (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+/**
+ * Simulated hardware which does something at a time of its own - see DETAILS.
+ */
+class HostPeripheral {
+public:
+    HostPeripheral *nextPeripheral = 0;
+    virtual ~HostPeripheral() {};
+    virtual uint64_t dueUs() = 0;      // When fire() should next be called. UINT64_MAX => not waiting for anything.
+    virtual void fire() = 0;
+};
+
+extern uint64_t hostNowUs;            // Simulated time since start (64 bits - micros() wraps, this doesn't).
+void hostAttach(HostPeripheral *peripheral);
+void hostDetach(HostPeripheral *peripheral);
+void hostAdvance(uint32_t us);        // Let time pass, firing what's due.
+void hostInterrupt(void (*isr)(void)); // Raise an interrupt. See DETAILS.
+void hostExternalInterrupt(uint8_t interrupt); // .. the one attachInterrupt() gave this INTn.
+void hostSetPin(uint8_t pin, uint8_t value); // Drive an input (as the outside world). Its PINx bit follows.
+extern void (*hostPinHook)(uint8_t pin, uint8_t value); // Called on every digitalWrite(). May be 0.
+extern void (*hostSerialOut)(uint8_t c); // Where Serial's bytes go. Default stdout.
+void hostSerialFeed(const char *text); // Queue bytes for Serial.read().
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void cli();
+void sei();
+#define noInterrupts() cli()
+#define interrupts() sei()
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+char *dtostrf(double value, signed char width, unsigned char precision, char *buffer);
+
+class Print {
+private:
+    size_t printNumber(unsigned long n, uint8_t base);
+public:
+    virtual ~Print() {};
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *s) { return s == 0 ? 0 : write((const uint8_t *) s, strlen(s)); };
+    size_t print(const char *s) { return write(s); };
+    size_t print(char c) { return write((uint8_t) c); };
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); };
+    size_t print(int n, int base = DEC) { return print((long) n, base); };
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); };
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+    size_t println() { return write('\n'); };
+    template <class T> size_t println(T value) { size_t n = print(value); return n + println(); };
+    template <class T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); };
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {};
+};
+
+class HardwareSerial : public Stream {
+private:
+    uint8_t input[HOST_SERIAL_INPUT];
+    uint16_t head = 0, tail = 0;
+public:
+    void begin(unsigned long baud) {};
+    void begin(unsigned long baud, uint8_t config) {};
+    void end() {};
+    operator bool() { return true; };
+    void feed(const char *text);
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+    virtual void flush() { fflush(stdout); };
+    virtual size_t write(uint8_t c);
+    int availableForWrite() { return 63; };
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif /* Arduino_h */
@@ -0,0 +1,33 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     EEPROM.h (host)
+ * PURPOSE
+ *     The Nano's 1kB of EEPROM, in memory - starts erased (0xFF), forgets everything when the program ends. See Arduino.h.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+#define HOST_EEPROM_BYTES 1024
+
+class EEPROMClass {
+private:
+    uint8_t bytes[HOST_EEPROM_BYTES];
+public:
+    EEPROMClass() { memset(bytes, 0xFF, sizeof(bytes)); };
+    uint8_t read(int address) { return bytes[address]; };
+    void write(int address, uint8_t value) { bytes[address] = value; };
+    void update(int address, uint8_t value) { bytes[address] = value; };
+    uint16_t length() { return HOST_EEPROM_BYTES; };
+    template <class T> T &get(int address, T &t) { memcpy(&t, bytes + address, sizeof(T)); return t; };
+    template <class T> const T &put(int address, const T &t) { memcpy(bytes + address, &t, sizeof(T)); return t; };
+};
+
+extern EEPROMClass EEPROM;
+
+#endif /* EEPROM_h */
@@ -0,0 +1,3 @@
+//-*- mode: c -*-
+// Print (host) - it's in Arduino.h, as Stream and Serial are. See Arduino.h.
+#include "Arduino.h"
@@ -0,0 +1,44 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     SPI.h (host)
+ * PURPOSE
+ *     SPI, so drivers which can do either (Adafruit_LSM9DS0) build. Nothing is on the host's SPI bus - transfer() reads 0.
+ *     See Arduino.h.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#ifndef SPI_h
+#define SPI_h
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPISettings {
+public:
+    SPISettings() {};
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) {};
+};
+
+class SPIClass {
+public:
+    void begin() {};
+    void end() {};
+    void beginTransaction(SPISettings settings) {};
+    void endTransaction() {};
+    uint8_t transfer(uint8_t data) { return 0; };
+    void setClockDivider(uint8_t divider) {};
+    void setDataMode(uint8_t mode) {};
+    void setBitOrder(uint8_t order) {};
+};
+
+extern SPIClass SPI;
+
+#endif /* SPI_h */
@@ -0,0 +1,3 @@
+//-*- mode: c -*-
+// Pre-1.0 Arduino's name for Arduino.h (host). See Arduino.h.
+#include "Arduino.h"
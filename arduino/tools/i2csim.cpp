@@ -0,0 +1,532 @@
+//-*- mode: c -*-
+/**
+ * FILE
+ *     i2csim.cpp
+ * AUTHOR
+ *     Scott BARNES
+ * COPYRIGHT
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include "Arduino.h"
+
+#include "i2csim.h"
+
+// TWI status codes (TWSR & 0xF8), master modes - as I2cBus.cpp.
+#define I2C_SIM_START           0x08
+#define I2C_SIM_REPEATED_START  0x10
+#define I2C_SIM_MT_SLA_ACK      0x18
+#define I2C_SIM_MT_SLA_NACK     0x20
+#define I2C_SIM_MT_DATA_ACK     0x28
+#define I2C_SIM_MT_DATA_NACK    0x30
+#define I2C_SIM_ARBITRATION_LOST 0x38
+#define I2C_SIM_MR_SLA_ACK      0x40
+#define I2C_SIM_MR_SLA_NACK     0x48
+#define I2C_SIM_MR_DATA_ACK     0x50
+#define I2C_SIM_MR_DATA_NACK    0x58
+
+#define I2C_SIM_SDA             _BV(4)  /* Port C, as the Nano */
+#define I2C_SIM_SCL             _BV(5)
+
+#define I2C_SIM_AUTO_INCREMENT  0x80    /* Top bit of the register address, for LidarLite and LSM9DS0 alike */
+
+// LSM9DS0 registers the simulation acts on (the rest just hold what's written).
+#define LSM9DS0_SIM_WHO_AM_I    0x0F
+#define LSM9DS0_SIM_CTRL_REG1_G 0x20
+#define LSM9DS0_SIM_CTRL_REG3_G 0x22
+#define LSM9DS0_SIM_CTRL_REG4_G 0x23
+#define LSM9DS0_SIM_CTRL_REG5_G 0x24
+#define LSM9DS0_SIM_OUT_TEMP_G  0x26
+#define LSM9DS0_SIM_OUT_X_L     0x28    /* Gyro and accelerometer both */
+#define LSM9DS0_SIM_OUT_Z_H     0x2D
+#define LSM9DS0_SIM_FIFO_CTRL_G 0x2E
+#define LSM9DS0_SIM_FIFO_SRC_G  0x2F
+#define LSM9DS0_SIM_OUT_TEMP_L_XM 0x05
+#define LSM9DS0_SIM_OUT_X_L_M   0x08
+#define LSM9DS0_SIM_OUT_Z_H_M   0x0D
+#define LSM9DS0_SIM_CTRL_REG1_XM 0x20
+#define LSM9DS0_SIM_CTRL_REG2_XM 0x21
+#define LSM9DS0_SIM_CTRL_REG5_XM 0x24
+#define LSM9DS0_SIM_CTRL_REG6_XM 0x25
+#define LSM9DS0_SIM_CTRL_REG7_XM 0x26
+#define LSM9DS0_SIM_TEMPERATURE 200     /* OUT_TEMP_XM: 25C at 8 LSB/C */
+
+extern "C" void TWI_vect(void);        // I2cBus.cpp's ISR().
+
+I2cSim *I2cSim::instance = 0;
+
+uint16_t I2cSimDevice::nextRandom() {
+    seed = seed * 1103515245L + 12345;
+    return (seed >> 16) & 0x7FFF;
+}
+
+/**
+ * Doesn't use up a random number when percent is 0 - so turning one fault on doesn't change when the others happen.
+ */
+byte I2cSimDevice::chance(uint8_t percent) {
+    return percent != 0 && nextRandom() % 100 < percent;
+}
+
+/***************************************************************************
+ THE TWI
+ ***************************************************************************/
+
+I2cSim::I2cSim() {
+    instance = this;
+    TWCR.onWrite = twcrWritten;
+    DDRC.onWrite = ddrcWritten;
+    PINC.onRead = pincRead;
+    hostAttach(this);
+}
+
+I2cSim::~I2cSim() {
+    hostDetach(this);
+    TWCR.onWrite = 0;
+    DDRC.onWrite = 0;
+    PINC.onRead = 0;
+    instance = 0;
+}
+
+void I2cSim::add(I2cSimDevice *device) {
+    if (deviceCount < I2C_SIM_DEVICES)
+        devices[deviceCount++] = device;
+}
+
+I2cSimDevice *I2cSim::find(uint8_t address) {
+    for (uint8_t i = 0; i < deviceCount; i++)
+        if (devices[i]->address == address)
+            return devices[i];
+    return 0;
+}
+
+void I2cSim::twcrWritten(HostRegister *reg, uint8_t old) {
+    instance->command(reg->value, old);
+}
+
+/**
+ * A pin let go of (output low -> input) is pulled up. For SCL, that's a clock.
+ */
+void I2cSim::ddrcWritten(HostRegister *reg, uint8_t old) {
+    if ((old & I2C_SIM_SCL) && !(reg->value & I2C_SIM_SCL)) {
+        instance->recoveryClocks++;
+        if (instance->holding != 0 && --instance->heldClocks == 0)
+            instance->holding = 0; // Finished its byte - lets go of SDA.
+    }
+}
+
+/**
+ * The pull-ups hold both lines high, unless we drive one low (output, 0), or a device holds SDA.
+ */
+uint8_t I2cSim::pincRead(const HostRegister *reg) {
+    uint8_t pins = reg->value | I2C_SIM_SDA | I2C_SIM_SCL;
+    if (((DDRC.value & ~PORTC.value) & I2C_SIM_SDA) || instance->holding != 0)
+        pins &= ~I2C_SIM_SDA;
+    if ((DDRC.value & ~PORTC.value) & I2C_SIM_SCL)
+        pins &= ~I2C_SIM_SCL;
+    return pins;
+}
+
+/**
+ * TWCR has been written. See the ATmega328 datasheet, TWI: writing TWINT 1 clears it and starts the next step (STOP,
+ * START, or the byte in TWDR); writing it 0 changes nothing.
+ */
+void I2cSim::command(uint8_t twcr, uint8_t old) {
+    if (!(twcr & _BV(TWEN))) { // Off. Whatever we were doing is abandoned, part way through.
+        if (step != NONE || mode != IDLE)
+            resets++;
+        if (step != NONE && stepDueUs == I2C_SIM_NEVER && selected != 0) {
+            holding = selected; // Hung mid-byte - it'll hold SDA until it's clocked through the rest.
+            heldClocks = I2C_SIM_HELD_CLOCKS;
+        }
+        step = NONE;
+        stepDueUs = I2C_SIM_NEVER;
+        mode = IDLE;
+        busOwned = false;
+        selected = 0;
+        return;
+    }
+    if (!(twcr & _BV(TWINT))) {
+        TWCR.value = (twcr & ~_BV(TWINT)) | (old & _BV(TWINT));
+        return;
+    }
+    TWCR.value = twcr & ~_BV(TWINT);
+    if (twcr & _BV(TWSTO)) {
+        if (selected != 0)
+            selected->stopped();
+        selected = 0;
+        busOwned = false;
+        mode = IDLE;
+        TWCR.value &= ~_BV(TWSTO); // Out at once - see DETAILS.
+    }
+    if (twcr & _BV(TWSTA))
+        begin(START, 0, 0);
+    else if (mode == ADDRESSING)
+        begin(ADDRESS, 1, find(TWDR.value >> 1));
+    else if (mode == TRANSMITTING)
+        begin(WRITE, 1, selected);
+    else if (mode == RECEIVING) {
+        acknowledging = (twcr & _BV(TWEA)) != 0;
+        begin(READ, 1, selected);
+    }
+}
+
+/**
+ * Works out when the step will be done - or that it never will (a hang, or SDA held so a START can't go out).
+ */
+void I2cSim::begin(uint8_t newStep, uint32_t bytes, I2cSimDevice *device) {
+    step = newStep;
+    glitching = false;
+    uint32_t prescale = 1L << (2 * (TWSR.value & 0x03));
+    sclHz = F_CPU / (16 + 2L * TWBR.value * prescale);
+    uint64_t ns = (bytes == 0 ? 1 : 9 * bytes) * 1000000000ULL / sclHz;
+    if (newStep == START && holding != 0) {
+        stepDueUs = I2C_SIM_NEVER;
+        return;
+    }
+    if (device != 0) {
+        ns += device->stretchUs * 1000ULL;
+        if (newStep == WRITE || newStep == READ) {
+            if (device->hangNext > 0 || device->chance(device->hangPercent)) {
+                if (device->hangNext > 0)
+                    device->hangNext--;
+                device->hung++;
+                stepDueUs = I2C_SIM_NEVER;
+                return;
+            }
+            if (device->glitchNext > 0 || device->chance(device->glitchPercent)) {
+                if (device->glitchNext > 0)
+                    device->glitchNext--;
+                device->glitched++;
+                glitching = true;
+            }
+        }
+    }
+    stepDueUs = hostNowUs + (ns + 999) / 1000;
+}
+
+/**
+ * The step is done: the device has its say, and the master gets TWINT (and the interrupt) - last, since the ISR starts
+ * the next step from inside finish().
+ */
+void I2cSim::fire() {
+    uint8_t done = step;
+    step = NONE;
+    stepDueUs = I2C_SIM_NEVER;
+    if (glitching && (done == WRITE || done == READ)) {
+        busOwned = false; // Lost the bus to "someone else" - back to not addressed.
+        mode = IDLE;
+        selected = 0;
+        finish(I2C_SIM_ARBITRATION_LOST);
+        return;
+    }
+    switch (done) {
+    case START: {
+        byte repeated = busOwned;
+        busOwned = true;
+        selected = 0;
+        mode = ADDRESSING;
+        finish(repeated ? I2C_SIM_REPEATED_START : I2C_SIM_START);
+        break;
+    }
+    case ADDRESS: {
+        byte reading = TWDR.value & 0x01;
+        I2cSimDevice *device = find(TWDR.value >> 1);
+        byte ack = false;
+        if (device != 0) {
+            if (device->nackNext > 0)
+                device->nackNext--;
+            else if (!device->chance(device->nackPercent))
+                ack = device->start(reading);
+            if (ack)
+                device->addressed++;
+            else
+                device->nacked++;
+        }
+        selected = ack ? device : 0;
+        mode = ack ? (reading ? RECEIVING : TRANSMITTING) : REJECTED;
+        if (reading)
+            finish(ack ? I2C_SIM_MR_SLA_ACK : I2C_SIM_MR_SLA_NACK);
+        else
+            finish(ack ? I2C_SIM_MT_SLA_ACK : I2C_SIM_MT_SLA_NACK);
+        break;
+    }
+    case WRITE:
+        finish(selected->received(TWDR.value) ? I2C_SIM_MT_DATA_ACK : I2C_SIM_MT_DATA_NACK);
+        break;
+    case READ:
+        TWDR.value = selected->sent();
+        finish(acknowledging ? I2C_SIM_MR_DATA_ACK : I2C_SIM_MR_DATA_NACK);
+        break;
+    }
+}
+
+void I2cSim::finish(uint8_t status) {
+    TWSR.value = status | (TWSR.value & 0x03);
+    TWCR.value |= _BV(TWINT);
+    if (TWCR.value & _BV(TWIE))
+        hostInterrupt(TWI_vect);
+}
+
+/***************************************************************************
+ LIDARLITE V1
+ ***************************************************************************/
+
+LidarLiteSim::LidarLiteSim(uint8_t address, uint32_t seed) : I2cSimDevice(address, seed) {
+    memset(registers, 0, sizeof(registers));
+}
+
+/**
+ * The range registers are only filled in when an acquisition finishes.
+ */
+void LidarLiteSim::acquired() {
+    if (busyUntilUs != 0 && !busy()) {
+        registers[0x0F] = acquiredCm >> 8;
+        registers[0x10] = acquiredCm & 0xFF;
+        busyUntilUs = 0;
+    }
+}
+
+byte LidarLiteSim::start(byte reading) {
+    acquired();
+    if (busy())
+        return false; // Acquiring - the v1 doesn't answer.
+    if (!reading)
+        pointerSet = false; // The first byte written is the register.
+    return true;
+}
+
+byte LidarLiteSim::received(uint8_t data) {
+    if (!pointerSet) {
+        pointer = data;
+        pointerSet = true;
+        return true;
+    }
+    uint8_t reg = pointer & ~I2C_SIM_AUTO_INCREMENT;
+    registers[reg] = data;
+    if (reg == 0x00 && data == 0x04) { // REGISTER_MEASURE, MEASURE_VALUE.
+        acquiredCm = range != 0 ? range(hostNowUs) : rangeCm;
+        busyUntilUs = hostNowUs + acquisitionUs;
+        acquisitions++;
+    }
+    if (pointer & I2C_SIM_AUTO_INCREMENT)
+        pointer = ((pointer + 1) & 0x7F) | I2C_SIM_AUTO_INCREMENT;
+    return true;
+}
+
+uint8_t LidarLiteSim::sent() {
+    uint8_t value = registers[pointer & ~I2C_SIM_AUTO_INCREMENT];
+    if (pointer & I2C_SIM_AUTO_INCREMENT)
+        pointer = ((pointer + 1) & 0x7F) | I2C_SIM_AUTO_INCREMENT;
+    return value;
+}
+
+/***************************************************************************
+ LSM9DS0 GYRO
+ ***************************************************************************/
+
+Lsm9ds0GyroSim::Lsm9ds0GyroSim(Lsm9ds0Motion *motion, uint8_t drdyInterrupt, uint32_t seed)
+    : I2cSimDevice(LSM9DS0_SIM_GYRO, seed), motion(motion), drdyInterrupt(drdyInterrupt) {
+    memset(registers, 0, sizeof(registers));
+    registers[LSM9DS0_SIM_WHO_AM_I] = 0xD4;
+    registers[LSM9DS0_SIM_CTRL_REG1_G] = 0x07; // Powered down, XYZ enabled.
+    registers[LSM9DS0_SIM_OUT_TEMP_G] = 25;
+    hostAttach(this);
+}
+
+Lsm9ds0GyroSim::~Lsm9ds0GyroSim() {
+    hostDetach(this);
+}
+
+/**
+ * CTRL_REG1_G: DR (bits 7:6) picks 95, 190, 380 or 760Hz; PD (bit 3) is power.
+ */
+uint16_t Lsm9ds0GyroSim::dataRateHz() {
+    static const uint16_t rates[4] = { 95, 190, 380, 760 };
+    uint8_t reg1 = registers[LSM9DS0_SIM_CTRL_REG1_G];
+    return (reg1 & 0x08) ? rates[reg1 >> 6] : 0;
+}
+
+/**
+ * A register has been written - start or stop sampling, empty the FIFO when it's bypassed.
+ */
+void Lsm9ds0GyroSim::written(uint8_t reg) {
+    if (reg == LSM9DS0_SIM_CTRL_REG1_G) {
+        uint16_t hz = dataRateHz();
+        if (hz == 0)
+            nextSampleNs = I2C_SIM_NEVER;
+        else if (nextSampleNs == I2C_SIM_NEVER)
+            nextSampleNs = hostNowUs * 1000 + 1000000000ULL / hz;
+    } else if (reg == LSM9DS0_SIM_FIFO_CTRL_G || reg == LSM9DS0_SIM_CTRL_REG5_G) {
+        if (!(registers[LSM9DS0_SIM_CTRL_REG5_G] & 0x40) || (registers[LSM9DS0_SIM_FIFO_CTRL_G] >> 5) == 0) {
+            fifoCount = 0;
+            overrun = false;
+        }
+    }
+}
+
+void Lsm9ds0GyroSim::fire() {
+    sample();
+    uint16_t hz = dataRateHz();
+    nextSampleNs = hz == 0 ? I2C_SIM_NEVER : nextSampleNs + 1000000000ULL / hz;
+}
+
+/**
+ * A new sample lands: in the output registers, or the FIFO (FIFO mode stops when it's full; stream mode drops the
+ * oldest). Then DRDY_G, if it's on.
+ */
+void Lsm9ds0GyroSim::sample() {
+    static const float mdpsPerCount[4] = { 8.75f, 17.5f, 70.0f, 70.0f };
+    float scale = mdpsPerCount[(registers[LSM9DS0_SIM_CTRL_REG4_G] >> 4) & 0x03];
+    for (byte axis = 0; axis < 3; axis++) {
+        float dps = motion->gyroBiasDps[axis] + (axis == 2 ? motion->yawRateDps : 0.0f);
+        if (motion->gyroNoiseDps != 0.0f)
+            dps += motion->gyroNoiseDps * (nextRandom() / 16383.5f - 1.0f);
+        float counts = dps * 1000.0f / scale;
+        latest[axis] = (int16_t) constrain(lroundf(counts), -32768L, 32767L);
+    }
+    samples++;
+    uint8_t mode = registers[LSM9DS0_SIM_FIFO_CTRL_G] >> 5;
+    if ((registers[LSM9DS0_SIM_CTRL_REG5_G] & 0x40) && mode != 0) {
+        if (fifoCount == LSM9DS0_SIM_FIFO) {
+            overrun = true;
+            overruns++;
+            if (mode == 1)
+                return; // FIFO mode: full is full.
+            fifoHead = (fifoHead + 1) % LSM9DS0_SIM_FIFO;
+            fifoCount--;
+        }
+        memcpy(fifo[(fifoHead + fifoCount) % LSM9DS0_SIM_FIFO], latest, sizeof(latest));
+        fifoCount++;
+    }
+    if ((registers[LSM9DS0_SIM_CTRL_REG3_G] & 0x08) && drdyInterrupt != LSM9DS0_SIM_NO_INTERRUPT)
+        hostExternalInterrupt(drdyInterrupt);
+}
+
+/**
+ * With the FIFO on, the output registers are its oldest sample (or the newest, once it's empty).
+ */
+const int16_t *Lsm9ds0GyroSim::output() {
+    byte fifoOn = (registers[LSM9DS0_SIM_CTRL_REG5_G] & 0x40) && (registers[LSM9DS0_SIM_FIFO_CTRL_G] >> 5) != 0;
+    return fifoOn && fifoCount > 0 ? fifo[fifoHead] : latest;
+}
+
+byte Lsm9ds0GyroSim::start(byte reading) {
+    if (!reading)
+        pointerSet = false;
+    return true;
+}
+
+byte Lsm9ds0GyroSim::received(uint8_t data) {
+    if (!pointerSet) {
+        pointer = data;
+        pointerSet = true;
+        return true;
+    }
+    uint8_t reg = pointer & 0x3F;
+    if (reg != LSM9DS0_SIM_WHO_AM_I && reg != LSM9DS0_SIM_FIFO_SRC_G && (reg < LSM9DS0_SIM_OUT_TEMP_G || reg > LSM9DS0_SIM_OUT_Z_H)) {
+        registers[reg] = data;
+        written(reg);
+    }
+    if (pointer & I2C_SIM_AUTO_INCREMENT)
+        pointer = ((reg + 1) & 0x3F) | I2C_SIM_AUTO_INCREMENT;
+    return true;
+}
+
+/**
+ * Reading OUT_Z_H_G takes the sample out of the FIFO, and (auto-incrementing) wraps back to OUT_X_L_G - so one burst
+ * reads several samples, as Lsm9ds0Imu::readBatch() does.
+ */
+uint8_t Lsm9ds0GyroSim::sent() {
+    uint8_t reg = pointer & 0x3F;
+    uint8_t value;
+    byte fifoOn = (registers[LSM9DS0_SIM_CTRL_REG5_G] & 0x40) && (registers[LSM9DS0_SIM_FIFO_CTRL_G] >> 5) != 0;
+    if (reg >= LSM9DS0_SIM_OUT_X_L && reg <= LSM9DS0_SIM_OUT_Z_H) {
+        int16_t axis = output()[(reg - LSM9DS0_SIM_OUT_X_L) / 2];
+        value = (reg & 0x01) ? (uint16_t) axis >> 8 : axis & 0xFF;
+    } else if (reg == LSM9DS0_SIM_FIFO_SRC_G) {
+        value = (overrun ? 0x40 : 0) | (fifoCount == 0 ? 0x20 : 0) | min(fifoCount, (uint8_t) 0x1F);
+    } else {
+        value = registers[reg];
+    }
+    if (reg == LSM9DS0_SIM_OUT_Z_H && fifoOn && fifoCount > 0) {
+        memcpy(latest, fifo[fifoHead], sizeof(latest));
+        fifoHead = (fifoHead + 1) % LSM9DS0_SIM_FIFO;
+        fifoCount--;
+        overrun = false;
+    }
+    if (pointer & I2C_SIM_AUTO_INCREMENT)
+        pointer = (reg == LSM9DS0_SIM_OUT_Z_H && fifoOn ? LSM9DS0_SIM_OUT_X_L : (reg + 1) & 0x3F) | I2C_SIM_AUTO_INCREMENT;
+    return value;
+}
+
+/***************************************************************************
+ LSM9DS0 ACCELEROMETER/MAGNETOMETER
+ ***************************************************************************/
+
+Lsm9ds0XmSim::Lsm9ds0XmSim(Lsm9ds0Motion *motion, uint32_t seed) : I2cSimDevice(LSM9DS0_SIM_XM, seed), motion(motion) {
+    memset(registers, 0, sizeof(registers));
+    registers[LSM9DS0_SIM_WHO_AM_I] = 0x49;
+    registers[LSM9DS0_SIM_CTRL_REG1_XM] = 0x07;
+    registers[LSM9DS0_SIM_CTRL_REG5_XM] = 0x18;
+    registers[LSM9DS0_SIM_CTRL_REG6_XM] = 0x20; // +-4 gauss.
+    registers[LSM9DS0_SIM_CTRL_REG7_XM] = 0x02;
+}
+
+/**
+ * The axis (or temperature) whose low byte is at reg, in counts at the scales set in CTRL_REG2_XM (AFS) and CTRL_REG6_XM
+ * (MFS). Level, so the accelerometer reads +1g on Z; the field turns the opposite way to the sensor.
+ */
+int16_t Lsm9ds0XmSim::reading(uint8_t reg) {
+    static const float mgPerCount[8] = { 0.061f, 0.122f, 0.183f, 0.244f, 0.732f, 0.732f, 0.732f, 0.732f };
+    static const float mgaussPerCount[4] = { 0.08f, 0.16f, 0.32f, 0.48f };
+    if (reg == LSM9DS0_SIM_OUT_TEMP_L_XM)
+        return LSM9DS0_SIM_TEMPERATURE;
+    float value;
+    float noise = nextRandom() / 16383.5f - 1.0f;
+    if (reg >= LSM9DS0_SIM_OUT_X_L) {
+        float mg = (reg == LSM9DS0_SIM_OUT_X_L + 4 ? 1000.0f : 0.0f) + motion->accelNoiseMg * noise;
+        value = mg / mgPerCount[(registers[LSM9DS0_SIM_CTRL_REG2_XM] >> 3) & 0x07];
+    } else {
+        float yaw = motion->yawDegrees(hostNowUs) * (float) DEG_TO_RAD;
+        float gauss[3] = { motion->horizontalGauss * cosf(yaw), -motion->horizontalGauss * sinf(yaw), -motion->downGauss };
+        float mgauss = gauss[(reg - LSM9DS0_SIM_OUT_X_L_M) / 2] * 1000.0f + motion->magNoiseMgauss * noise;
+        value = mgauss / mgaussPerCount[(registers[LSM9DS0_SIM_CTRL_REG6_XM] >> 5) & 0x03];
+    }
+    return (int16_t) constrain(lroundf(value), -32768L, 32767L);
+}
+
+byte Lsm9ds0XmSim::start(byte reading) {
+    if (!reading)
+        pointerSet = false;
+    return true;
+}
+
+byte Lsm9ds0XmSim::received(uint8_t data) {
+    if (!pointerSet) {
+        pointer = data;
+        pointerSet = true;
+        return true;
+    }
+    uint8_t reg = pointer & 0x3F;
+    if (reg != LSM9DS0_SIM_WHO_AM_I)
+        registers[reg] = data;
+    if (pointer & I2C_SIM_AUTO_INCREMENT)
+        pointer = ((reg + 1) & 0x3F) | I2C_SIM_AUTO_INCREMENT;
+    return true;
+}
+
+uint8_t Lsm9ds0XmSim::sent() {
+    uint8_t reg = pointer & 0x3F;
+    uint8_t value;
+    if ((reg >= LSM9DS0_SIM_OUT_TEMP_L_XM && reg <= LSM9DS0_SIM_OUT_TEMP_L_XM + 1)
+        || (reg >= LSM9DS0_SIM_OUT_X_L_M && reg <= LSM9DS0_SIM_OUT_Z_H_M)
+        || (reg >= LSM9DS0_SIM_OUT_X_L && reg <= LSM9DS0_SIM_OUT_Z_H)) {
+        int16_t axis = reading(reg & ~0x01);
+        value = (reg & 0x01) ? (uint16_t) axis >> 8 : axis & 0xFF;
+    } else {
+        value = registers[reg];
+    }
+    if (pointer & I2C_SIM_AUTO_INCREMENT)
+        pointer = ((reg + 1) & 0x3F) | I2C_SIM_AUTO_INCREMENT;
+    return value;
+}
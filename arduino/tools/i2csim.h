@@ -0,0 +1,207 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     i2csim.h
+ * PURPOSE
+ *     Simulated I2C devices, and the Nano's TWI to talk to them, for running the library's I2C code (I2cBus, I2C, I2cWire,
+ *     and the drivers on top) on the host - see host/Arduino.h. So the lidar and IMU code paths can be benchmarked, and
+ *     their error paths driven, without the hardware, and the same way every time.
+ * DETAILS
+ *     I2cSim is the ATmega328's TWI, behind the host's TWCR/TWSR/TWDR/TWBR: a write to TWCR with TWINT set starts the step
+ *     (START, a byte out, a byte in) and, when the simulated clock gets there - 9 SCL clocks a byte, at the rate TWBR gives -
+ *     the step is done with the device, TWSR gets the status the datasheet says, TWINT is set and, if TWIE is, TWI_vect
+ *     runs. STOP is instant. Writing TWCR without TWEN resets it, as on the chip.
+ *     The TWI pins (port C 4 and 5) are simulated too, for I2cBus's bus recovery: a device can hold SDA low, and lets go
+ *     after enough SCL clocks toggled by hand.
+ *     A device (I2cSimDevice) sees what a slave sees: addressed (read or write), a byte received, a byte wanted, STOP. The
+ *     register-level models are below. The Nano has one TWI, so there is one I2cSim.
+ * FAULTS
+ *     Every device can be told to misbehave - now (the next n times), or at random (n%, from the device's own seed, so a run
+ *     is repeatable):
+ *         nack      - NACK its address, as if it weren't there (or were busy).
+ *         hang      - hold SCL low part way through a byte, for ever: the TWI never finishes the step, so the master's
+ *                     timeout has to catch it. When the master gives up (resets the TWI) the device is left holding SDA
+ *                     low, until it's clocked through the rest of its byte - ie until bus recovery.
+ *         glitch    - the byte ends in lost arbitration (as noise on the wires does).
+ *     and stretchUs adds latency to every byte (clock stretching).
+ * DEVICES
+ *     LidarLiteSim   - LidarLite v1. Writing MEASURE_VALUE (4) to REGISTER_MEASURE (0) starts an acquisition, which
+ *                      takes acquisitionUs; meanwhile it NACKs its address. Then REGISTER_HIGH_LOW_B (0x8F - 0x0F with the
+ *                      auto-increment bit) reads the range, high byte first. The range comes from rangeCm, or range(now).
+ *     Lsm9ds0GyroSim - LSM9DS0 gyro (0x6B): WHO_AM_I, CTRL_REG1_G .. 5_G (power, data rate, scale, FIFO_EN), the output
+ *                      registers, the 32 sample FIFO (bypass, FIFO and stream modes, FIFO_SRC_REG_G) and DRDY_G (as an
+ *                      external interrupt). Samples land at the data rate set in CTRL_REG1_G.
+ *     Lsm9ds0XmSim   - LSM9DS0 accelerometer/magnetometer (0x1D): WHO_AM_I_XM, CTRL_REG0_XM .. 7_XM (scales), temperature,
+ *                      and the accelerometer and magnetometer output registers.
+ *     Both LSM9DS0 halves auto-increment the register address when its top bit is set (as the Adafruit driver asks), and
+ *     read an Lsm9ds0Motion - a level sensor turning about Z at a steady rate, in the Earth's field.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#ifndef i2csim_h
+#define i2csim_h
+
+#include "Arduino.h"
+
+#define I2C_SIM_NEVER            UINT64_MAX
+#define I2C_SIM_DEVICES          8
+#define I2C_SIM_HELD_CLOCKS      8      /* SCL clocks a hung device needs to finish its byte and let go of SDA */
+
+#define LIDARLITE_SIM_ADDRESS    0x62
+#define LIDARLITE_SIM_ACQUISITION_US 10000 /* ~100 readings a second, as the v1 datasheet says */
+
+#define LSM9DS0_SIM_GYRO         0x6B
+#define LSM9DS0_SIM_XM           0x1D
+#define LSM9DS0_SIM_FIFO         32     /* Gyro samples */
+#define LSM9DS0_SIM_NO_INTERRUPT 0xFF   /* Lsm9ds0GyroSim.drdyInterrupt: DRDY_G not wired */
+
+/**
+ * One slave on the bus. See DETAILS and FAULTS.
+ */
+class I2cSimDevice {
+private:
+    uint32_t seed;
+public:
+    uint8_t address;                  // 7 bit.
+    uint16_t stretchUs = 0;           // Added to every byte.
+    uint16_t nackNext = 0;            // FAULTS: the next n times.
+    uint16_t hangNext = 0;
+    uint16_t glitchNext = 0;
+    uint8_t nackPercent = 0;          // FAULTS: at random.
+    uint8_t hangPercent = 0;
+    uint8_t glitchPercent = 0;
+    uint32_t addressed = 0;           // Counters: address phases ACKed ..
+    uint32_t nacked = 0;              // .. NACKed (faults, or the device's own choice)
+    uint32_t hung = 0;
+    uint32_t glitched = 0;
+    I2cSimDevice(uint8_t address, uint32_t seed = 1) : seed(seed), address(address) {};
+    virtual ~I2cSimDevice() {};
+    uint16_t nextRandom();            // 0 .. 32767, from our own seed.
+    byte chance(uint8_t percent);     // true percent% of the time.
+    // What the slave sees. Return true to ACK.
+    virtual byte start(byte reading) = 0;
+    virtual byte received(uint8_t data) = 0;
+    virtual uint8_t sent() = 0;
+    virtual void stopped() {};
+};
+
+/**
+ * The TWI, and the bus. See DETAILS.
+ */
+class I2cSim : public HostPeripheral {
+private:
+    enum { IDLE, ADDRESSING, TRANSMITTING, RECEIVING, REJECTED };
+    enum { NONE, START, ADDRESS, WRITE, READ };
+    I2cSimDevice *devices[I2C_SIM_DEVICES];
+    uint8_t deviceCount = 0;
+    uint8_t mode = IDLE;
+    uint8_t step = NONE;              // Under way ..
+    uint64_t stepDueUs = I2C_SIM_NEVER; // .. done then (never, if a device hung).
+    byte acknowledging = false;       // TWEA when a READ step started.
+    byte glitching = false;           // This step ends in lost arbitration.
+    byte busOwned = false;            // We've sent a START and no STOP.
+    I2cSimDevice *selected = 0;       // ACKed its address, since the last START.
+    I2cSimDevice *holding = 0;        // Hung, then abandoned, so holding SDA low ..
+    uint8_t heldClocks = 0;           // .. for this many more SCL clocks.
+    static I2cSim *instance;
+    static void twcrWritten(HostRegister *reg, uint8_t old);
+    static void ddrcWritten(HostRegister *reg, uint8_t old);
+    static uint8_t pincRead(const HostRegister *reg);
+    void command(uint8_t twcr, uint8_t old);
+    void begin(uint8_t newStep, uint32_t bytes, I2cSimDevice *device);
+    void finish(uint8_t status);
+    I2cSimDevice *find(uint8_t address);
+public:
+    uint32_t sclHz = 0;               // Of the last step.
+    uint32_t recoveryClocks = 0;      // SCL clocks toggled by hand (bus recovery).
+    uint32_t resets = 0;              // Times the TWI was turned off part way through a transaction.
+    I2cSim();
+    ~I2cSim();
+    void add(I2cSimDevice *device);
+    byte sdaHeld() { return holding != 0; };
+    virtual uint64_t dueUs() { return stepDueUs; };
+    virtual void fire();
+};
+
+/**
+ * See DEVICES.
+ */
+class LidarLiteSim : public I2cSimDevice {
+private:
+    uint8_t registers[0x80];
+    uint8_t pointer = 0;
+    byte pointerSet = false;
+    uint64_t busyUntilUs = 0;
+    uint16_t acquiredCm = 0;
+    void acquired();
+public:
+    uint32_t acquisitionUs = LIDARLITE_SIM_ACQUISITION_US;
+    uint16_t rangeCm = 500;
+    uint16_t (*range)(uint64_t nowUs) = 0; // If set, the range at the start of each acquisition (instead of rangeCm).
+    uint32_t acquisitions = 0;
+    LidarLiteSim(uint8_t address = LIDARLITE_SIM_ADDRESS, uint32_t seed = 1);
+    byte busy() { return hostNowUs < busyUntilUs; };
+    virtual byte start(byte reading);
+    virtual byte received(uint8_t data);
+    virtual uint8_t sent();
+};
+
+/**
+ * What the LSM9DS0 is feeling - level, Z up, turning about Z (counter-clockwise from above, for positive rates). See DEVICES.
+ */
+struct Lsm9ds0Motion {
+    float yawRateDps = 0.0f;
+    float gyroBiasDps[3] = { 0.0f, 0.0f, 0.0f };
+    float gyroNoiseDps = 0.1f;        // Peak, uniform, from each half's own seed - a real sensor never reads the same
+    float accelNoiseMg = 2.0f;        // twice running (see Imu HEALTH).
+    float magNoiseMgauss = 2.0f;
+    float horizontalGauss = 0.25f;    // The Earth's field, along X when yaw is 0 ..
+    float downGauss = 0.45f;          // .. and down.
+    float yawDegrees(uint64_t nowUs) { return yawRateDps * (float) (nowUs * 1e-6); };
+};
+
+class Lsm9ds0GyroSim : public I2cSimDevice, public HostPeripheral {
+private:
+    uint8_t registers[0x40];
+    uint8_t pointer = 0;
+    byte pointerSet = false;
+    int16_t fifo[LSM9DS0_SIM_FIFO][3];
+    uint8_t fifoHead = 0;
+    uint8_t fifoCount = 0;
+    byte overrun = false;
+    int16_t latest[3] = { 0, 0, 0 };
+    uint64_t nextSampleNs = I2C_SIM_NEVER;
+    void sample();
+    const int16_t *output();
+    void written(uint8_t reg);
+public:
+    Lsm9ds0Motion *motion;
+    uint8_t drdyInterrupt;            // INTn DRDY_G is wired to, or LSM9DS0_SIM_NO_INTERRUPT.
+    uint32_t samples = 0;             // Produced ..
+    uint32_t overruns = 0;            // .. and lost off a full FIFO.
+    Lsm9ds0GyroSim(Lsm9ds0Motion *motion, uint8_t drdyInterrupt = 0, uint32_t seed = 1);
+    ~Lsm9ds0GyroSim();
+    uint16_t dataRateHz();            // 0 if powered down.
+    virtual byte start(byte reading);
+    virtual byte received(uint8_t data);
+    virtual uint8_t sent();
+    virtual uint64_t dueUs() { return nextSampleNs == I2C_SIM_NEVER ? I2C_SIM_NEVER : nextSampleNs / 1000; };
+    virtual void fire();
+};
+
+class Lsm9ds0XmSim : public I2cSimDevice {
+private:
+    uint8_t registers[0x40];
+    uint8_t pointer = 0;
+    byte pointerSet = false;
+    int16_t reading(uint8_t reg);
+public:
+    Lsm9ds0Motion *motion;
+    Lsm9ds0XmSim(Lsm9ds0Motion *motion, uint32_t seed = 1);
+    virtual byte start(byte reading);
+    virtual byte received(uint8_t data);
+    virtual uint8_t sent();
+};
+
+#endif /* i2csim_h */
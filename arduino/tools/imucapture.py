@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+NAME
+    imucapture.py
+PURPOSE
+    Host side of the Imu's binary capture mode ("UC" - see CAPTURE in library/Imu.h).
+    Asks the Arduino for a capture, follows it to the capture baud rate, decodes the frames, and writes one CSV line
+    per gyro sample, for tuning filters offline against real data.
+USAGE
+    imucapture.py /dev/ttyUSB0 -n 5000 -o run1.csv      # 5000 gyro samples
+    imucapture.py /dev/ttyUSB0 -t 20000 -o run1.csv     # 20 seconds
+OUTPUT
+    Comment lines ("# key=value") with the sample period, scales and gyro bias from the header frame, then
+        t_us,gx,gy,gz,ax,ay,az,mx,my,mz,mag_fresh
+    Raw counts, NWU, exactly as the Ahrs sees them. Multiply by the scales for dps, m/s^2 and gauss.
+    Accel is read once per batch, so it repeats within a batch. mag_fresh is 1 on the sample a new magnetometer reading
+    was fused with (the latest of its batch); otherwise the mag columns hold the previous reading.
+    Timestamps of earlier samples in a batch are worked back from the latest, one sample period apart.
+DEPENDENCIES
+    pyserial
+AUTHOR
+    Scott BARNES 2019. IP freely on non-commercial applications.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+HOST_BAUD = 19200           # IMU_HOST_BAUD
+SYNC = b'\xa5\x5a'
+
+
+class FrameReader:
+    """Pulls good frames out of a byte stream, skipping text lines and anything with a bad checksum."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.badFrames = 0
+
+    def feed(self, data):
+        self.buffer.extend(data)
+        frames = []
+        while True:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                del self.buffer[:-1]      # Keep a trailing 0xA5, in case it's half a sync.
+                return frames
+            if len(self.buffer) < start + 4:
+                del self.buffer[:start]
+                return frames
+            frameType = self.buffer[start + 2]
+            length = self.buffer[start + 3]
+            end = start + 4 + length + 1
+            if len(self.buffer) < end:
+                del self.buffer[:start]
+                return frames
+            payload = bytes(self.buffer[start + 4:end - 1])
+            checksum = (frameType + length + sum(payload)) & 0xFF
+            if checksum == self.buffer[end - 1] and chr(frameType) in 'HBE':
+                frames.append((chr(frameType), payload))
+                del self.buffer[:end]
+            else:
+                self.badFrames += 1
+                del self.buffer[:start + 1]  # Not a frame after all - look for the next sync.
+
+
+class CsvWriter:
+    """Turns decoded frames into CSV lines."""
+
+    def __init__(self, out):
+        self.out = out
+        self.periodUs = 0
+        self.mag = (0, 0, 0)
+        self.samples = 0
+        self.finished = False
+
+    def frame(self, frameType, payload):
+        if frameType == 'H':
+            periodUs, gyroScale, accelScale, magScale, bx, by, bz = struct.unpack('<Ifffhhh', payload)
+            self.periodUs = periodUs
+            self.out.write('# sample_period_us=%d\n' % periodUs)
+            self.out.write('# gyro_scale_dps=%.8g\n# accel_scale_mps2=%.8g\n# mag_scale_gauss=%.8g\n' % (gyroScale, accelScale, magScale))
+            self.out.write('# gyro_bias=%d,%d,%d\n' % (bx, by, bz))
+            self.out.write('t_us,gx,gy,gz,ax,ay,az,mx,my,mz,mag_fresh\n')
+        elif frameType == 'B':
+            timestampUs, magFresh, count = struct.unpack_from('<IBB', payload, 0)
+            offset = 6
+            accel = struct.unpack_from('<hhh', payload, offset)
+            offset += 6
+            newMag = self.mag
+            if magFresh:
+                newMag = struct.unpack_from('<hhh', payload, offset)
+                offset += 6
+            for i in range(count):
+                gyro = struct.unpack_from('<hhh', payload, offset + 6 * i)
+                t = (timestampUs - (count - 1 - i) * self.periodUs) & 0xFFFFFFFF
+                fresh = 1 if magFresh and i == count - 1 else 0
+                mag = newMag if i == count - 1 else self.mag
+                self.out.write('%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n' % ((t,) + gyro + accel + mag + (fresh,)))
+            self.mag = newMag
+            self.samples += count
+        elif frameType == 'E':
+            (sent,) = struct.unpack('<I', payload)
+            if sent != self.samples:
+                sys.stderr.write('Arduino sent %d samples, we decoded %d\n' % (sent, self.samples))
+            self.finished = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Capture raw IMU samples from the Arduino to CSV.')
+    parser.add_argument('port')
+    parser.add_argument('-n', '--samples', type=int, default=0, help='gyro samples to capture')
+    parser.add_argument('-t', '--ms', type=int, default=0, help='milliseconds to capture for')
+    parser.add_argument('-o', '--output', default='-', help='CSV file (default stdout)')
+    parser.add_argument('--settle', type=float, default=5.0, help='seconds to let the Arduino set up after the port opens (it resets)')
+    args = parser.parse_args()
+
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    port = serial.Serial(args.port, HOST_BAUD, timeout=0.5)
+    time.sleep(args.settle)
+    port.reset_input_buffer()
+    command = 'UCT%d' % args.ms if args.ms > 0 else 'UC%d' % args.samples
+    port.write((command + '\n').encode('ascii'))
+
+    # Wait for "UCbaud", then follow.
+    deadline = time.time() + 5
+    while True:
+        line = port.readline().decode('ascii', 'replace').strip()
+        if line.startswith('UC') and line[2:].isdigit():
+            port.baudrate = int(line[2:])  # Changes the open port - reopening would reset the Arduino.
+            break
+        if time.time() > deadline:
+            sys.exit('No "UC" reply - is this a kangarouter?')
+
+    reader = FrameReader()
+    writer = CsvWriter(out)
+    lastDataAt = time.time()
+    while not writer.finished and time.time() - lastDataAt < 3:
+        data = port.read(256)
+        if data:
+            lastDataAt = time.time()
+        for frameType, payload in reader.feed(data):
+            writer.frame(frameType, payload)
+    port.baudrate = HOST_BAUD
+    if reader.badFrames:
+        sys.stderr.write('%d bad frames skipped\n' % reader.badFrames)
+    sys.stderr.write('%d samples captured\n' % writer.samples)
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,101 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     imulog.h
+ * PURPOSE
+ *     Loads an imucapture.py recording into memory, converted to the units and dts Ahrs would feed its filter, so the
+ *     host tools (ahrsbench, ahrstune) can replay it through the library's filters - as many times as they like.
+ * FORMAT
+ *     See imucapture.py. One extra, optional, column is understood: yaw_ref - the true yaw, degrees CW of (magnetic) North,
+ *     for recordings (or simulations) that know it. Without it, the tools fall back to the magnetometer and loop closure.
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#ifndef imulog_h
+#define imulog_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define AHRS_MAX_DT_US 250000L    /* As Ahrs.h - longer gaps are integrated as one nominal period */
+
+struct ImuLog {
+    double periodUs = 0.0, gyroScale = 0.0, accelScale = 0.0, magScale = 0.0;
+    size_t samples = 0;
+    std::vector<float> g[3], a[3], m[3];  // dps, m/s^2, gauss. NWU. One vector per axis, so the scaling loop vectorises.
+    std::vector<float> dt;                // Seconds, worked out as Ahrs::sampleDt() does.
+    std::vector<float> tS;                // Seconds since the first sample.
+    std::vector<uint8_t> magFresh;
+    std::vector<float> yawRef;            // Empty unless the recording has a yaw_ref column.
+
+    /**
+     * @return false (and an explanation in error) if the file can't be read or isn't an imucapture.py recording.
+     */
+    bool load(const char *path, char *error, size_t errorSize) {
+        FILE *in = fopen(path, "r");
+        if (in == NULL) {
+            snprintf(error, errorSize, "%s: can't open", path);
+            return false;
+        }
+        std::vector<int16_t> raw[9];
+        std::vector<uint32_t> t;
+        char line[256];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (line[0] == '#') {
+                sscanf(line, "# sample_period_us=%lf", &periodUs);
+                sscanf(line, "# gyro_scale_dps=%lf", &gyroScale);
+                sscanf(line, "# accel_scale_mps2=%lf", &accelScale);
+                sscanf(line, "# mag_scale_gauss=%lf", &magScale);
+                continue;
+            }
+            unsigned long us;
+            int r[9], fresh;
+            float ref;
+            int fields = sscanf(line, "%lu,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%f", &us, &r[0], &r[1], &r[2], &r[3], &r[4], &r[5],
+                                &r[6], &r[7], &r[8], &fresh, &ref);
+            if (fields < 11)
+                continue; // The column header line, or junk.
+            t.push_back((uint32_t) us);
+            for (int i = 0; i < 9; i++)
+                raw[i].push_back((int16_t) r[i]);
+            magFresh.push_back((uint8_t) fresh);
+            if (fields == 12)
+                yawRef.push_back(ref);
+        }
+        fclose(in);
+        if (gyroScale == 0.0 || t.empty()) {
+            snprintf(error, errorSize, "%s: no scales or no samples - not an imucapture.py file?", path);
+            return false;
+        }
+        if (yawRef.size() != t.size())
+            yawRef.clear();
+        samples = t.size();
+        // Counts -> units. Plain loops over contiguous arrays, which the compiler turns into SIMD (-O3).
+        float scales[3] = { (float) gyroScale, (float) accelScale, (float) magScale };
+        for (int i = 0; i < 9; i++) {
+            std::vector<float> &out = i < 3 ? g[i] : i < 6 ? a[i - 3] : m[i - 6];
+            out.resize(samples);
+            const int16_t *in16 = raw[i].data();
+            float *outF = out.data();
+            float scale = scales[i / 3];
+            for (size_t j = 0; j < samples; j++)
+                outF[j] = in16[j] * scale;
+        }
+        dt.resize(samples);
+        tS.resize(samples);
+        double elapsedUs = 0.0;
+        for (size_t j = 0; j < samples; j++) {
+            uint32_t deltaUs = j == 0 ? 0 : t[j] - t[j - 1];
+            double us = (j == 0 || deltaUs == 0 || deltaUs > AHRS_MAX_DT_US) ? periodUs : deltaUs;
+            elapsedUs += us;
+            dt[j] = us / 1000000.0;
+            tS[j] = elapsedUs / 1000000.0;
+        }
+        return true;
+    }
+};
+
+#endif /* imulog_h */
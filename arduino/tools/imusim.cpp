@@ -0,0 +1,207 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     imusim.cpp
+ * PURPOSE
+ *     Runs the kangarouter's IMU stack - Lsm9ds0Imu and Ahrs<Lsm9ds0Imu>, set up and looped as the sketch does - on the host,
+ *     against a simulated LSM9DS0 (see i2csim.h) turning at a steady rate, in simulated time. For checking that every gyro
+ *     sample gets through the FIFO to the filter, that the heading follows the turn, and what the I2C error paths (and a
+ *     busy lidar on the same bus) do to both - repeatably.
+ * USAGE
+ *     imusim [-t seconds] [-y yaw_dps] [-n nack%] [-h hang%] [-g glitch%] [-s stretch_us] [-l] [-d] [-r seed] [-v]
+ *     Faults are the gyro's, at random (see i2csim.h FAULTS). -l puts a LidarLite on the bus too, measuring and reading
+ *     back to back (each transaction's callback submits the next, as fast as the bus allows) at the default priority.
+ *     -d leaves DRDY_G unwired, though the sketch still asks for it (useDataReadyPin()) - the Ahrs should fall back to polling.
+ *     -t defaults to 10, -y to 30 (counter-clockwise, seen from above), -r to 1. -v echoes the sketch's own output.
+ *     The first IMUSIM_SETTLE_S seconds are left out of the yaw figures, while the filter pulls in from its start-up guess.
+ * BUILD
+ *     From this directory:
+ *         g++ -O2 -DARDUINO=185 -Ihost -I../library imusim.cpp i2csim.cpp host/Arduino.cpp ../library/I2cBus.cpp \
+ *             ../library/I2cWire.cpp ../library/Adafruit_LSM9DS0.cpp ../library/Lsm9ds0Imu.cpp ../library/Imu.cpp \
+ *             ../library/MagCalibration.cpp ../library/Ahrs.cpp ../library/MadgwickAHRS.cpp ../library/MahonyAHRS.cpp \
+ *             ../library/ComplementaryAHRS.cpp ../library/MadgwickFixedAHRS.cpp -o imusim
+ * OUTPUT
+ *     imu seconds samples overruns
+ *         samples  - gyro samples the simulated sensor produced; overruns - lost off its full FIFO.
+ *     yaw turned measured error
+ *         Degrees clockwise (the Ahrs's sense) since IMUSIM_SETTLE_S: what the sensor turned, what getYawCentidegrees()
+ *         moved, and the difference.
+ *     gyro addressed nacked hung glitched
+ *     bus resets recovery_clocks
+ *     lidar acquisitions addressed nacked (with -l)
+ *     Then the Imu's own "UD", "UH", "UP" and "UI" lines (see Imu.h, Lsm9ds0Imu.h).
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "i2csim.h"
+
+#include "I2cBus.h"
+#include "Lsm9ds0Imu.h"
+#include "Ahrs.h"
+
+#define IMUSIM_SETTLE_S        2.0    /* Seconds before the yaw figures start */
+#define IMUSIM_DRDY_PIN        2      /* As the kangarouter: DRDY_G on D2 .. */
+#define IMUSIM_DRDY_INTERRUPT  0      /* .. which is INT0 */
+#define IMUSIM_NO_INTERRUPT    0xFF   /* DRDY_G not wired (-d) */
+#define IMUSIM_LIDAR_DEADLINE_US 5000 /* As lidarlitesweeper */
+#define IMUSIM_OUTPUT          4096   /* Bytes of the sketch's output we hold, between looks */
+
+Lsm9ds0Imu imu;
+Ahrs<Lsm9ds0Imu> ahrs(&imu);
+
+static byte echo = false;
+static char output[IMUSIM_OUTPUT];
+static uint32_t outputLength = 0;
+
+// The lidar traffic (-l). See USAGE.
+static uint8_t measureValue = 0x04;
+static uint8_t rangeBytes[2];
+static I2cTransaction measureTransaction = { LIDARLITE_SIM_ADDRESS, 0x00, 0, &measureValue, 1, 0, 0, 0, 0, 0, 0, 0L };
+static I2cTransaction rangeTransaction = { LIDARLITE_SIM_ADDRESS, 0x8F, I2C_BUS_READ, rangeBytes, 2, 0, 0, 0, 0, 0, 0, 0L };
+
+/**
+ * From the TWI interrupt. A range read NACKed while the lidar is acquiring is just tried again.
+ */
+static void lidarFinished(I2cTransaction *transaction) {
+    if (transaction == &measureTransaction && transaction->status != 0)
+        i2cBus.submit(&measureTransaction);
+    else if (transaction == &measureTransaction || transaction->status != 0)
+        i2cBus.submit(&rangeTransaction);
+    else
+        i2cBus.submit(&measureTransaction);
+}
+
+static void simSerialOut(uint8_t c) {
+    if (echo)
+        putchar(c);
+    if (outputLength < IMUSIM_OUTPUT)
+        output[outputLength++] = c;
+}
+
+/**
+ * Runs a "U" command, as the sketch would pass it on, and prints the lines that come back.
+ */
+static void simCommand(const char *command) {
+    char commandLine[16];
+    strncpy(commandLine, command, sizeof(commandLine) - 1);
+    commandLine[sizeof(commandLine) - 1] = '\0';
+    outputLength = 0;
+    imu.command(commandLine);
+    fwrite(output, 1, outputLength, stdout);
+    outputLength = 0;
+}
+
+/**
+ * Clockwise (Ahrs) yaw change from before to after, centidegrees, taking the shorter way round.
+ */
+static int32_t yawStep(int32_t before, int32_t after) {
+    int32_t step = after - before;
+    if (step > 18000)
+        step -= 36000;
+    else if (step < -18000)
+        step += 36000;
+    return step;
+}
+
+int main(int argc, char **argv) {
+    double seconds = 10.0;
+    float yawRateDps = 30.0f;
+    uint32_t seed = 1;
+    uint8_t nackPercent = 0, hangPercent = 0, glitchPercent = 0;
+    uint16_t stretchUs = 0;
+    byte withLidar = false;
+    byte dataReadyWired = true;
+    int option;
+    while ((option = getopt(argc, argv, "t:y:n:h:g:s:ldr:v")) != -1) {
+        switch (option) {
+        case 't': seconds = atof(optarg); break;
+        case 'y': yawRateDps = atof(optarg); break;
+        case 'n': nackPercent = atoi(optarg); break;
+        case 'h': hangPercent = atoi(optarg); break;
+        case 'g': glitchPercent = atoi(optarg); break;
+        case 's': stretchUs = atoi(optarg); break;
+        case 'l': withLidar = true; break;
+        case 'd': dataReadyWired = false; break;
+        case 'r': seed = strtoul(optarg, NULL, 10); break;
+        case 'v': echo = true; break;
+        default:
+            fprintf(stderr, "usage: imusim [-t seconds] [-y yaw_dps] [-n nack%%] [-h hang%%] [-g glitch%%] [-s stretch_us] [-l] [-d] [-r seed] [-v]\n");
+            return 2;
+        }
+    }
+    Lsm9ds0Motion motion;
+    motion.yawRateDps = yawRateDps;
+    Lsm9ds0GyroSim gyro(&motion, dataReadyWired ? IMUSIM_DRDY_INTERRUPT : IMUSIM_NO_INTERRUPT, seed);
+    gyro.nackPercent = nackPercent;
+    gyro.hangPercent = hangPercent;
+    gyro.glitchPercent = glitchPercent;
+    gyro.stretchUs = stretchUs;
+    Lsm9ds0XmSim xm(&motion, seed + 1);
+    LidarLiteSim lidar(LIDARLITE_SIM_ADDRESS, seed + 2);
+    I2cSim bus;
+    bus.add(&gyro);
+    bus.add(&xm);
+    if (withLidar)
+        bus.add(&lidar);
+    hostSerialOut = simSerialOut;
+
+    // As the kangarouter's setup().
+    Serial.begin(IMU_HOST_BAUD);
+    imu.setup();
+    imu.useDataReadyPin(IMUSIM_DRDY_PIN, IMUSIM_DRDY_INTERRUPT);
+    imu.setReportInterval(0);
+    ahrs.setup();
+    if (withLidar) {
+        i2cBus.setDevice(LIDARLITE_SIM_ADDRESS, 0, IMUSIM_LIDAR_DEADLINE_US);
+        measureTransaction.callback = lidarFinished;
+        rangeTransaction.callback = lidarFinished;
+        i2cBus.submit(&measureTransaction);
+    }
+
+    uint64_t startUs = hostNowUs;
+    uint64_t settleUs = startUs + (uint64_t) (IMUSIM_SETTLE_S * 1e6);
+    uint64_t endUs = startUs + (uint64_t) (seconds * 1e6);
+    byte settled = false;
+    uint64_t settledAtUs = 0;
+    int32_t yaw = 0;
+    int64_t measuredCentidegrees = 0;
+    while (hostNowUs < endUs) {
+        uint32_t now = millis();
+        imu.loop(now);
+        ahrs.loop(now);
+        int32_t latest = ahrs.getYawCentidegrees();
+        if (settled)
+            measuredCentidegrees += yawStep(yaw, latest);
+        else if (hostNowUs >= settleUs) {
+            settled = true;
+            settledAtUs = hostNowUs;
+        }
+        yaw = latest;
+        outputLength = 0;
+    }
+    measureTransaction.callback = 0; // Nothing more goes on the bus (the reports below don't look at the clock).
+    rangeTransaction.callback = 0;
+    double elapsed = (hostNowUs - startUs) * 1e-6;
+    double turned = settled ? -(motion.yawDegrees(hostNowUs) - motion.yawDegrees(settledAtUs)) : 0.0;
+    double measured = measuredCentidegrees / 100.0;
+
+    echo = false;
+    printf("imu %.1f %u %u\n", elapsed, gyro.samples, gyro.overruns);
+    printf("yaw %.1f %.1f %.1f\n", turned, measured, measured - turned);
+    printf("gyro %u %u %u %u\n", gyro.addressed, gyro.nacked, gyro.hung, gyro.glitched);
+    printf("bus %u %u\n", bus.resets, bus.recoveryClocks);
+    if (withLidar)
+        printf("lidar %u %u %u\n", lidar.acquisitions, lidar.addressed, lidar.nacked);
+    simCommand("UD");
+    simCommand("UH");
+    simCommand("UP");
+    simCommand("UI");
+    return 0;
+}
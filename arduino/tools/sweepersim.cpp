@@ -0,0 +1,192 @@
+//-*- mode: c -*-
+/*
+ * NAME
+ *     sweepersim.cpp
+ * PURPOSE
+ *     Runs the lidarlitesweeper sketch - the real one, setup() and loop() as on the Nano - on the host, against a simulated
+ *     LidarLite v1 (see i2csim.h), in simulated time. For benchmarking the sweep (readings a second, time a reading) and
+ *     for driving its I2C error paths on purpose: every fault, and every run, is repeatable.
+ * USAGE
+ *     sweepersim [-t seconds] [-n nack%] [-h hang%] [-g glitch%] [-s stretch_us] [-a acquisition_us] [-r seed] [-v]
+ *     Faults are the LidarLite's, at random (see i2csim.h FAULTS) - on top of the NACKs it gives of its own accord while
+ *     acquiring. -t defaults to 10, -a to LIDARLITE_SIM_ACQUISITION_US, -r to 1. -v echoes the sketch's own output.
+ *     The simulated turret sits in the middle of a 6 x 4m room, so the true range changes with the angle.
+ * BUILD
+ *     From this directory:
+ *         g++ -O2 -DARDUINO=185 -Ihost -I../library sweepersim.cpp i2csim.cpp host/Arduino.cpp ../library/I2cBus.cpp \
+ *             -o sweepersim
+ * OUTPUT
+ *     sweeper seconds readings per_second errors stale max_reading_us syncs state
+ *         errors  - readings sent as 0 (the range read failed).
+ *         stale   - readings sent without a new acquisition behind them (the measure command failed, so the range is the
+ *                   last one again).
+ *         max_reading_us - longest loop() while working - the slowest reading, retries and all.
+ *         state   - working, or stopped (the sketch gave up on the lidar).
+ *     lidar acquisitions addressed nacked hung glitched
+ *     bus resets recovery_clocks
+ *     Then the sketch's own "LI" I2C statistics lines (see I2cBus.h STATISTICS).
+ * AUTHOR
+ *     Scott BARNES 2019. IP freely on non-commercial applications.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "i2csim.h"
+
+#include "../lidarlitesweeper/lidarlitesweeper.ino"
+
+#define SIM_STEPS_PER_TURN   400   /* Half stepping (the sketch sets MS1) a 200 step motor */
+#define SIM_INTERRUPTER_STEPS  4   /* The photo-interrupter's slot */
+#define SIM_ROOM_X_CM        300   /* Half the room */
+#define SIM_ROOM_Y_CM        200
+#define SIM_OUTPUT         65536   /* Bytes of the sketch's output we hold, between looks */
+
+static uint32_t simSteps = 0;
+static byte echo = false;
+static uint8_t output[SIM_OUTPUT];
+static uint32_t outputLength = 0;
+
+/**
+ * The stepper: count STEP pulses, and show the interrupter once a turn.
+ */
+static void simPin(uint8_t pin, uint8_t value) {
+    if (pin == STEPPER_MOTOR_STEP_PIN && value == HIGH) {
+        simSteps++;
+        hostSetPin(INTERRUPTER_PIN, simSteps % SIM_STEPS_PER_TURN < SIM_INTERRUPTER_STEPS ? HIGH : LOW);
+    }
+}
+
+/**
+ * Distance from the middle of the room to the wall the lidar is pointing at.
+ */
+static uint16_t simRange(uint64_t nowUs) {
+    double angle = 2.0 * PI * (simSteps % SIM_STEPS_PER_TURN) / SIM_STEPS_PER_TURN;
+    double toX = fabs(cos(angle)) > 1e-6 ? SIM_ROOM_X_CM / fabs(cos(angle)) : 1e9;
+    double toY = fabs(sin(angle)) > 1e-6 ? SIM_ROOM_Y_CM / fabs(sin(angle)) : 1e9;
+    return (uint16_t) (toX < toY ? toX : toY);
+}
+
+static void simSerialOut(uint8_t c) {
+    if (echo)
+        putchar(c);
+    if (outputLength < SIM_OUTPUT)
+        output[outputLength++] = c;
+}
+
+/**
+ * What the sketch sent since we last looked. Distance packets are "L", two 6 bit halves (+ 32), "\n"; info packets "L",
+ * a letter, "\n"; anything else is a line of text.
+ */
+struct SimOutput {
+    uint32_t distances = 0;
+    uint32_t zeros = 0;
+    uint32_t syncs = 0;
+    byte failed = false;
+    void parse(byte printLines) {
+        uint32_t i = 0;
+        while (i < outputLength) {
+            if (output[i] == 'L' && i + 2 < outputLength && output[i + 2] == '\n') {
+                i += 3; // Info.
+            } else if (output[i] == 'L' && i + 3 < outputLength) {
+                int distance = ((output[i + 1] - 32) << 6) | (output[i + 2] - 32);
+                distances++;
+                if (distance == 0)
+                    zeros++;
+                i += 4;
+            } else {
+                uint32_t end = i;
+                while (end < outputLength && output[end] != '\n')
+                    end++;
+                if (end - i == 1 && output[i] == LD_SYNCHRONIZE)
+                    syncs++;
+                if (end - i == 1 && output[i] == LD_LIDAR_FAIL)
+                    failed = true;
+                if (printLines && output[i] == 'I')
+                    printf("%.*s\n", (int) (end - i), (const char *) output + i);
+                i = end + 1;
+            }
+        }
+        outputLength = 0;
+    }
+};
+
+int main(int argc, char **argv) {
+    double seconds = 10.0;
+    uint32_t seed = 1;
+    uint8_t nackPercent = 0, hangPercent = 0, glitchPercent = 0;
+    uint16_t stretchUs = 0;
+    uint32_t acquisitionUs = LIDARLITE_SIM_ACQUISITION_US;
+    int option;
+    while ((option = getopt(argc, argv, "t:n:h:g:s:a:r:v")) != -1) {
+        switch (option) {
+        case 't': seconds = atof(optarg); break;
+        case 'n': nackPercent = atoi(optarg); break;
+        case 'h': hangPercent = atoi(optarg); break;
+        case 'g': glitchPercent = atoi(optarg); break;
+        case 's': stretchUs = atoi(optarg); break;
+        case 'a': acquisitionUs = atol(optarg); break;
+        case 'r': seed = strtoul(optarg, NULL, 10); break;
+        case 'v': echo = true; break;
+        default:
+            fprintf(stderr, "usage: sweepersim [-t seconds] [-n nack%%] [-h hang%%] [-g glitch%%] [-s stretch_us] [-a acquisition_us] [-r seed] [-v]\n");
+            return 2;
+        }
+    }
+    LidarLiteSim lidar(LIDARLITE_SIM_ADDRESS, seed);
+    lidar.nackPercent = nackPercent;
+    lidar.hangPercent = hangPercent;
+    lidar.glitchPercent = glitchPercent;
+    lidar.stretchUs = stretchUs;
+    lidar.acquisitionUs = acquisitionUs;
+    lidar.range = simRange;
+    I2cSim bus;
+    bus.add(&lidar);
+    hostPinHook = simPin;
+    hostSerialOut = simSerialOut;
+
+    setup();
+    SimOutput sent;
+    sent.parse(false);
+    hostSerialFeed("\nLG");
+    for (byte i = 0; i < 3; i++)
+        loop(); // Reads "\nLG", one character a loop().
+    sent.parse(false);
+
+    uint64_t startUs = hostNowUs;
+    uint64_t endUs = startUs + (uint64_t) (seconds * 1e6);
+    uint32_t maxReadingUs = 0;
+    uint32_t stale = 0;
+    uint32_t lastAcquisitions = lidar.acquisitions;
+    while (hostNowUs < endUs && state == STATE_WORKING) {
+        uint64_t loopStartUs = hostNowUs;
+        loop();
+        uint32_t loopUs = (uint32_t) (hostNowUs - loopStartUs);
+        if (loopUs > maxReadingUs)
+            maxReadingUs = loopUs;
+        uint32_t distances = sent.distances;
+        sent.parse(false);
+        if (sent.distances != distances) {
+            if (lidar.acquisitions == lastAcquisitions)
+                stale++;
+            lastAcquisitions = lidar.acquisitions;
+        }
+    }
+    double elapsed = (hostNowUs - startUs) * 1e-6;
+    byte working = state == STATE_WORKING;
+
+    echo = false;
+    printf("sweeper %.1f %u %.1f %u %u %u %u %s\n", elapsed, sent.distances, sent.distances / elapsed, sent.zeros, stale,
+           maxReadingUs, sent.syncs, working ? "working" : "stopped");
+    printf("lidar %u %u %u %u %u\n", lidar.acquisitions, lidar.addressed, lidar.nacked, lidar.hung, lidar.glitched);
+    printf("bus %u %u\n", bus.resets, bus.recoveryClocks);
+    hostSerialFeed("\nLS\nLI");
+    for (byte i = 0; i < 6; i++)
+        loop();
+    sent.parse(true);
+    return 0;
+}